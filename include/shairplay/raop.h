@@ -22,6 +22,15 @@ extern "C" {
 #define RAOP_LOG_INFO        6       /* informational */
 #define RAOP_LOG_DEBUG       7       /* debug-level messages */
 
+/* Define concealment modes for lost packets */
+#define RAOP_PLC_SILENCE     0       /* play silence */
+#define RAOP_PLC_REPEAT      1       /* repeat the previous frame */
+#define RAOP_PLC_EXTRAPOLATE 2       /* extend the previous pitch period */
+
+
+/* Histogram buckets, bucket i counts values from 2^(i-1) to below 2^i */
+#define RAOP_METRICS_BUCKETS 32
+
 
 typedef struct raop_s raop_t;
 
@@ -42,14 +51,82 @@ struct raop_callbacks_s {
 	void  (*audio_set_coverart)(void *cls, void *session, const void *buffer, int buflen);
 	void  (*audio_remote_control_id)(void *cls, const char *dacp_id, const char *active_remote_header);
 	void  (*audio_set_progress)(void *cls, void *session, unsigned int start, unsigned int curr, unsigned int end);
+
+	/* Optional, frames written but not yet played by the output, used for scheduling */
+	int   (*audio_get_delay)(void *cls, void *session);
+
+	/* Optional zero-copy output, audio_get_buffer lends sink memory with room for
+	 * frames frames, or returns NULL to fall back to audio_process. The audio is
+	 * decoded straight into it and audio_put_buffer returns it with buflen bytes
+	 * written, which is 0 when no frame was ready */
+	void* (*audio_get_buffer)(void *cls, void *session, int frames);
+	void  (*audio_put_buffer)(void *cls, void *session, void *buffer, int buflen, unsigned int timestamp, unsigned int ltime);
 };
 typedef struct raop_callbacks_s raop_callbacks_t;
 
+typedef struct {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long long buckets[RAOP_METRICS_BUCKETS];
+} raop_histogram_t;
+
+/* Totals over all sessions since raop_init */
+typedef struct {
+	unsigned long long sessions;
+	unsigned long long packets_received;   /* audio packets buffered */
+	unsigned long long packets_resent;     /* of them sent again on request */
+	unsigned long long packets_late;       /* arrived after their frame was output */
+	unsigned long long packets_duplicate;  /* arrived when already buffered */
+	unsigned long long packets_lost;       /* never arrived, concealed */
+	unsigned long long resend_requests;
+	unsigned long long frames_output;
+	unsigned long long frames_dropped;     /* decoded too late to be played in sync */
+	unsigned long long wakeups;            /* wakeups of the session loops */
+	unsigned long long recv_calls;         /* receive syscalls on the UDP sockets */
+	unsigned long long recv_packets;       /* datagrams they returned */
+	unsigned long long log_dropped;        /* messages lost to a full log queue */
+
+	/* Drift correction of the session that last output a frame */
+	long long resample_ratio;              /* output per input frame, 1000000000 is 1.0 */
+	long long resample_error;              /* smoothed playout error, in us */
+
+	raop_histogram_t buffer_fill;          /* frames buffered at each output */
+	raop_histogram_t playout_error;        /* drift steered by the resampler, in us */
+	raop_histogram_t aes_time;             /* ns to decrypt a frame */
+	raop_histogram_t decode_time;          /* ns to decode a frame */
+	raop_histogram_t callback_time;        /* ns spent in the audio callback */
+} raop_metrics_t;
+
 RAOP_API raop_t *raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int *error);
 RAOP_API raop_t *raop_init_from_keyfile(int max_clients, raop_callbacks_t *callbacks, const char *keyfile, int *error);
 
 RAOP_API void raop_set_log_level(raop_t *raop, int level);
+
+/* Messages are queued and the callback is called later from a thread of
+ * the logger, never from the thread that logged. Messages beyond the
+ * queue are dropped and counted in log_dropped. The callback is no longer
+ * called once raop_set_log_callback replaced it or raop_destroy returned. */
 RAOP_API void raop_set_log_callback(raop_t *raop, raop_log_callback_t callback, void *cls);
+RAOP_API void raop_set_buffer_length(raop_t *raop, int packets);
+RAOP_API void raop_set_lazy_decode(raop_t *raop, int enabled);
+RAOP_API void raop_set_plc_mode(raop_t *raop, int mode);
+
+/* Drift between sender and output clock is corrected by resampling 16-bit
+ * sessions, on by default. Frames pass through bit-exact while the
+ * correction is within a small deadband, or always when turned off. */
+RAOP_API void raop_set_resample(raop_t *raop, int enabled);
+RAOP_API void raop_set_worker_threads(raop_t *raop, int workers);
+
+/* Appends the RTSP and RTP traffic of every session to a file, NULL stops.
+ * The replay runs the captured sessions through the handlers and audio
+ * callbacks in the calling thread, at the captured pace or at full speed,
+ * and returns the number of records. Neither works while started. */
+RAOP_API int raop_set_capture_file(raop_t *raop, const char *filename);
+RAOP_API int raop_replay_file(raop_t *raop, const char *filename, int realtime);
+
+/* Lock-free snapshot of the counters, cheap enough to poll */
+RAOP_API void raop_get_metrics(raop_t *raop, raop_metrics_t *metrics);
 
 RAOP_API int raop_start(raop_t *raop, unsigned short *port, const char *hwaddr, int hwaddrlen, const char *password);
 RAOP_API int raop_is_running(raop_t *raop);
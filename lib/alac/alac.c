@@ -42,6 +42,13 @@ static const int host_bigendian = 0;
 
 #include "alac.h"
 
+/* the stereo output kernels have SSE2 and AVX2 versions on x86, they are
+ * compiled with target attributes and picked at runtime */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define ALAC_X86_SIMD
+    #include <immintrin.h>
+#endif
+
 #define _Swap32(v) do { \
                    v = (((v) & 0x000000FF) << 0x18) | \
                        (((v) & 0x0000FF00) << 0x08) | \
@@ -55,6 +62,8 @@ static const int host_bigendian = 0;
 struct {signed int x:24;} se_struct_24;
 #define SignExtend24(val) (se_struct_24.x = val)
 
+static void select_kernels(alac_file *alac);
+
 void alac_free(alac_file *alac) {
     if (alac->predicterror_buffer_a)
         free(alac->predicterror_buffer_a);
@@ -130,89 +139,85 @@ void alac_set_info(alac_file *alac, char *inputbuffer)
       _Swap32(alac->setinfo_8a_rate);
 
   alac_allocate_buffers(alac);
-
+  select_kernels(alac);
 }
 
 /* stream reading */
 
-/* supports reading 1 to 16 bits, in big endian format */
-static uint32_t readbits_16(alac_file *alac, int bits)
+/* the bit reader keeps up to 64 not yet consumed bits of the input in
+ * input_bitcache, most significant bit first. the cache is refilled with
+ * a single 64 bit load, which leaves at least 57 bits available, so any
+ * read of up to 32 bits needs at most one refill. bytes past the end of
+ * the packet read as zeroes, so a corrupt frame cannot make the decoder
+ * read beyond input_buffer_end.
+ */
+static uint64_t read_be64(const unsigned char *ptr)
 {
-    uint32_t result;
-    int new_accumulator;
-
-    result = (alac->input_buffer[0] << 16) |
-             (alac->input_buffer[1] << 8) |
-             (alac->input_buffer[2]);
-
-    /* shift left by the number of bits we've already read,
-     * so that the top 'n' bits of the 24 bits we read will
-     * be the return bits */
-    result = result << alac->input_buffer_bitaccumulator;
-
-    result = result & 0x00ffffff;
-
-    /* and then only want the top 'n' bits from that, where
-     * n is 'bits' */
-    result = result >> (24 - bits);
-
-    new_accumulator = (alac->input_buffer_bitaccumulator + bits);
-
-    /* increase the buffer pointer if we've read over n bytes. */
-    alac->input_buffer += (new_accumulator >> 3);
-
-    /* and the remainder goes back into the bit accumulator */
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-
-    return result;
+#if defined(__GNUC__)
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    if (!host_bigendian)
+        value = __builtin_bswap64(value);
+    return value;
+#else
+    return ((uint64_t)ptr[0] << 56) | ((uint64_t)ptr[1] << 48) |
+           ((uint64_t)ptr[2] << 40) | ((uint64_t)ptr[3] << 32) |
+           ((uint64_t)ptr[4] << 24) | ((uint64_t)ptr[5] << 16) |
+           ((uint64_t)ptr[6] << 8) | ((uint64_t)ptr[7]);
+#endif
 }
 
-/* supports reading 1 to 32 bits, in big endian format */
-static uint32_t readbits(alac_file *alac, int bits)
+static void refillbits(alac_file *alac)
 {
-    int32_t result = 0;
-
-    if (bits > 16)
+    if (alac->input_buffer_end - alac->input_buffer >= 8)
     {
-        bits -= 16;
-        result = readbits_16(alac, 16) << bits;
+        /* the low bits beyond the whole bytes consumed hold the top of
+         * the next byte, which the next refill ORs in again unchanged */
+        int bytes = (63 - alac->input_bitcount) >> 3;
+
+        alac->input_bitcache |= read_be64(alac->input_buffer) >> alac->input_bitcount;
+        alac->input_buffer += bytes;
+        alac->input_bitcount += bytes << 3;
+        return;
     }
 
-    result |= readbits_16(alac, bits);
+    /* near the end of the packet, go byte by byte and pad with zeroes */
+    while (alac->input_bitcount <= 56)
+    {
+        uint64_t byte = 0;
 
-    return result;
+        if (alac->input_buffer < alac->input_buffer_end)
+            byte = *alac->input_buffer++;
+
+        alac->input_bitcache |= byte << (56 - alac->input_bitcount);
+        alac->input_bitcount += 8;
+    }
 }
 
-/* reads a single bit */
-static int readbit(alac_file *alac)
+/* returns the next 0 to 32 bits without consuming them */
+static uint32_t peekbits(alac_file *alac, int bits)
 {
-    int result;
-    int new_accumulator;
-
-    result = alac->input_buffer[0];
-
-    result = result << alac->input_buffer_bitaccumulator;
-
-    result = result >> 7 & 1;
+    if (alac->input_bitcount < bits)
+        refillbits(alac);
 
-    new_accumulator = (alac->input_buffer_bitaccumulator + 1);
-
-    alac->input_buffer += (new_accumulator / 8);
-
-    alac->input_buffer_bitaccumulator = (new_accumulator % 8);
+    /* two shifts so that bits == 0 does not shift by 64 */
+    return (uint32_t)((alac->input_bitcache >> (63 - bits)) >> 1);
+}
 
-    return result;
+static void consumebits(alac_file *alac, int bits)
+{
+    alac->input_bitcache <<= bits;
+    alac->input_bitcount -= bits;
 }
 
-static void unreadbits(alac_file *alac, int bits)
+/* supports reading 0 to 32 bits, in big endian format */
+static uint32_t readbits(alac_file *alac, int bits)
 {
-    int new_accumulator = (alac->input_buffer_bitaccumulator - bits);
+    uint32_t result = peekbits(alac, bits);
 
-    alac->input_buffer += (new_accumulator >> 3);
+    consumebits(alac, bits);
 
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-    if (alac->input_buffer_bitaccumulator < 0)
-        alac->input_buffer_bitaccumulator *= -1;
+    return result;
 }
 
 /* various implementations of count_leading_zero:
@@ -313,19 +318,21 @@ static int32_t entropy_decode_value(alac_file* alac,
                              int k,
                              int rice_kmodifier_mask)
 {
-    int32_t x = 0; // decoded value
+    int32_t x; // decoded value
 
-    // read x, number of 1s before 0 represent the rice value.
-    while (x <= RICE_THRESHOLD && readbit(alac))
-    {
-        x++;
-    }
+    // x is the number of 1s before a 0 and represents the rice value.
+    // the marker bit below the threshold caps the count at
+    // RICE_THRESHOLD + 1, in which case no terminating 0 is read.
+    x = count_leading_zeros(~peekbits(alac, 32) |
+                            (0x80000000u >> (RICE_THRESHOLD + 1)));
 
     if (x > RICE_THRESHOLD)
     {
         // read the number from the bit stream (raw value)
         int32_t value;
 
+        consumebits(alac, x);
+
         value = readbits(alac, readSampleSize);
 
         // mask value
@@ -335,17 +342,23 @@ static int32_t entropy_decode_value(alac_file* alac,
     }
     else
     {
+        consumebits(alac, x + 1);
+
         if (k != 1)
         {
-            int extraBits = readbits(alac, k);
+            int extraBits = peekbits(alac, k);
 
             // x = x * (2^k - 1)
             x *= (((1 << k) - 1) & rice_kmodifier_mask);
 
+            // values of 0 and 1 are coded with one bit less
             if (extraBits > 1)
+            {
                 x += extraBits - 1;
+                consumebits(alac, k);
+            }
             else
-                unreadbits(alac, 1);
+                consumebits(alac, k - 1);
         }
     }
 
@@ -407,7 +420,9 @@ static void entropy_rice_decode(alac_file* alac,
             // note: blockSize is always 16bit
             blockSize = entropy_decode_value(alac, 16, k, rice_kmodifier_mask);
 
-            // got blockSize 0s
+            // got blockSize 0s, but never more than fit in the output
+            if (blockSize > outputSize - outputCount - 1)
+                blockSize = outputSize - outputCount - 1;
             if (blockSize > 0)
             {
                 memset(&outputBuffer[outputCount + 1], 0, blockSize * sizeof(*outputBuffer));
@@ -429,7 +444,240 @@ static void entropy_rice_decode(alac_file* alac,
                                 ((v > 0) ? (1) : \
                                            (0)))
 
-static void predictor_decompress_fir_adapt(int32_t *error_buffer,
+/* computes, stores and returns the next output sample from the
+ * prediction sum, buffer_out points at the oldest sample of the history */
+static int32_t predictor_output(int32_t *buffer_out,
+                                int sum,
+                                int error_val,
+                                int readsamplesize,
+                                int predictor_coef_num,
+                                int predictor_quantitization)
+{
+    int outval;
+
+    outval = (1 << (predictor_quantitization-1)) + sum;
+    outval = outval >> predictor_quantitization;
+    outval = outval + buffer_out[0] + error_val;
+    outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+    buffer_out[predictor_coef_num+1] = outval;
+
+    return outval;
+}
+
+/* adapts the coefficients towards the sign of the prediction error,
+ * returns the number of coefficients that were changed */
+static int predictor_adapt(int32_t *buffer_out,
+                            int error_val,
+                            int16_t *predictor_coef_table,
+                            int predictor_coef_num,
+                            int predictor_quantitization)
+{
+    int predictor_num = predictor_coef_num - 1;
+
+    if (error_val > 0)
+    {
+        while (predictor_num >= 0 && error_val > 0)
+        {
+            int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+            int sign = SIGN_ONLY(val);
+
+            predictor_coef_table[predictor_num] -= sign;
+
+            val *= sign; /* absolute value */
+
+            error_val -= ((val >> predictor_quantitization) *
+                          (predictor_coef_num - predictor_num));
+
+            predictor_num--;
+        }
+    }
+    else if (error_val < 0)
+    {
+        while (predictor_num >= 0 && error_val < 0)
+        {
+            int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+            int sign = - SIGN_ONLY(val);
+
+            predictor_coef_table[predictor_num] -= sign;
+
+            val *= sign; /* neg value */
+
+            error_val -= ((val >> predictor_quantitization) *
+                          (predictor_coef_num - predictor_num));
+
+            predictor_num--;
+        }
+    }
+
+    return predictor_coef_num - 1 - predictor_num;
+}
+
+/* the general case of the adaptive fir, after the warm-up samples */
+static void predictor_fir_adapt_c(int32_t *error_buffer,
+                                  int32_t *buffer_out,
+                                  int output_size,
+                                  int readsamplesize,
+                                  int16_t *predictor_coef_table,
+                                  int predictor_coef_num,
+                                  int predictor_quantitization)
+{
+    int i;
+
+    for (i = predictor_coef_num + 1;
+         i < output_size;
+         i++)
+    {
+        int j;
+        int sum = 0;
+        int error_val = error_buffer[i];
+
+        for (j = 0; j < predictor_coef_num; j++)
+        {
+            sum += (buffer_out[predictor_coef_num-j] - buffer_out[0]) *
+                   predictor_coef_table[j];
+        }
+
+        predictor_output(buffer_out, sum, error_val, readsamplesize,
+                         predictor_coef_num, predictor_quantitization);
+        predictor_adapt(buffer_out, error_val, predictor_coef_table,
+                        predictor_coef_num, predictor_quantitization);
+
+        buffer_out++;
+    }
+}
+
+#ifdef ALAC_X86_SIMD
+/* SSE4.1 version of the general case, specialised at compile time for
+ * the common coefficient counts. the history and the coefficients stay
+ * in registers, coefficient j in the lane of history sample
+ * predictor_coef_num-j, so the dot product is a straight multiply-add.
+ * predictor_adapt still runs sequentially on the table and decides how
+ * many coefficients change, the registers then apply the same signs.
+ * integer addition wraps, so the sum matches the C version in any order.
+ */
+__attribute__((target("sse4.1"), always_inline))
+static inline void predictor_fir_adapt_sse41_n(int32_t *error_buffer,
+                                               int32_t *buffer_out,
+                                               int output_size,
+                                               int readsamplesize,
+                                               int16_t *predictor_coef_table,
+                                               const int predictor_coef_num,
+                                               int predictor_quantitization)
+{
+    const int vectors = predictor_coef_num / 4;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i history[4], coefs[4];
+    int i, j;
+
+    for (j = 0; j < vectors; j++)
+    {
+        __m128i table = _mm_loadl_epi64((const __m128i *)&predictor_coef_table[predictor_coef_num - 4 - 4*j]);
+
+        history[j] = _mm_loadu_si128((const __m128i *)&buffer_out[1 + 4*j]);
+        coefs[j] = _mm_shuffle_epi32(_mm_cvtepi16_epi32(table), _MM_SHUFFLE(0, 1, 2, 3));
+    }
+
+    for (i = predictor_coef_num + 1;
+         i < output_size;
+         i++)
+    {
+        __m128i base = _mm_set1_epi32(buffer_out[0]);
+        __m128i acc = zero;
+        int error_val = error_buffer[i];
+        int32_t outval;
+        int adapted;
+
+        for (j = 0; j < vectors; j++)
+            acc = _mm_add_epi32(acc, _mm_mullo_epi32(_mm_sub_epi32(history[j], base), coefs[j]));
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+        outval = predictor_output(buffer_out, _mm_cvtsi128_si32(acc), error_val,
+                                  readsamplesize, predictor_coef_num,
+                                  predictor_quantitization);
+        adapted = predictor_adapt(buffer_out, error_val, predictor_coef_table,
+                                  predictor_coef_num, predictor_quantitization);
+
+        /* the first 'adapted' lanes move by the sign of the sample
+         * difference times the sign of the error, wrapping like int16 */
+        if (adapted)
+        {
+            __m128i direction = _mm_set1_epi32(error_val);
+            __m128i count = _mm_set1_epi32(adapted);
+
+            for (j = 0; j < vectors; j++)
+            {
+                __m128i diff = _mm_sub_epi32(base, history[j]);
+                __m128i sign = _mm_sub_epi32(_mm_cmpgt_epi32(zero, diff),
+                                             _mm_cmpgt_epi32(diff, zero));
+                __m128i mask = _mm_cmpgt_epi32(count, _mm_add_epi32(lanes, _mm_set1_epi32(4*j)));
+
+                sign = _mm_and_si128(_mm_sign_epi32(sign, direction), mask);
+                coefs[j] = _mm_sub_epi32(coefs[j], sign);
+                coefs[j] = _mm_srai_epi32(_mm_slli_epi32(coefs[j], 16), 16);
+            }
+        }
+
+        /* slide the history by one sample */
+        for (j = 0; j < vectors - 1; j++)
+            history[j] = _mm_alignr_epi8(history[j+1], history[j], 4);
+        history[vectors-1] = _mm_insert_epi32(_mm_srli_si128(history[vectors-1], 4), outval, 3);
+
+        buffer_out++;
+    }
+}
+
+#define PREDICTOR_FIR_ADAPT_SSE41(n) \
+__attribute__((target("sse4.1"))) \
+static void predictor_fir_adapt_sse41_##n(int32_t *error_buffer, \
+                                         int32_t *buffer_out, \
+                                         int output_size, \
+                                         int readsamplesize, \
+                                         int16_t *predictor_coef_table, \
+                                         int predictor_quantitization) \
+{ \
+    predictor_fir_adapt_sse41_n(error_buffer, buffer_out, output_size, \
+                                readsamplesize, predictor_coef_table, \
+                                n, predictor_quantitization); \
+}
+
+/* with 4 coefficients the scalar loop is as fast, and 32 cannot be coded */
+PREDICTOR_FIR_ADAPT_SSE41(8)
+PREDICTOR_FIR_ADAPT_SSE41(16)
+
+static void predictor_fir_adapt_sse41(int32_t *error_buffer,
+                                      int32_t *buffer_out,
+                                      int output_size,
+                                      int readsamplesize,
+                                      int16_t *predictor_coef_table,
+                                      int predictor_coef_num,
+                                      int predictor_quantitization)
+{
+    switch (predictor_coef_num)
+    {
+    case 8:
+        predictor_fir_adapt_sse41_8(error_buffer, buffer_out, output_size,
+                                    readsamplesize, predictor_coef_table,
+                                    predictor_quantitization);
+        break;
+    case 16:
+        predictor_fir_adapt_sse41_16(error_buffer, buffer_out, output_size,
+                                     readsamplesize, predictor_coef_table,
+                                     predictor_quantitization);
+        break;
+    default:
+        predictor_fir_adapt_c(error_buffer, buffer_out, output_size,
+                              readsamplesize, predictor_coef_table,
+                              predictor_coef_num, predictor_quantitization);
+        break;
+    }
+}
+#endif /* ALAC_X86_SIMD */
+
+static void predictor_decompress_fir_adapt(alac_file *alac,
+                                           int32_t *error_buffer,
                                            int32_t *buffer_out,
                                            int output_size,
                                            int readsamplesize,
@@ -482,94 +730,16 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer,
         }
     }
 
-#if 0
-    /* 4 and 8 are very common cases (the only ones i've seen). these
-     * should be unrolled and optimised
-     */
-    if (predictor_coef_num == 4)
-    {
-        /* FIXME: optimised general case */
-        return;
-    }
-
-    if (predictor_coef_table == 8)
-    {
-        /* FIXME: optimised general case */
-        return;
-    }
-#endif
-
-
     /* general case */
     if (predictor_coef_num > 0)
     {
-        for (i = predictor_coef_num + 1;
-             i < output_size;
-             i++)
-        {
-            int j;
-            int sum = 0;
-            int outval;
-            int error_val = error_buffer[i];
-
-            for (j = 0; j < predictor_coef_num; j++)
-            {
-                sum += (buffer_out[predictor_coef_num-j] - buffer_out[0]) *
-                       predictor_coef_table[j];
-            }
-
-            outval = (1 << (predictor_quantitization-1)) + sum;
-            outval = outval >> predictor_quantitization;
-            outval = outval + buffer_out[0] + error_val;
-            outval = SIGN_EXTENDED32(outval, readsamplesize);
-
-            buffer_out[predictor_coef_num+1] = outval;
-
-            if (error_val > 0)
-            {
-                int predictor_num = predictor_coef_num - 1;
-
-                while (predictor_num >= 0 && error_val > 0)
-                {
-                    int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-                    int sign = SIGN_ONLY(val);
-
-                    predictor_coef_table[predictor_num] -= sign;
-
-                    val *= sign; /* absolute value */
-
-                    error_val -= ((val >> predictor_quantitization) *
-                                  (predictor_coef_num - predictor_num));
-
-                    predictor_num--;
-                }
-            }
-            else if (error_val < 0)
-            {
-                int predictor_num = predictor_coef_num - 1;
-
-                while (predictor_num >= 0 && error_val < 0)
-                {
-                    int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-                    int sign = - SIGN_ONLY(val);
-
-                    predictor_coef_table[predictor_num] -= sign;
-
-                    val *= sign; /* neg value */
-
-                    error_val -= ((val >> predictor_quantitization) *
-                                  (predictor_coef_num - predictor_num));
-
-                    predictor_num--;
-                }
-            }
-
-            buffer_out++;
-        }
+        alac->predictor_fir_adapt(error_buffer, buffer_out, output_size,
+                                  readsamplesize, predictor_coef_table,
+                                  predictor_coef_num, predictor_quantitization);
     }
 }
 
-static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
+static void deinterlace_16_c(int32_t *buffer_a, int32_t *buffer_b,
                     int16_t *buffer_out,
                     int numchannels, int numsamples,
                     uint8_t interlacing_shift,
@@ -628,7 +798,7 @@ static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
     }
 }
 
-static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
+static void deinterlace_24_c(int32_t *buffer_a, int32_t *buffer_b,
                     int uncompressed_bytes,
                     int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
                     void *buffer_out,
@@ -706,8 +876,312 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
 
 }
 
+#ifdef ALAC_X86_SIMD
+/* SIMD versions of the stereo kernels. they produce the same output as
+ * the C versions above: samples are truncated, not saturated, and the
+ * weighted reconstruction uses wrapping 32 bit arithmetic. only the
+ * interleaved stereo layout is handled, and the tail of each frame that
+ * does not fill a whole vector is left to the C versions. so are weighted
+ * frames with a shift above 31, where C leaves the result undefined.
+ */
+
+/* number of samples the vector loops may handle */
+static int vector_samples(int numsamples,
+                          uint8_t interlacing_shift,
+                          uint8_t interlacing_leftweight)
+{
+    if (interlacing_leftweight && interlacing_shift > 31)
+        return 0;
+    return numsamples;
+}
+
+/* 32 bit multiply keeping the low half, SSE2 has no pmulld */
+__attribute__((target("sse2")))
+static __m128i mullo_epi32_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* packs the low 24 bits of L0 R0 L1 R1 into the first 12 bytes */
+__attribute__((target("sse2")))
+static __m128i pack_24_sse2(__m128i frames)
+{
+    const __m128i lowlanes = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+    const __m128i highlanes = _mm_set_epi32(0x00FFFFFF, 0, 0x00FFFFFF, 0);
+    __m128i pairs;
+
+    /* six valid bytes at the bottom of each 64 bit half */
+    pairs = _mm_or_si128(_mm_and_si128(frames, lowlanes),
+                         _mm_srli_epi64(_mm_and_si128(frames, highlanes), 8));
+
+    return _mm_or_si128(_mm_move_epi64(pairs),
+                        _mm_slli_si128(_mm_srli_si128(pairs, 8), 6));
+}
+
+__attribute__((target("sse2")))
+static void deinterlace_16_sse2(int32_t *buffer_a, int32_t *buffer_b,
+                    int16_t *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    const __m128i lowmask = _mm_set1_epi32(0xFFFF);
+    int vectorsamples = vector_samples(numsamples, interlacing_shift, interlacing_leftweight);
+    int i = 0;
+
+    if (numsamples <= 0) return;
+
+    if (interlacing_leftweight)
+    {
+        const __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+        const __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+
+        for (; i + 4 <= vectorsamples; i += 4)
+        {
+            __m128i midright = _mm_loadu_si128((const __m128i *)&buffer_a[i]);
+            __m128i difference = _mm_loadu_si128((const __m128i *)&buffer_b[i]);
+            __m128i right, left;
+
+            right = _mm_sub_epi32(midright,
+                                  _mm_sra_epi32(mullo_epi32_sse2(difference, weight), shift));
+            left = _mm_add_epi32(right, difference);
+
+            /* one little endian L/R pair per 32 bit lane */
+            _mm_storeu_si128((__m128i *)&buffer_out[i*2],
+                             _mm_or_si128(_mm_and_si128(left, lowmask),
+                                          _mm_slli_epi32(right, 16)));
+        }
+    }
+    else
+    {
+        for (; i + 4 <= vectorsamples; i += 4)
+        {
+            __m128i left = _mm_loadu_si128((const __m128i *)&buffer_a[i]);
+            __m128i right = _mm_loadu_si128((const __m128i *)&buffer_b[i]);
+
+            _mm_storeu_si128((__m128i *)&buffer_out[i*2],
+                             _mm_or_si128(_mm_and_si128(left, lowmask),
+                                          _mm_slli_epi32(right, 16)));
+        }
+    }
+
+    deinterlace_16_c(buffer_a + i, buffer_b + i, buffer_out + i*2,
+                     numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
+
+__attribute__((target("avx2")))
+static void deinterlace_16_avx2(int32_t *buffer_a, int32_t *buffer_b,
+                    int16_t *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    const __m256i lowmask = _mm256_set1_epi32(0xFFFF);
+    int vectorsamples = vector_samples(numsamples, interlacing_shift, interlacing_leftweight);
+    int i = 0;
+
+    if (numsamples <= 0) return;
+
+    if (interlacing_leftweight)
+    {
+        const __m256i weight = _mm256_set1_epi32(interlacing_leftweight);
+        const __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+
+        for (; i + 8 <= vectorsamples; i += 8)
+        {
+            __m256i midright = _mm256_loadu_si256((const __m256i *)&buffer_a[i]);
+            __m256i difference = _mm256_loadu_si256((const __m256i *)&buffer_b[i]);
+            __m256i right, left;
+
+            right = _mm256_sub_epi32(midright,
+                                     _mm256_sra_epi32(_mm256_mullo_epi32(difference, weight), shift));
+            left = _mm256_add_epi32(right, difference);
+
+            _mm256_storeu_si256((__m256i *)&buffer_out[i*2],
+                                _mm256_or_si256(_mm256_and_si256(left, lowmask),
+                                                _mm256_slli_epi32(right, 16)));
+        }
+    }
+    else
+    {
+        for (; i + 8 <= vectorsamples; i += 8)
+        {
+            __m256i left = _mm256_loadu_si256((const __m256i *)&buffer_a[i]);
+            __m256i right = _mm256_loadu_si256((const __m256i *)&buffer_b[i]);
+
+            _mm256_storeu_si256((__m256i *)&buffer_out[i*2],
+                                _mm256_or_si256(_mm256_and_si256(left, lowmask),
+                                                _mm256_slli_epi32(right, 16)));
+        }
+    }
+
+    deinterlace_16_c(buffer_a + i, buffer_b + i, buffer_out + i*2,
+                     numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
+
+__attribute__((target("sse2")))
+static void deinterlace_24_sse2(int32_t *buffer_a, int32_t *buffer_b,
+                    int uncompressed_bytes,
+                    int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
+                    void *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    const __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+    const __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+    const __m128i ushift = _mm_cvtsi32_si128(uncompressed_bytes * 8);
+    const __m128i umask = _mm_set1_epi32(~(0xFFFFFFFF << (uncompressed_bytes * 8)));
+    uint8_t *out = buffer_out;
+    int vectorsamples = vector_samples(numsamples, interlacing_shift, interlacing_leftweight);
+    int i = 0;
+
+    if (numsamples <= 0) return;
+
+    /* each 16 byte store writes 4 bytes into the next frame, so stop
+     * while there is still at least one frame left for the C version */
+    for (; i + 5 <= vectorsamples; i += 4)
+    {
+        __m128i left = _mm_loadu_si128((const __m128i *)&buffer_a[i]);
+        __m128i right = _mm_loadu_si128((const __m128i *)&buffer_b[i]);
+
+        if (interlacing_leftweight)
+        {
+            __m128i difference = right;
+
+            right = _mm_sub_epi32(left,
+                                  _mm_sra_epi32(mullo_epi32_sse2(difference, weight), shift));
+            left = _mm_add_epi32(right, difference);
+        }
+
+        if (uncompressed_bytes)
+        {
+            __m128i bytes_a = _mm_loadu_si128((const __m128i *)&uncompressed_bytes_buffer_a[i]);
+            __m128i bytes_b = _mm_loadu_si128((const __m128i *)&uncompressed_bytes_buffer_b[i]);
+
+            left = _mm_or_si128(_mm_sll_epi32(left, ushift), _mm_and_si128(bytes_a, umask));
+            right = _mm_or_si128(_mm_sll_epi32(right, ushift), _mm_and_si128(bytes_b, umask));
+        }
+
+        _mm_storeu_si128((__m128i *)&out[i*6],
+                         pack_24_sse2(_mm_unpacklo_epi32(left, right)));
+        _mm_storeu_si128((__m128i *)&out[i*6 + 12],
+                         pack_24_sse2(_mm_unpackhi_epi32(left, right)));
+    }
+
+    deinterlace_24_c(buffer_a + i, buffer_b + i,
+                     uncompressed_bytes,
+                     uncompressed_bytes_buffer_a + i, uncompressed_bytes_buffer_b + i,
+                     out + i*6,
+                     numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
+
+__attribute__((target("avx2")))
+static void deinterlace_24_avx2(int32_t *buffer_a, int32_t *buffer_b,
+                    int uncompressed_bytes,
+                    int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
+                    void *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    const __m256i weight = _mm256_set1_epi32(interlacing_leftweight);
+    const __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+    const __m128i ushift = _mm_cvtsi32_si128(uncompressed_bytes * 8);
+    const __m256i umask = _mm256_set1_epi32(~(0xFFFFFFFF << (uncompressed_bytes * 8)));
+    uint8_t *out = buffer_out;
+    int vectorsamples = vector_samples(numsamples, interlacing_shift, interlacing_leftweight);
+    int i = 0;
+
+    if (numsamples <= 0) return;
+
+    /* see deinterlace_24_sse2 for the extra frame */
+    for (; i + 9 <= vectorsamples; i += 8)
+    {
+        __m256i left = _mm256_loadu_si256((const __m256i *)&buffer_a[i]);
+        __m256i right = _mm256_loadu_si256((const __m256i *)&buffer_b[i]);
+        __m256i lo, hi;
+
+        if (interlacing_leftweight)
+        {
+            __m256i difference = right;
+
+            right = _mm256_sub_epi32(left,
+                                     _mm256_sra_epi32(_mm256_mullo_epi32(difference, weight), shift));
+            left = _mm256_add_epi32(right, difference);
+        }
+
+        if (uncompressed_bytes)
+        {
+            __m256i bytes_a = _mm256_loadu_si256((const __m256i *)&uncompressed_bytes_buffer_a[i]);
+            __m256i bytes_b = _mm256_loadu_si256((const __m256i *)&uncompressed_bytes_buffer_b[i]);
+
+            left = _mm256_or_si256(_mm256_sll_epi32(left, ushift), _mm256_and_si256(bytes_a, umask));
+            right = _mm256_or_si256(_mm256_sll_epi32(right, ushift), _mm256_and_si256(bytes_b, umask));
+        }
+
+        /* frames 0 1 4 5 and 2 3 6 7, unpack works within 128 bit lanes */
+        lo = _mm256_unpacklo_epi32(left, right);
+        hi = _mm256_unpackhi_epi32(left, right);
+
+        _mm_storeu_si128((__m128i *)&out[i*6],
+                         pack_24_sse2(_mm256_castsi256_si128(lo)));
+        _mm_storeu_si128((__m128i *)&out[i*6 + 12],
+                         pack_24_sse2(_mm256_castsi256_si128(hi)));
+        _mm_storeu_si128((__m128i *)&out[i*6 + 24],
+                         pack_24_sse2(_mm256_extracti128_si256(lo, 1)));
+        _mm_storeu_si128((__m128i *)&out[i*6 + 36],
+                         pack_24_sse2(_mm256_extracti128_si256(hi, 1)));
+    }
+
+    deinterlace_24_c(buffer_a + i, buffer_b + i,
+                     uncompressed_bytes,
+                     uncompressed_bytes_buffer_a + i, uncompressed_bytes_buffer_b + i,
+                     out + i*6,
+                     numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
+#endif /* ALAC_X86_SIMD */
+
+/* the C versions have no dependencies between samples, so compilers can
+ * still vectorize them for other targets such as NEON */
+static void select_kernels(alac_file *alac)
+{
+    alac->predictor_fir_adapt = predictor_fir_adapt_c;
+    alac->deinterlace_16 = deinterlace_16_c;
+    alac->deinterlace_24 = deinterlace_24_c;
+
+#ifdef ALAC_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        alac->predictor_fir_adapt = predictor_fir_adapt_sse41;
+
+    /* the vector kernels assume interleaved stereo, little endian output */
+    if (alac->numchannels != 2 || host_bigendian)
+        return;
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        alac->deinterlace_16 = deinterlace_16_avx2;
+        alac->deinterlace_24 = deinterlace_24_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        alac->deinterlace_16 = deinterlace_16_sse2;
+        alac->deinterlace_24 = deinterlace_24_sse2;
+    }
+#endif
+}
+
 void alac_decode_frame(alac_file *alac,
-                       unsigned char *inbuffer,
+                       unsigned char *inbuffer, int inputsize,
                        void *outbuffer, int *outputsize)
 {
     int channels;
@@ -715,7 +1189,9 @@ void alac_decode_frame(alac_file *alac,
 
     /* setup the stream */
     alac->input_buffer = inbuffer;
-    alac->input_buffer_bitaccumulator = 0;
+    alac->input_buffer_end = inbuffer + inputsize;
+    alac->input_bitcache = 0;
+    alac->input_bitcount = 0;
 
     channels = readbits(alac, 3);
 
@@ -750,6 +1226,9 @@ void alac_decode_frame(alac_file *alac,
             /* now read the number of samples,
              * as a 32bit integer */
             outputsamples = readbits(alac, 32);
+            /* compared unsigned, a count with the top bit set is capped too */
+            if ((uint32_t)outputsamples > alac->setinfo_max_samples_per_frame)
+                outputsamples = alac->setinfo_max_samples_per_frame;
             *outputsize = outputsamples * alac->bytespersample;
         }
 
@@ -800,7 +1279,8 @@ void alac_decode_frame(alac_file *alac,
 
             if (prediction_type == 0)
             { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_a,
+                predictor_decompress_fir_adapt(alac,
+                                               alac->predicterror_buffer_a,
                                                alac->outputsamples_buffer_a,
                                                outputsamples,
                                                readsamplesize,
@@ -927,6 +1407,9 @@ void alac_decode_frame(alac_file *alac,
             /* now read the number of samples,
              * as a 32bit integer */
             outputsamples = readbits(alac, 32);
+            /* compared unsigned, a count with the top bit set is capped too */
+            if ((uint32_t)outputsamples > alac->setinfo_max_samples_per_frame)
+                outputsamples = alac->setinfo_max_samples_per_frame;
             *outputsize = outputsamples * alac->bytespersample;
         }
 
@@ -1000,7 +1483,8 @@ void alac_decode_frame(alac_file *alac,
 
             if (prediction_type_a == 0)
             { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_a,
+                predictor_decompress_fir_adapt(alac,
+                                               alac->predicterror_buffer_a,
                                                alac->outputsamples_buffer_a,
                                                outputsamples,
                                                readsamplesize,
@@ -1025,7 +1509,8 @@ void alac_decode_frame(alac_file *alac,
 
             if (prediction_type_b == 0)
             { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_b,
+                predictor_decompress_fir_adapt(alac,
+                                               alac->predicterror_buffer_b,
                                                alac->outputsamples_buffer_b,
                                                outputsamples,
                                                readsamplesize,
@@ -1087,27 +1572,27 @@ void alac_decode_frame(alac_file *alac,
         {
         case 16:
         {
-            deinterlace_16(alac->outputsamples_buffer_a,
-                           alac->outputsamples_buffer_b,
-                           (int16_t*)outbuffer,
-                           alac->numchannels,
-                           outputsamples,
-                           interlacing_shift,
-                           interlacing_leftweight);
+            alac->deinterlace_16(alac->outputsamples_buffer_a,
+                                 alac->outputsamples_buffer_b,
+                                 (int16_t*)outbuffer,
+                                 alac->numchannels,
+                                 outputsamples,
+                                 interlacing_shift,
+                                 interlacing_leftweight);
             break;
         }
         case 24:
         {
-            deinterlace_24(alac->outputsamples_buffer_a,
-                           alac->outputsamples_buffer_b,
-                           uncompressed_bytes,
-                           alac->uncompressed_bytes_buffer_a,
-                           alac->uncompressed_bytes_buffer_b,
-                           (int16_t*)outbuffer,
-                           alac->numchannels,
-                           outputsamples,
-                           interlacing_shift,
-                           interlacing_leftweight);
+            alac->deinterlace_24(alac->outputsamples_buffer_a,
+                                 alac->outputsamples_buffer_b,
+                                 uncompressed_bytes,
+                                 alac->uncompressed_bytes_buffer_a,
+                                 alac->uncompressed_bytes_buffer_b,
+                                 (int16_t*)outbuffer,
+                                 alac->numchannels,
+                                 outputsamples,
+                                 interlacing_shift,
+                                 interlacing_leftweight);
             break;
         }
         case 20:
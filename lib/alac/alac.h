@@ -5,9 +5,28 @@
 
 typedef struct alac_file alac_file;
 
+typedef void (*alac_predictor_t)(int32_t *error_buffer, int32_t *buffer_out,
+                                 int output_size, int readsamplesize,
+                                 int16_t *predictor_coef_table,
+                                 int predictor_coef_num,
+                                 int predictor_quantitization);
+typedef void (*alac_deinterlace_16_t)(int32_t *buffer_a, int32_t *buffer_b,
+                                      int16_t *buffer_out,
+                                      int numchannels, int numsamples,
+                                      uint8_t interlacing_shift,
+                                      uint8_t interlacing_leftweight);
+typedef void (*alac_deinterlace_24_t)(int32_t *buffer_a, int32_t *buffer_b,
+                                      int uncompressed_bytes,
+                                      int32_t *uncompressed_bytes_buffer_a,
+                                      int32_t *uncompressed_bytes_buffer_b,
+                                      void *buffer_out,
+                                      int numchannels, int numsamples,
+                                      uint8_t interlacing_shift,
+                                      uint8_t interlacing_leftweight);
+
 alac_file *alac_create(int samplesize, int numchannels);
 void alac_decode_frame(alac_file *alac,
-                       unsigned char *inbuffer,
+                       unsigned char *inbuffer, int inputsize,
                        void *outbuffer, int *outputsize);
 void alac_set_info(alac_file *alac, char *inputbuffer);
 void alac_allocate_buffers(alac_file *alac);
@@ -15,9 +34,10 @@ void alac_free(alac_file *alac);
 
 struct alac_file
 {
-    unsigned char *input_buffer;
-    int input_buffer_bitaccumulator; /* used so we can do arbitary
-                                        bit reads */
+    unsigned char *input_buffer;     /* next byte to load */
+    unsigned char *input_buffer_end; /* reads past this return zeroes */
+    uint64_t input_bitcache;         /* unread bits, msb first */
+    int input_bitcount;              /* number of valid bits in the cache */
 
     int samplesize;
     int numchannels;
@@ -34,6 +54,11 @@ struct alac_file
     int32_t *uncompressed_bytes_buffer_a;
     int32_t *uncompressed_bytes_buffer_b;
 
+    /* predictor and stereo output kernels, selected in alac_set_info */
+    alac_predictor_t predictor_fir_adapt;
+    alac_deinterlace_16_t deinterlace_16;
+    alac_deinterlace_24_t deinterlace_24;
+
 
 
   /* stuff from setinfo */
@@ -41,6 +41,18 @@
 /* all commented out in skeleton mode */
 #ifndef CONFIG_SSL_SKELETON_MODE
 
+/*
+ * Use the AES-NI instructions for CBC decryption when the CPU has them.
+ * The functions are compiled with a target attribute, so no extra compiler
+ * flags are needed and the software code below remains the fallback.
+ */
+#if !defined(CONFIG_AES_NO_AESNI) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CONFIG_AES_NI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
 #define rot1(x) (((x) << 24) | ((x) >> 8))
 #define rot2(x) (((x) << 16) | ((x) >> 16))
 #define rot3(x) (((x) <<  8) | ((x) >> 24))
@@ -164,6 +176,11 @@ static const unsigned char Rcon[30]=
 /* ----- static functions ----- */
 static void AES_encrypt(const AES_CTX *ctx, uint32_t *data);
 static void AES_decrypt(const AES_CTX *ctx, uint32_t *data);
+#ifdef CONFIG_AES_NI
+static int AES_has_aesni(void);
+static void AES_cbc_decrypt_aesni(AES_CTX *ctx, const uint8_t *msg,
+        uint8_t *out, int length);
+#endif
 
 /* Perform doubling in Galois Field GF(2^8) using the irreducible polynomial
    x^8+x^4+x^3+x+1 */
@@ -313,6 +330,14 @@ void AES_cbc_decrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
     int i;
     uint32_t tin[4], xor[4], tout[4], data[4], iv[4];
 
+#ifdef CONFIG_AES_NI
+    if (AES_has_aesni())
+    {
+        AES_cbc_decrypt_aesni(ctx, msg, out, length);
+        return;
+    }
+#endif
+
     memcpy(iv, ctx->iv, AES_IV_SIZE);
     for (i = 0; i < 4; i++)
         xor[i] = ntohl(iv[i]);
@@ -454,4 +479,102 @@ static void AES_decrypt(const AES_CTX *ctx, uint32_t *data)
     }
 }
 
+#ifdef CONFIG_AES_NI
+/**
+ * Check once whether the CPU supports the AES-NI instructions.
+ */
+static int AES_has_aesni(void)
+{
+    static volatile int has_aesni = -1;
+
+    if (has_aesni < 0)
+    {
+        unsigned int eax, ebx, ecx, edx;
+
+        has_aesni = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+                    (ecx & bit_AES) && (edx & bit_SSE2);
+    }
+
+    return has_aesni;
+}
+
+/**
+ * Decrypt a byte sequence (with a block size 16) using AES-NI. The key
+ * must have been through AES_convert_key(), which leaves the middle round
+ * keys in the form aesdec expects. CBC decryption has no dependency
+ * between blocks, so four blocks are kept in flight at a time.
+ */
+__attribute__((target("aes,sse2")))
+static void AES_cbc_decrypt_aesni(AES_CTX *ctx, const uint8_t *msg,
+        uint8_t *out, int length)
+{
+    __m128i rk[AES_MAXROUNDS+1];
+    __m128i iv, c0, c1, c2, c3, b0, b1, b2, b3;
+    uint32_t w[4];
+    int i, r, rounds = ctx->rounds;
+
+    /* The key schedule is kept as host order words, convert to bytes */
+    for (r = 0; r <= rounds; r++)
+    {
+        for (i = 0; i < 4; i++)
+            w[i] = htonl(ctx->ks[r*4+i]);
+
+        rk[r] = _mm_loadu_si128((const __m128i *)w);
+    }
+
+    iv = _mm_loadu_si128((const __m128i *)ctx->iv);
+
+    for (; length >= 4*AES_BLOCKSIZE; length -= 4*AES_BLOCKSIZE)
+    {
+        c0 = _mm_loadu_si128((const __m128i *)(msg + 0*AES_BLOCKSIZE));
+        c1 = _mm_loadu_si128((const __m128i *)(msg + 1*AES_BLOCKSIZE));
+        c2 = _mm_loadu_si128((const __m128i *)(msg + 2*AES_BLOCKSIZE));
+        c3 = _mm_loadu_si128((const __m128i *)(msg + 3*AES_BLOCKSIZE));
+        msg += 4*AES_BLOCKSIZE;
+
+        b0 = _mm_xor_si128(c0, rk[rounds]);
+        b1 = _mm_xor_si128(c1, rk[rounds]);
+        b2 = _mm_xor_si128(c2, rk[rounds]);
+        b3 = _mm_xor_si128(c3, rk[rounds]);
+
+        for (r = rounds-1; r > 0; r--)
+        {
+            b0 = _mm_aesdec_si128(b0, rk[r]);
+            b1 = _mm_aesdec_si128(b1, rk[r]);
+            b2 = _mm_aesdec_si128(b2, rk[r]);
+            b3 = _mm_aesdec_si128(b3, rk[r]);
+        }
+
+        b0 = _mm_aesdeclast_si128(b0, rk[0]);
+        b1 = _mm_aesdeclast_si128(b1, rk[0]);
+        b2 = _mm_aesdeclast_si128(b2, rk[0]);
+        b3 = _mm_aesdeclast_si128(b3, rk[0]);
+
+        _mm_storeu_si128((__m128i *)(out + 0*AES_BLOCKSIZE), _mm_xor_si128(b0, iv));
+        _mm_storeu_si128((__m128i *)(out + 1*AES_BLOCKSIZE), _mm_xor_si128(b1, c0));
+        _mm_storeu_si128((__m128i *)(out + 2*AES_BLOCKSIZE), _mm_xor_si128(b2, c1));
+        _mm_storeu_si128((__m128i *)(out + 3*AES_BLOCKSIZE), _mm_xor_si128(b3, c2));
+        out += 4*AES_BLOCKSIZE;
+        iv = c3;
+    }
+
+    for (; length >= AES_BLOCKSIZE; length -= AES_BLOCKSIZE)
+    {
+        c0 = _mm_loadu_si128((const __m128i *)msg);
+        msg += AES_BLOCKSIZE;
+
+        b0 = _mm_xor_si128(c0, rk[rounds]);
+        for (r = rounds-1; r > 0; r--)
+            b0 = _mm_aesdec_si128(b0, rk[r]);
+        b0 = _mm_aesdeclast_si128(b0, rk[0]);
+
+        _mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, iv));
+        out += AES_BLOCKSIZE;
+        iv = c0;
+    }
+
+    _mm_storeu_si128((__m128i *)ctx->iv, iv);
+}
+#endif
+
 #endif
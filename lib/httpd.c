@@ -16,6 +16,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "httpd.h"
 #include "netutils.h"
@@ -23,12 +25,22 @@
 #include "compat.h"
 #include "logger.h"
 
+/* Read size per connection, takes the ANNOUNCE and SETUP requests whole */
+#define HTTPD_BUFFER_SIZE  8192
+
+/* Events handled per epoll_wait call */
+#define HTTPD_EVENTS       16
+
 struct http_connection_s {
 	int connected;
 
 	int socket_fd;
 	void *user_data;
 	http_request_t *request;
+	char *buffer;
+
+	/* Session of the connection in the capture, if any */
+	unsigned int capture_session;
 };
 typedef struct http_connection_s http_connection_t;
 
@@ -40,6 +52,9 @@ struct httpd_s {
 	int open_connections;
 	http_connection_t *connections;
 
+	/* Optional record of the connections */
+	raop_capture_t *capture;
+
 	/* These variables only edited mutex locked */
 	int running;
 	int joined;
@@ -49,6 +64,12 @@ struct httpd_s {
 	/* Server fds for accepting connections */
 	int server_fd4;
 	int server_fd6;
+
+	/* Server sockets, connections and the stop event share one epoll
+	 * descriptor, server sockets are left out while at max connections */
+	int epoll_fd;
+	int stop_fd;
+	int accepting;
 };
 
 httpd_t *
@@ -100,7 +121,10 @@ httpd_destroy(httpd_t *httpd)
 static int
 httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len, unsigned char *remote, int remote_len)
 {
+	struct epoll_event ev;
 	void *user_data;
+	unsigned int capture_session;
+	char *buffer;
 	int i;
 
 	for (i=0; i<httpd->max_connections; i++) {
@@ -109,14 +133,52 @@ httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len
 		}
 	}
 	if (i == httpd->max_connections) {
-		/* This code should never be reached, we do not select server_fds when full */
+		/* This code should never be reached, we do not poll server_fds when full */
 		logger_log(httpd->logger, LOGGER_INFO, "Max connections reached");
 		return -1;
 	}
 
-	user_data = httpd->callbacks.conn_init(httpd->callbacks.opaque, local, local_len, remote, remote_len);
+	buffer = malloc(HTTPD_BUFFER_SIZE);
+	if (!buffer) {
+		logger_log(httpd->logger, LOGGER_ERR, "Error allocating connection buffer");
+		return -1;
+	}
+
+	capture_session = 0;
+	if (httpd->capture) {
+		unsigned char addresses[2+2*16];
+
+		/* Address lengths and addresses, the handler needs the local one */
+		capture_session = raop_capture_new_session(httpd->capture);
+		addresses[0] = local_len;
+		memcpy(addresses+1, local, local_len);
+		addresses[1+local_len] = remote_len;
+		memcpy(addresses+2+local_len, remote, remote_len);
+		raop_capture_write(httpd->capture, capture_session, RAOP_CAPTURE_OPEN,
+		                   addresses, 2+local_len+remote_len);
+	}
+
+	user_data = httpd->callbacks.conn_init(httpd->callbacks.opaque, capture_session,
+	                                       local, local_len, remote, remote_len);
 	if (!user_data) {
 		logger_log(httpd->logger, LOGGER_ERR, "Error initializing HTTP request handler");
+		if (httpd->capture) {
+			raop_capture_write(httpd->capture, capture_session, RAOP_CAPTURE_CLOSE, NULL, 0);
+		}
+		free(buffer);
+		return -1;
+	}
+
+	/* Edge triggered, each wakeup reads until the socket is empty */
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = &httpd->connections[i];
+	if (epoll_ctl(httpd->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		logger_log(httpd->logger, LOGGER_ERR, "Error polling socket %d: %s", fd, strerror(errno));
+		httpd->callbacks.conn_destroy(user_data);
+		if (httpd->capture) {
+			raop_capture_write(httpd->capture, capture_session, RAOP_CAPTURE_CLOSE, NULL, 0);
+		}
+		free(buffer);
 		return -1;
 	}
 
@@ -124,9 +186,33 @@ httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len
 	httpd->connections[i].socket_fd = fd;
 	httpd->connections[i].connected = 1;
 	httpd->connections[i].user_data = user_data;
+	httpd->connections[i].buffer = buffer;
+	httpd->connections[i].capture_session = capture_session;
 	return 0;
 }
 
+static void
+httpd_set_accepting(httpd_t *httpd, int accepting)
+{
+	struct epoll_event ev;
+
+	if (accepting == httpd->accepting) {
+		return;
+	}
+	httpd->accepting = accepting;
+
+	/* No events keeps the sockets registered but quiet */
+	ev.events = accepting ? EPOLLIN : 0;
+	if (httpd->server_fd4 != -1) {
+		ev.data.ptr = &httpd->server_fd4;
+		epoll_ctl(httpd->epoll_fd, EPOLL_CTL_MOD, httpd->server_fd4, &ev);
+	}
+	if (httpd->server_fd6 != -1) {
+		ev.data.ptr = &httpd->server_fd6;
+		epoll_ctl(httpd->epoll_fd, EPOLL_CTL_MOD, httpd->server_fd6, &ev);
+	}
+}
+
 static int
 httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
 {
@@ -175,168 +261,175 @@ httpd_remove_connection(httpd_t *httpd, http_connection_t *connection)
 		connection->request = NULL;
 	}
 	httpd->callbacks.conn_destroy(connection->user_data);
+	if (httpd->capture) {
+		raop_capture_write(httpd->capture, connection->capture_session, RAOP_CAPTURE_CLOSE, NULL, 0);
+	}
+	epoll_ctl(httpd->epoll_fd, EPOLL_CTL_DEL, connection->socket_fd, NULL);
 	shutdown(connection->socket_fd, SHUT_WR);
 	closesocket(connection->socket_fd);
+	free(connection->buffer);
+	connection->buffer = NULL;
 	connection->connected = 0;
 	httpd->open_connections--;
 }
 
-static THREAD_RETVAL
-httpd_thread(void *arg)
+/* Returns 0 when the connection was removed */
+static int
+httpd_process_request(httpd_t *httpd, http_connection_t *connection)
 {
-	httpd_t *httpd = arg;
-	char buffer[1024];
-	int i;
+	http_response_t *response = NULL;
 
-	assert(httpd);
+	httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
+	http_request_destroy(connection->request);
+	connection->request = NULL;
 
-	while (1) {
-		fd_set rfds;
-		struct timeval tv;
-		int nfds=0;
+	if (response) {
+		const char *data;
+		int datalen;
+		int written;
 		int ret;
 
-		MUTEX_LOCK(httpd->run_mutex);
-		if (!httpd->running) {
-			MUTEX_UNLOCK(httpd->run_mutex);
-			break;
-		}
-		MUTEX_UNLOCK(httpd->run_mutex);
+		/* Get response data and datalen */
+		data = http_response_get_data(response, &datalen);
 
-		/* Set timeout value to 5ms */
-		tv.tv_sec = 1;
-		tv.tv_usec = 5000;
-
-		/* Get the correct nfds value and set rfds */
-		FD_ZERO(&rfds);
-		if (httpd->open_connections < httpd->max_connections) {
-			if (httpd->server_fd4 != -1) {
-				FD_SET(httpd->server_fd4, &rfds);
-				if (nfds <= httpd->server_fd4) {
-					nfds = httpd->server_fd4+1;
-				}
-			}
-			if (httpd->server_fd6 != -1) {
-				FD_SET(httpd->server_fd6, &rfds);
-				if (nfds <= httpd->server_fd6) {
-					nfds = httpd->server_fd6+1;
-				}
+		written = 0;
+		while (written < datalen) {
+			ret = send(connection->socket_fd, data+written, datalen-written, 0);
+			if (ret == -1) {
+				/* FIXME: Error happened */
+				logger_log(httpd->logger, LOGGER_INFO, "Error in sending data");
+				break;
 			}
+			written += ret;
+		}
+
+		if (http_response_get_disconnect(response)) {
+			logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
+			http_response_destroy(response);
+			httpd_remove_connection(httpd, connection);
+			return 0;
 		}
-		for (i=0; i<httpd->max_connections; i++) {
-			int socket_fd;
-			if (!httpd->connections[i].connected) {
+	} else {
+		logger_log(httpd->logger, LOGGER_INFO, "Didn't get response");
+	}
+	http_response_destroy(response);
+	return 1;
+}
+
+static void
+httpd_read_connection(httpd_t *httpd, http_connection_t *connection)
+{
+	int ret;
+
+	/* The socket stays blocking for the responses, only reads do not wait */
+	while (1) {
+		logger_log(httpd->logger, LOGGER_DEBUG, "Receiving on socket %d", connection->socket_fd);
+		ret = recv(connection->socket_fd, connection->buffer, HTTPD_BUFFER_SIZE, MSG_DONTWAIT);
+		if (ret == -1) {
+			if (errno == EINTR) {
 				continue;
 			}
-			socket_fd = httpd->connections[i].socket_fd;
-			FD_SET(socket_fd, &rfds);
-			if (nfds <= socket_fd) {
-				nfds = socket_fd+1;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* Drained, the next edge comes with new data */
+				return;
 			}
+			logger_log(httpd->logger, LOGGER_INFO, "Error receiving on socket %d: %s",
+			           connection->socket_fd, strerror(errno));
+			httpd_remove_connection(httpd, connection);
+			return;
 		}
-
-		ret = select(nfds, &rfds, NULL, NULL, &tv);
 		if (ret == 0) {
-			/* Timeout happened */
-			continue;
-		} else if (ret == -1) {
-			/* FIXME: Error happened */
-			logger_log(httpd->logger, LOGGER_INFO, "Error in select");
-			break;
+			logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d", connection->socket_fd);
+			httpd_remove_connection(httpd, connection);
+			return;
+		}
+		if (httpd->capture) {
+			raop_capture_write(httpd->capture, connection->capture_session, RAOP_CAPTURE_RTSP,
+			                   connection->buffer, ret);
 		}
 
-		if (httpd->open_connections < httpd->max_connections &&
-		    httpd->server_fd4 != -1 && FD_ISSET(httpd->server_fd4, &rfds)) {
-			ret = httpd_accept_connection(httpd, httpd->server_fd4, 0);
-			if (ret == -1) {
-				break;
-			} else if (ret == 0) {
-				continue;
-			}
+		/* If not in the middle of request, allocate one */
+		if (!connection->request) {
+			connection->request = http_request_init();
+			assert(connection->request);
 		}
-		if (httpd->open_connections < httpd->max_connections &&
-		    httpd->server_fd6 != -1 && FD_ISSET(httpd->server_fd6, &rfds)) {
-			ret = httpd_accept_connection(httpd, httpd->server_fd6, 1);
-			if (ret == -1) {
-				break;
-			} else if (ret == 0) {
-				continue;
-			}
+
+		/* Parse HTTP request from data read from connection */
+		http_request_add_data(connection->request, connection->buffer, ret);
+		if (http_request_has_error(connection->request)) {
+			logger_log(httpd->logger, LOGGER_INFO, "Error in parsing: %s", http_request_get_error_name(connection->request));
+			httpd_remove_connection(httpd, connection);
+			return;
 		}
-		for (i=0; i<httpd->max_connections; i++) {
-			http_connection_t *connection = &httpd->connections[i];
 
-			if (!connection->connected) {
-				continue;
-			}
-			if (!FD_ISSET(connection->socket_fd, &rfds)) {
-				continue;
+		/* If request is finished, process and deallocate */
+		if (http_request_is_complete(connection->request)) {
+			if (!httpd_process_request(httpd, connection)) {
+				return;
 			}
+		} else {
+			logger_log(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
+		}
+	}
+}
 
-			/* If not in the middle of request, allocate one */
-			if (!connection->request) {
-				connection->request = http_request_init();
-				assert(connection->request);
-			}
+static THREAD_RETVAL
+httpd_thread(void *arg)
+{
+	httpd_t *httpd = arg;
+	struct epoll_event events[HTTPD_EVENTS];
+	int i;
+
+	assert(httpd);
 
-			logger_log(httpd->logger, LOGGER_DEBUG, "Receiving on socket %d", connection->socket_fd);
-			ret = recv(connection->socket_fd, buffer, sizeof(buffer), 0);
-			if (ret == 0) {
-				logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d", connection->socket_fd);
-				httpd_remove_connection(httpd, connection);
+	while (1) {
+		int nevents, ret;
+
+		MUTEX_LOCK(httpd->run_mutex);
+		if (!httpd->running) {
+			MUTEX_UNLOCK(httpd->run_mutex);
+			break;
+		}
+		MUTEX_UNLOCK(httpd->run_mutex);
+
+		/* Only the ready descriptors come back, httpd_stop wakes it up */
+		nevents = epoll_wait(httpd->epoll_fd, events, HTTPD_EVENTS, -1);
+		if (nevents == -1) {
+			if (errno == EINTR) {
 				continue;
 			}
+			logger_log(httpd->logger, LOGGER_ERR, "httpd_thread: epoll error %s, exiting", strerror(errno));
+			break;
+		}
 
-			/* Parse HTTP request from data read from connection */
-			http_request_add_data(connection->request, buffer, ret);
-			if (http_request_has_error(connection->request)) {
-				logger_log(httpd->logger, LOGGER_INFO, "Error in parsing: %s", http_request_get_error_name(connection->request));
-				httpd_remove_connection(httpd, connection);
+		for (i=0; i<nevents; i++) {
+			void *ptr = events[i].data.ptr;
+
+			if (!ptr) {
+				/* Stop event, the running flag is checked above */
 				continue;
 			}
-
-			/* If request is finished, process and deallocate */
-			if (http_request_is_complete(connection->request)) {
-				http_response_t *response = NULL;
-
-				httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
-				http_request_destroy(connection->request);
-				connection->request = NULL;
-
-				if (response) {
-					const char *data;
-					int datalen;
-					int written;
-					int ret;
-
-					/* Get response data and datalen */
-					data = http_response_get_data(response, &datalen);
-
-					written = 0;
-					while (written < datalen) {
-						ret = send(connection->socket_fd, data+written, datalen-written, 0);
-						if (ret == -1) {
-							/* FIXME: Error happened */
-							logger_log(httpd->logger, LOGGER_INFO, "Error in sending data");
-							break;
-						}
-						written += ret;
-					}
-
-					if (http_response_get_disconnect(response)) {
-						logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
-						httpd_remove_connection(httpd, connection);
-					}
-				} else {
-					logger_log(httpd->logger, LOGGER_INFO, "Didn't get response");
+			if (ptr == &httpd->server_fd4 || ptr == &httpd->server_fd6) {
+				if (!httpd->accepting) {
+					continue;
 				}
-				http_response_destroy(response);
-			} else {
-				logger_log(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
+				ret = httpd_accept_connection(httpd, *(int *)ptr, ptr == &httpd->server_fd6);
+				if (ret == -1) {
+					logger_log(httpd->logger, LOGGER_ERR, "httpd_thread: accept error %s, exiting", strerror(errno));
+					goto cleanup;
+				}
+				httpd_set_accepting(httpd, httpd->open_connections < httpd->max_connections);
+				continue;
 			}
+
+			/* Each descriptor is in a batch once, so removing a connection
+			 * does not affect the others */
+			httpd_read_connection(httpd, ptr);
+			httpd_set_accepting(httpd, httpd->open_connections < httpd->max_connections);
 		}
 	}
 
+cleanup:
 	/* Remove all connections that are still connected */
 	for (i=0; i<httpd->max_connections; i++) {
 		http_connection_t *connection = &httpd->connections[i];
@@ -365,6 +458,43 @@ httpd_thread(void *arg)
 	return 0;
 }
 
+void
+httpd_set_capture(httpd_t *httpd, raop_capture_t *capture)
+{
+	assert(httpd);
+
+	/* Read by the thread, set before httpd_start */
+	httpd->capture = capture;
+}
+
+static int
+httpd_init_epoll(httpd_t *httpd)
+{
+	struct epoll_event ev;
+
+	httpd->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	httpd->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (httpd->epoll_fd == -1 || httpd->stop_fd == -1) {
+		if (httpd->epoll_fd != -1) close(httpd->epoll_fd);
+		if (httpd->stop_fd != -1) close(httpd->stop_fd);
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(httpd->epoll_fd, EPOLL_CTL_ADD, httpd->stop_fd, &ev);
+	if (httpd->server_fd4 != -1) {
+		ev.data.ptr = &httpd->server_fd4;
+		epoll_ctl(httpd->epoll_fd, EPOLL_CTL_ADD, httpd->server_fd4, &ev);
+	}
+	if (httpd->server_fd6 != -1) {
+		ev.data.ptr = &httpd->server_fd6;
+		epoll_ctl(httpd->epoll_fd, EPOLL_CTL_ADD, httpd->server_fd6, &ev);
+	}
+	httpd->accepting = 1;
+	return 0;
+}
+
 int
 httpd_start(httpd_t *httpd, unsigned short *port)
 {
@@ -406,6 +536,13 @@ httpd_start(httpd_t *httpd, unsigned short *port)
 		MUTEX_UNLOCK(httpd->run_mutex);
 		return -2;
 	}
+	if (httpd_init_epoll(httpd) == -1) {
+		logger_log(httpd->logger, LOGGER_ERR, "Error creating epoll descriptor: %s", strerror(errno));
+		closesocket(httpd->server_fd4);
+		closesocket(httpd->server_fd6);
+		MUTEX_UNLOCK(httpd->run_mutex);
+		return -1;
+	}
 	logger_log(httpd->logger, LOGGER_INFO, "Initialized server socket(s)");
 
 	/* Set values correctly and create new thread */
@@ -434,6 +571,8 @@ httpd_is_running(httpd_t *httpd)
 void
 httpd_stop(httpd_t *httpd)
 {
+	uint64_t value;
+
 	assert(httpd);
 
 	MUTEX_LOCK(httpd->run_mutex);
@@ -444,7 +583,14 @@ httpd_stop(httpd_t *httpd)
 	httpd->running = 0;
 	MUTEX_UNLOCK(httpd->run_mutex);
 
+	/* The thread waits in epoll_wait without a timeout */
+	value = 1;
+	if (write(httpd->stop_fd, &value, sizeof(value)) == -1) {
+		logger_log(httpd->logger, LOGGER_WARNING, "Error waking HTTP thread: %d", errno);
+	}
 	THREAD_JOIN(httpd->thread);
+	close(httpd->epoll_fd);
+	close(httpd->stop_fd);
 
 	MUTEX_LOCK(httpd->run_mutex);
 	httpd->joined = 1;
@@ -18,12 +18,14 @@
 #include "logger.h"
 #include "http_request.h"
 #include "http_response.h"
+#include "raop_capture.h"
 
 typedef struct httpd_s httpd_t;
 
 struct httpd_callbacks_s {
 	void* opaque;
-	void* (*conn_init)(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen);
+	void* (*conn_init)(void *opaque, unsigned int capture_session,
+	                   unsigned char *local, int locallen, unsigned char *remote, int remotelen);
 	void  (*conn_request)(void *ptr, http_request_t *request, http_response_t **response);
 	void  (*conn_destroy)(void *ptr);
 };
@@ -34,6 +36,9 @@ httpd_t *httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int max_conn
 
 int httpd_is_running(httpd_t *httpd);
 
+/* Records connections and everything read from them, set before httpd_start */
+void httpd_set_capture(httpd_t *httpd, raop_capture_t *capture);
+
 int httpd_start(httpd_t *httpd, unsigned short *port);
 void httpd_stop(httpd_t *httpd);
 
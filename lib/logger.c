@@ -15,38 +15,107 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <assert.h>
+#include <sys/eventfd.h>
 
 #include "logger.h"
 #include "compat.h"
 
-struct logger_s {
-	mutex_handle_t lvl_mutex;
-	mutex_handle_t cb_mutex;
+/* Messages wait in a ring until the log thread hands them on, so the
+ * threads logging never block on the callback or stderr */
+#define LOGGER_SLOTS        128
+#define LOGGER_MESSAGE_LEN  1024
 
+typedef struct {
+	/* Ring position the slot is free for, or that position plus one
+	 * once the message in it is complete */
+	unsigned long seq;
+	int level;
+	char msg[LOGGER_MESSAGE_LEN];
+} logger_slot_t;
+
+struct logger_s {
+	/* Read without a lock so filtered messages cost one load, it is
+	 * the first member as logger_level_enabled reads it inline */
 	int level;
+
+	mutex_handle_t cb_mutex;
 	void *cls;
 	logger_callback_t callback;
+
+	logger_slot_t slots[LOGGER_SLOTS];
+	unsigned long head;
+	unsigned long tail;
+	unsigned long long dropped;
+	unsigned long long dropped_reported;
+
+	/* The log thread sets sleeping before it waits on event_fd, the
+	 * first message after that writes to it */
+	thread_handle_t thread;
+	int event_fd;
+	int sleeping;
+	int running;
 };
 
+typedef char logger_level_first[(offsetof(struct logger_s, level) == 0) ? 1 : -1];
+
+static THREAD_RETVAL logger_thread(void *arg);
+
+static void
+logger_wakeup(logger_t *logger)
+{
+	uint64_t value = 1;
+	ssize_t ret;
+
+	/* Only fails when the counter is about to overflow, it is signalled anyway */
+	ret = write(logger->event_fd, &value, sizeof(value));
+	(void) ret;
+}
+
 logger_t *
 logger_init()
 {
 	logger_t *logger = calloc(1, sizeof(logger_t));
-	assert(logger);
+	unsigned long i;
 
-	MUTEX_CREATE(logger->lvl_mutex);
+	if (!logger) {
+		return NULL;
+	}
 	MUTEX_CREATE(logger->cb_mutex);
 
 	logger->level = LOGGER_WARNING;
 	logger->callback = NULL;
+	for (i=0; i<LOGGER_SLOTS; i++) {
+		logger->slots[i].seq = i;
+	}
+
+	logger->event_fd = eventfd(0, EFD_CLOEXEC);
+	if (logger->event_fd < 0) {
+		MUTEX_DESTROY(logger->cb_mutex);
+		free(logger);
+		return NULL;
+	}
+	logger->running = 1;
+	THREAD_CREATE(logger->thread, logger_thread, logger);
+	if (!logger->thread) {
+		close(logger->event_fd);
+		MUTEX_DESTROY(logger->cb_mutex);
+		free(logger);
+		return NULL;
+	}
 	return logger;
 }
 
 void
 logger_destroy(logger_t *logger)
 {
-	MUTEX_DESTROY(logger->lvl_mutex);
+	/* The thread empties the ring before it exits */
+	__atomic_store_n(&logger->running, 0, __ATOMIC_SEQ_CST);
+	logger_wakeup(logger);
+	THREAD_JOIN(logger->thread);
+
+	close(logger->event_fd);
 	MUTEX_DESTROY(logger->cb_mutex);
 	free(logger);
 }
@@ -56,9 +125,7 @@ logger_set_level(logger_t *logger, int level)
 {
 	assert(logger);
 
-	MUTEX_LOCK(logger->lvl_mutex);
-	logger->level = level;
-	MUTEX_UNLOCK(logger->lvl_mutex);
+	__atomic_store_n(&logger->level, level, __ATOMIC_RELAXED);
 }
 
 void
@@ -72,6 +139,14 @@ logger_set_callback(logger_t *logger, logger_callback_t callback, void *cls)
 	MUTEX_UNLOCK(logger->cb_mutex);
 }
 
+unsigned long long
+logger_get_dropped(logger_t *logger)
+{
+	assert(logger);
+
+	return __atomic_load_n(&logger->dropped, __ATOMIC_RELAXED);
+}
+
 static char *
 logger_utf8_to_local(const char *str)
 {
@@ -102,38 +177,126 @@ logger_utf8_to_local(const char *str)
 	return ret;
 }
 
-void
-logger_log(logger_t *logger, int level, const char *fmt, ...)
+static void
+logger_dispatch(logger_t *logger, int level, const char *msg)
 {
-	char buffer[4096];
-	va_list ap;
-
-	MUTEX_LOCK(logger->lvl_mutex);
-	if (level > logger->level) {
-		MUTEX_UNLOCK(logger->lvl_mutex);
-		return;
-	}
-	MUTEX_UNLOCK(logger->lvl_mutex);
-
-	buffer[sizeof(buffer)-1] = '\0';
-	va_start(ap, fmt);
-	vsnprintf(buffer, sizeof(buffer)-1, fmt, ap);
-	va_end(ap);
-
 	MUTEX_LOCK(logger->cb_mutex);
 	if (logger->callback) {
-		logger->callback(logger->cls, level, buffer);
+		logger->callback(logger->cls, level, msg);
 		MUTEX_UNLOCK(logger->cb_mutex);
 	} else {
 		char *local;
 		MUTEX_UNLOCK(logger->cb_mutex);
-		local = logger_utf8_to_local(buffer);
+		local = logger_utf8_to_local(msg);
 		if (local) {
 			fprintf(stderr, "%s\n", local);
 			free(local);
 		} else {
-			fprintf(stderr, "%s\n", buffer);
+			fprintf(stderr, "%s\n", msg);
 		}
 	}
 }
 
+/* Hands on the complete messages in order, only ever run by the log thread */
+static void
+logger_drain(logger_t *logger)
+{
+	unsigned long long dropped;
+	char buffer[64];
+
+	for (;;) {
+		logger_slot_t *slot = &logger->slots[logger->tail % LOGGER_SLOTS];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logger->tail+1) {
+			break;
+		}
+		logger_dispatch(logger, slot->level, slot->msg);
+		__atomic_store_n(&slot->seq, logger->tail+LOGGER_SLOTS, __ATOMIC_RELEASE);
+		logger->tail++;
+	}
+
+	dropped = __atomic_load_n(&logger->dropped, __ATOMIC_RELAXED);
+	if (dropped != logger->dropped_reported) {
+		snprintf(buffer, sizeof(buffer), "Log full, dropped %llu messages",
+		         dropped - logger->dropped_reported);
+		logger->dropped_reported = dropped;
+		logger_dispatch(logger, LOGGER_WARNING, buffer);
+	}
+}
+
+static int
+logger_is_empty(logger_t *logger)
+{
+	logger_slot_t *slot = &logger->slots[logger->tail % LOGGER_SLOTS];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logger->tail+1 &&
+	       __atomic_load_n(&logger->dropped, __ATOMIC_RELAXED) == logger->dropped_reported;
+}
+
+static THREAD_RETVAL
+logger_thread(void *arg)
+{
+	logger_t *logger = arg;
+	uint64_t value;
+
+	while (__atomic_load_n(&logger->running, __ATOMIC_SEQ_CST)) {
+		logger_drain(logger);
+
+		/* Pairs with the fence in logger_write, either the writer sees
+		 * sleeping or the thread sees its message */
+		__atomic_store_n(&logger->sleeping, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!logger_is_empty(logger)) {
+			__atomic_store_n(&logger->sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (read(logger->event_fd, &value, sizeof(value)) == -1 && errno != EINTR) {
+			break;
+		}
+	}
+	logger_drain(logger);
+	return 0;
+}
+
+void
+logger_write(logger_t *logger, int level, const char *fmt, ...)
+{
+	logger_slot_t *slot;
+	unsigned long pos;
+	va_list ap;
+
+	if (!logger_level_enabled(logger, level)) {
+		return;
+	}
+
+	/* Claim the next free slot, or count the message when there is none */
+	pos = __atomic_load_n(&logger->head, __ATOMIC_RELAXED);
+	for (;;) {
+		long diff;
+
+		slot = &logger->slots[pos % LOGGER_SLOTS];
+		diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&logger->head, &pos, pos+1, 1,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			__atomic_fetch_add(&logger->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&logger->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->level = level;
+	va_start(ap, fmt);
+	vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&logger->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		logger_wakeup(logger);
+	}
+}
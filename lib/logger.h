@@ -25,6 +25,12 @@
 #define LOGGER_INFO        6       /* informational */
 #define LOGGER_DEBUG       7       /* debug-level messages */
 
+/* Messages above this level are not compiled in at all, build with
+ * -DLOGGER_MAX_LEVEL=LOGGER_INFO to drop the per packet debug output */
+#ifndef LOGGER_MAX_LEVEL
+#define LOGGER_MAX_LEVEL   LOGGER_DEBUG
+#endif
+
 typedef void (*logger_callback_t)(void *cls, int level, const char *msg);
 
 typedef struct logger_s logger_t;
@@ -35,6 +41,23 @@ void logger_destroy(logger_t *logger);
 void logger_set_level(logger_t *logger, int level);
 void logger_set_callback(logger_t *logger, logger_callback_t callback, void *cls);
 
-void logger_log(logger_t *logger, int level, const char *fmt, ...);
+/* Messages are queued and handed to the callback or stderr by a thread of
+ * the logger, when the queue is full they are counted and dropped */
+unsigned long long logger_get_dropped(logger_t *logger);
+
+void logger_write(logger_t *logger, int level, const char *fmt, ...);
+
+/* The level set is the first member of the logger, checking it inline
+ * saves the call and the argument setup for every filtered message */
+#define logger_level_enabled(logger, level) \
+	((level) <= __atomic_load_n((const int *)(logger), __ATOMIC_RELAXED))
+
+/* The arguments are not evaluated when the level is compiled out or
+ * filtered at run time */
+#define logger_log(logger, level, ...) \
+	do { \
+		if ((level) <= LOGGER_MAX_LEVEL && logger_level_enabled((logger), (level))) \
+			logger_write((logger), (level), __VA_ARGS__); \
+	} while (0)
 
 #endif
@@ -16,9 +16,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "raop.h"
 #include "raop_rtp.h"
+#include "raop_buffer.h"
+#include "raop_pool.h"
+#include "raop_capture.h"
+#include "raop_metrics.h"
 #include "pairing.h"
 #include "rsakey.h"
 #include "digest.h"
@@ -59,6 +64,23 @@ struct raop_s {
 
 	/* Password information */
 	char password[MAX_PASSWORD_LEN+1];
+
+	/* Audio buffer length in packets and decode mode */
+	int buffer_length;
+	int lazy_decode;
+	int plc_mode;
+	int resample;
+
+	/* Worker threads running UDP sessions, none means a thread per session */
+	int workers;
+	raop_pool_t *pool;
+
+	/* Counters of all sessions */
+	raop_metrics_t metrics;
+
+	/* Record of the traffic, and set while a record is replayed */
+	raop_capture_t *capture;
+	int replaying;
 };
 
 struct raop_conn_s {
@@ -73,6 +95,9 @@ struct raop_conn_s {
 	unsigned char *remote;
 	int remotelen;
 
+	/* Session in the capture, 0 if not captured */
+	unsigned int capture_session;
+
 	char nonce[MAX_NONCE_LEN+1];
 };
 typedef struct raop_conn_s raop_conn_t;
@@ -80,7 +105,8 @@ typedef struct raop_conn_s raop_conn_t;
 #include "raop_handlers.h"
 
 static void *
-conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen)
+conn_init(void *opaque, unsigned int capture_session,
+          unsigned char *local, int locallen, unsigned char *remote, int remotelen)
 {
 	raop_t *raop = opaque;
 	raop_conn_t *conn;
@@ -93,6 +119,7 @@ conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remot
 	}
 	conn->raop = raop;
 	conn->raop_rtp = NULL;
+	conn->capture_session = capture_session;
 	conn->fairplay = fairplay_init(raop->logger);
 	if (!conn->fairplay) {
 		free(conn);
@@ -326,9 +353,17 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int
 
 	/* Initialize the logger */
 	raop->logger = logger_init();
+	if (!raop->logger) {
+		free(raop);
+		return NULL;
+	}
+	raop->buffer_length = RAOP_BUFFER_DEFAULT_LENGTH;
+	raop->plc_mode = RAOP_PLC_REPEAT;
+	raop->resample = 1;
 
 	pairing = pairing_init_generate();
 	if (!pairing) {
+		logger_destroy(raop->logger);
 		free(raop);
 		return NULL;
 	}
@@ -344,6 +379,7 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int
 	httpd = httpd_init(raop->logger, &httpd_cbs, max_clients);
 	if (!httpd) {
 		pairing_destroy(pairing);
+		logger_destroy(raop->logger);
 		free(raop);
 		return NULL;
 	}
@@ -356,6 +392,7 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int
 	if (!rsakey) {
 		pairing_destroy(pairing);
 		httpd_destroy(httpd);
+		logger_destroy(raop->logger);
 		free(raop);
 		return NULL;
 	}
@@ -390,6 +427,7 @@ raop_destroy(raop_t *raop)
 		pairing_destroy(raop->pairing);
 		httpd_destroy(raop->httpd);
 		rsakey_destroy(raop->rsakey);
+		raop_capture_destroy(raop->capture);
 		logger_destroy(raop->logger);
 		free(raop);
 
@@ -422,6 +460,251 @@ raop_set_log_callback(raop_t *raop, raop_log_callback_t callback, void *cls)
 	logger_set_callback(raop->logger, callback, cls);
 }
 
+void
+raop_set_buffer_length(raop_t *raop, int packets)
+{
+	assert(raop);
+
+	/* Applies to sessions announced after this call */
+	raop->buffer_length = raop_buffer_valid_length(packets);
+}
+
+void
+raop_set_lazy_decode(raop_t *raop, int enabled)
+{
+	assert(raop);
+
+	/* Applies to sessions announced after this call */
+	raop->lazy_decode = !!enabled;
+}
+
+void
+raop_set_worker_threads(raop_t *raop, int workers)
+{
+	assert(raop);
+
+	/* Applies from the next raop_start */
+	raop->workers = workers;
+}
+
+void
+raop_set_plc_mode(raop_t *raop, int mode)
+{
+	assert(raop);
+
+	/* Applies to sessions announced after this call */
+	raop->plc_mode = mode;
+}
+
+void
+raop_set_resample(raop_t *raop, int enabled)
+{
+	assert(raop);
+
+	/* Applies to sessions announced after this call */
+	raop->resample = !!enabled;
+}
+
+void
+raop_get_metrics(raop_t *raop, raop_metrics_t *metrics)
+{
+	assert(raop);
+	assert(metrics);
+
+	raop_metrics_read(&raop->metrics, metrics);
+	metrics->log_dropped = logger_get_dropped(raop->logger);
+}
+
+int
+raop_set_capture_file(raop_t *raop, const char *filename)
+{
+	raop_capture_t *capture = NULL;
+
+	assert(raop);
+
+	/* Connections and sessions pick it up when they start */
+	if (httpd_is_running(raop->httpd)) {
+		return -1;
+	}
+	if (filename) {
+		capture = raop_capture_init(filename);
+		if (!capture) {
+			logger_log(raop->logger, LOGGER_ERR, "Error opening capture file %s", filename);
+			return -1;
+		}
+	}
+	raop_capture_destroy(raop->capture);
+	raop->capture = capture;
+	httpd_set_capture(raop->httpd, capture);
+	return 0;
+}
+
+typedef struct {
+	unsigned int session;
+	raop_conn_t *conn;
+	http_request_t *request;
+} raop_replay_conn_t;
+
+static void
+raop_replay_remove(raop_replay_conn_t *replay)
+{
+	if (replay->request) {
+		http_request_destroy(replay->request);
+	}
+	conn_destroy(replay->conn);
+	replay->conn = NULL;
+	replay->request = NULL;
+}
+
+static void
+raop_replay_rtsp(raop_t *raop, raop_replay_conn_t *replay, const unsigned char *data, int datalen)
+{
+	http_response_t *response = NULL;
+
+	/* Parsed like httpd does, the responses go nowhere */
+	if (!replay->request) {
+		replay->request = http_request_init();
+		assert(replay->request);
+	}
+	http_request_add_data(replay->request, (const char *)data, datalen);
+	if (http_request_has_error(replay->request)) {
+		logger_log(raop->logger, LOGGER_INFO, "Error in parsing: %s", http_request_get_error_name(replay->request));
+		raop_replay_remove(replay);
+		return;
+	}
+	if (!http_request_is_complete(replay->request)) {
+		return;
+	}
+	conn_request(replay->conn, replay->request, &response);
+	http_request_destroy(replay->request);
+	replay->request = NULL;
+	if (response && http_response_get_disconnect(response)) {
+		raop_replay_remove(replay);
+	}
+	http_response_destroy(response);
+}
+
+int
+raop_replay_file(raop_t *raop, const char *filename, int realtime)
+{
+	raop_capture_t *capture;
+	raop_capture_record_t record;
+	raop_replay_conn_t *conns = NULL;
+	int conns_count = 0, records = 0;
+	uint64_t first_time = 0, start_time = 0;
+	int paced = 0;
+	int i, ret;
+
+	assert(raop);
+	assert(filename);
+
+	/* The handlers run in this thread instead of the server */
+	if (httpd_is_running(raop->httpd)) {
+		return -1;
+	}
+	capture = raop_capture_open(filename);
+	if (!capture) {
+		logger_log(raop->logger, LOGGER_ERR, "Error opening capture file %s", filename);
+		return -1;
+	}
+	raop->replaying = 1;
+
+	while ((ret = raop_capture_read(capture, &record)) > 0) {
+		raop_replay_conn_t *replay = NULL;
+
+		if (record.type == RAOP_CAPTURE_RUN) {
+			/* The previous run ended without closing its connections */
+			for (i=0; i<conns_count; i++) {
+				if (conns[i].conn) {
+					raop_replay_remove(&conns[i]);
+				}
+			}
+			/* No waiting for the time between the runs */
+			paced = 0;
+			records++;
+			continue;
+		}
+
+		/* Keep the pace of the capture, or go as fast as the pipeline can */
+		if (realtime) {
+			struct timespec ts;
+			uint64_t now;
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			now = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+			/* The clock of a run only goes forward, anything else starts over
+			 * rather than waiting for an underflowed time */
+			if (!paced || record.time < first_time) {
+				first_time = record.time;
+				start_time = now;
+				paced = 1;
+			} else if (record.time - first_time > now - start_time) {
+				uint64_t wait = (record.time - first_time) - (now - start_time);
+				ts.tv_sec = wait / 1000000000ull;
+				ts.tv_nsec = wait % 1000000000ull;
+				nanosleep(&ts, NULL);
+			}
+		}
+		records++;
+
+		for (i=0; i<conns_count; i++) {
+			if (conns[i].conn && conns[i].session == record.session) {
+				replay = &conns[i];
+				break;
+			}
+		}
+
+		if (record.type == RAOP_CAPTURE_OPEN) {
+			const unsigned char *local = record.data+1;
+			int locallen = record.datalen > 0 ? record.data[0] : 0;
+			const unsigned char *remote = local+locallen+1;
+			int remotelen;
+
+			if (replay || record.datalen < 2+locallen) {
+				continue;
+			}
+			remotelen = record.data[1+locallen];
+			if (record.datalen < 2+locallen+remotelen) {
+				continue;
+			}
+			for (i=0; i<conns_count && conns[i].conn; i++);
+			if (i == conns_count) {
+				raop_replay_conn_t *tmp = realloc(conns, (conns_count+1) * sizeof(raop_replay_conn_t));
+				if (!tmp) {
+					break;
+				}
+				conns = tmp;
+				conns_count++;
+			}
+			replay = &conns[i];
+			replay->session = record.session;
+			replay->request = NULL;
+			replay->conn = conn_init(raop, 0, (unsigned char *)local, locallen, (unsigned char *)remote, remotelen);
+		} else if (!replay) {
+			continue;
+		} else if (record.type == RAOP_CAPTURE_RTSP) {
+			raop_replay_rtsp(raop, replay, record.data, record.datalen);
+		} else if (record.type == RAOP_CAPTURE_CLOSE) {
+			raop_replay_remove(replay);
+		} else if (replay->conn->raop_rtp) {
+			raop_rtp_replay(replay->conn->raop_rtp, record.type, record.data, record.datalen, record.time);
+		}
+	}
+
+	/* Captures cut short leave connections open */
+	for (i=0; i<conns_count; i++) {
+		if (conns[i].conn) {
+			raop_replay_remove(&conns[i]);
+		}
+	}
+	free(conns);
+	raop_capture_destroy(capture);
+	raop->replaying = 0;
+
+	logger_log(raop->logger, LOGGER_INFO, "Replayed %d records from %s", records, filename);
+	return (ret < 0) ? -1 : records;
+}
+
 int
 raop_start(raop_t *raop, unsigned short *port, const char *hwaddr, int hwaddrlen, const char *password)
 {
@@ -449,6 +732,11 @@ raop_start(raop_t *raop, unsigned short *port, const char *hwaddr, int hwaddrlen
 	memcpy(raop->hwaddr, hwaddr, hwaddrlen);
 	raop->hwaddrlen = hwaddrlen;
 
+	/* Sessions fall back to their own threads if the pool cannot start */
+	if (raop->workers && !raop->pool && !httpd_is_running(raop->httpd)) {
+		raop->pool = raop_pool_init(raop->logger, raop->workers < 0 ? 0 : raop->workers);
+	}
+
 	return httpd_start(raop->httpd, port);
 }
 
@@ -458,5 +746,9 @@ raop_stop(raop_t *raop)
 	assert(raop);
 
 	httpd_stop(raop->httpd);
+
+	/* All sessions ended with their connections */
+	raop_pool_destroy(raop->pool);
+	raop->pool = NULL;
 }
 
@@ -25,7 +25,9 @@
 #include "crypto/crypto.h"
 #include "alac/alac.h"
 
-#define RAOP_BUFFER_LENGTH 256
+/* Bytes of ALAC frame header on top of the samples, a frame stored
+ * verbatim needs less than this */
+#define RAOP_BUFFER_PAYLOAD_SLACK 64
 
 typedef struct {
 	/* Packet available */
@@ -42,11 +44,22 @@ typedef struct {
 	int audio_buffer_size;
 	int audio_buffer_len;
 	void *audio_buffer;
+
+	/* Encrypted payload waiting for decode in lazy mode */
+	int payload_len;
+	unsigned char *payload;
+
+	/* Resend requests sent for a missing packet, and when the last was sent */
+	int resend_count;
+	uint64_t resend_time;
+
+	/* Missing packet given up on, played as silence */
+	int abandoned;
 } raop_buffer_entry_t;
 
 struct raop_buffer_s {
-	/* AES key and IV */
-	unsigned char aeskey[RAOP_AESKEY_LEN];
+	/* AES key schedule, expanded once for decryption, and IV */
+	AES_CTX aes_ctx;
 	unsigned char aesiv[RAOP_AESIV_LEN];
 
 	/* ALAC decoder */
@@ -55,17 +68,47 @@ struct raop_buffer_s {
 
 	unsigned int latest_timestamp;
 
+	/* Timestamp following the last frame dequeued, it stands in for a
+	 * lost frame at the head, unknown after a flush */
+	int has_next_timestamp;
+	unsigned int next_timestamp;
+
 	/* First and last seqnum */
 	int is_empty;
 	unsigned short first_seqnum;
 	unsigned short last_seqnum;
 
-	/* RTP buffer entries */
-	raop_buffer_entry_t entries[RAOP_BUFFER_LENGTH];
+	/* First seqnum not contiguously available from first_seqnum,
+	 * and the audio bytes available before it */
+	unsigned short ready_seqnum;
+	int ready_bytes;
+
+	/* Decode on dequeue instead of on queue */
+	int lazy_decode;
+
+	/* RTP buffer entries, length is a power of two */
+	int length;
+	unsigned short mask;
+	raop_buffer_entry_t *entries;
+
+	/* Fills the frames of packets that never arrived */
+	raop_plc_t *plc;
+
+	/* One bit per entry, set while its packet is missing and wanted */
+	uint32_t *missing;
+	raop_buffer_resend_stats_t resend_stats;
+
+	/* Shared counters of the receiver, may be NULL */
+	raop_metrics_t *metrics;
 
 	/* Buffer of all audio buffers */
 	int buffer_size;
 	void *buffer;
+
+	/* Payload slots of all entries in lazy mode, each one takes a frame
+	 * stored verbatim, which is as large as ALAC packets get */
+	int payload_size;
+	unsigned char *payloads;
 };
 
 
@@ -147,11 +190,25 @@ set_decoder_info(alac_file *alac, ALACSpecificConfig *config)
 	alac_set_info(alac, (char *) decoder_info);
 }
 
+int
+raop_buffer_valid_length(int length)
+{
+	int valid = RAOP_BUFFER_MIN_LENGTH;
+
+	/* Round up to the next power of two within limits */
+	while (valid < length && valid < RAOP_BUFFER_MAX_LENGTH) {
+		valid <<= 1;
+	}
+	return valid;
+}
+
 raop_buffer_t *
 raop_buffer_init(const char *rtpmap,
                  const char *fmtp,
                  const unsigned char *aeskey,
-                 const unsigned char *aesiv)
+                 const unsigned char *aesiv,
+                 int length,
+                 int lazy_decode)
 {
 	raop_buffer_t *raop_buffer;
 	int audio_buffer_size;
@@ -175,35 +232,86 @@ raop_buffer_init(const char *rtpmap,
 		return NULL;
 	}
 
-	/* Allocate the output audio buffers */
+	/* Allocate the buffer entries */
+	raop_buffer->length = raop_buffer_valid_length(length);
+	raop_buffer->mask = raop_buffer->length-1;
+	raop_buffer->entries = calloc(raop_buffer->length, sizeof(raop_buffer_entry_t));
+	raop_buffer->missing = calloc((raop_buffer->length+31)/32, sizeof(uint32_t));
+	if (!raop_buffer->entries || !raop_buffer->missing) {
+		free(raop_buffer->missing);
+		free(raop_buffer->entries);
+		free(raop_buffer);
+		return NULL;
+	}
+
+	/* Allocate the output audio buffers, lazy mode decodes
+	 * one packet at a time so all entries share one buffer */
+	raop_buffer->lazy_decode = lazy_decode;
 	audio_buffer_size = alacConfig->frameLength *
 	                    alacConfig->numChannels *
 	                    alacConfig->bitDepth/8;
-	raop_buffer->buffer_size = audio_buffer_size * RAOP_BUFFER_LENGTH;
+	raop_buffer->buffer_size = audio_buffer_size;
+	if (!lazy_decode) {
+		raop_buffer->buffer_size *= raop_buffer->length;
+	}
 	raop_buffer->buffer = malloc(raop_buffer->buffer_size);
 	if (!raop_buffer->buffer) {
+		free(raop_buffer->missing);
+		free(raop_buffer->entries);
 		free(raop_buffer);
 		return NULL;
 	}
-	for (i=0; i<RAOP_BUFFER_LENGTH; i++) {
+	if (lazy_decode) {
+		raop_buffer->payload_size = audio_buffer_size + RAOP_BUFFER_PAYLOAD_SLACK;
+		raop_buffer->payloads = malloc(raop_buffer->payload_size * raop_buffer->length);
+		if (!raop_buffer->payloads) {
+			free(raop_buffer->buffer);
+			free(raop_buffer->missing);
+			free(raop_buffer->entries);
+			free(raop_buffer);
+			return NULL;
+		}
+	}
+	for (i=0; i<raop_buffer->length; i++) {
 		raop_buffer_entry_t *entry = &raop_buffer->entries[i];
 		entry->audio_buffer_size = audio_buffer_size;
 		entry->audio_buffer_len = 0;
-		entry->audio_buffer = (char *)raop_buffer->buffer+i*audio_buffer_size;
+		entry->audio_buffer = raop_buffer->buffer;
+		if (!lazy_decode) {
+			entry->audio_buffer = (char *)raop_buffer->buffer+i*audio_buffer_size;
+		} else {
+			entry->payload = raop_buffer->payloads+i*raop_buffer->payload_size;
+		}
 	}
 
 	/* Initialize ALAC decoder */
 	raop_buffer->alac = alac_create(alacConfig->bitDepth,
 	                                alacConfig->numChannels);
 	if (!raop_buffer->alac) {
+		free(raop_buffer->payloads);
 		free(raop_buffer->buffer);
+		free(raop_buffer->missing);
+		free(raop_buffer->entries);
 		free(raop_buffer);
 		return NULL;
 	}
 	set_decoder_info(raop_buffer->alac, alacConfig);
 
-	/* Initialize AES keys */
-	memcpy(raop_buffer->aeskey, aeskey, RAOP_AESKEY_LEN);
+	/* Initialize packet loss concealment */
+	raop_buffer->plc = raop_plc_init(alacConfig->numChannels, alacConfig->frameLength);
+	if (!raop_buffer->plc) {
+		alac_free(raop_buffer->alac);
+		free(raop_buffer->payloads);
+		free(raop_buffer->buffer);
+		free(raop_buffer->missing);
+		free(raop_buffer->entries);
+		free(raop_buffer);
+		return NULL;
+	}
+
+	/* Initialize AES keys, the key schedule is the same for every packet */
+	AES_set_key(&raop_buffer->aes_ctx, aeskey, aesiv, AES_MODE_128);
+	AES_convert_key(&raop_buffer->aes_ctx);
 	memcpy(raop_buffer->aesiv, aesiv, RAOP_AESIV_LEN);
 
 	/* Mark buffer as empty */
@@ -215,8 +323,12 @@ void
 raop_buffer_destroy(raop_buffer_t *raop_buffer)
 {
 	if (raop_buffer) {
+		raop_plc_destroy(raop_buffer->plc);
 		alac_free(raop_buffer->alac);
+		free(raop_buffer->payloads);
 		free(raop_buffer->buffer);
+		free(raop_buffer->missing);
+		free(raop_buffer->entries);
 		free(raop_buffer);
 	}
 }
@@ -229,21 +341,118 @@ raop_buffer_get_config(raop_buffer_t *raop_buffer)
 	return &raop_buffer->alacConfig;
 }
 
+int
+raop_buffer_get_length(raop_buffer_t *raop_buffer)
+{
+	assert(raop_buffer);
+
+	return raop_buffer->length;
+}
+
+void
+raop_buffer_set_plc_mode(raop_buffer_t *raop_buffer, int mode)
+{
+	assert(raop_buffer);
+
+	raop_plc_set_mode(raop_buffer->plc, mode);
+}
+
+void
+raop_buffer_set_metrics(raop_buffer_t *raop_buffer, raop_metrics_t *metrics)
+{
+	assert(raop_buffer);
+
+	raop_buffer->metrics = metrics;
+}
+
+void
+raop_buffer_get_plc_stats(raop_buffer_t *raop_buffer, raop_plc_stats_t *stats)
+{
+	assert(raop_buffer);
+
+	raop_plc_get_stats(raop_buffer->plc, stats);
+}
+
 static short
 seqnum_cmp(unsigned short s1, unsigned short s2)
 {
 	return (s1 - s2);
 }
 
+static int
+is_missing(raop_buffer_t *raop_buffer, unsigned short seqnum)
+{
+	unsigned short index = seqnum & raop_buffer->mask;
+	return (raop_buffer->missing[index >> 5] >> (index & 31)) & 1;
+}
+
+static void
+set_missing(raop_buffer_t *raop_buffer, unsigned short seqnum, int missing)
+{
+	unsigned short index = seqnum & raop_buffer->mask;
+	if (missing) {
+		raop_buffer->missing[index >> 5] |= (1u << (index & 31));
+	} else {
+		raop_buffer->missing[index >> 5] &= ~(1u << (index & 31));
+	}
+}
+
+static void
+advance_ready(raop_buffer_t *raop_buffer)
+{
+	raop_buffer_entry_t *entry;
+
+	/* Abandoned entries are dequeued as silence, they do not block */
+	while (seqnum_cmp(raop_buffer->ready_seqnum, raop_buffer->last_seqnum) <= 0) {
+		entry = &raop_buffer->entries[raop_buffer->ready_seqnum & raop_buffer->mask];
+		if (entry->available) {
+			raop_buffer->ready_bytes += entry->audio_buffer_len;
+		} else if (entry->abandoned) {
+			raop_buffer->ready_bytes += entry->audio_buffer_size;
+		} else {
+			break;
+		}
+		raop_buffer->ready_seqnum++;
+	}
+}
+
+static void
+decode_payload(raop_buffer_t *raop_buffer, const unsigned char *payload, int payloadlen,
+               void *output, int *outputlen)
+{
+	unsigned char packetbuf[RAOP_PACKET_LEN];
+	int encryptedlen;
+	uint64_t start = 0, decrypted = 0;
+
+	if (raop_buffer->metrics) {
+		start = raop_metrics_now();
+	}
+
+	/* Decrypt audio data */
+	encryptedlen = payloadlen/16*16;
+	memcpy(raop_buffer->aes_ctx.iv, raop_buffer->aesiv, RAOP_AESIV_LEN);
+	AES_cbc_decrypt(&raop_buffer->aes_ctx, payload, packetbuf, encryptedlen);
+	memcpy(packetbuf+encryptedlen, payload+encryptedlen, payloadlen-encryptedlen);
+
+	if (raop_buffer->metrics) {
+		decrypted = raop_metrics_now();
+		raop_metrics_record(raop_buffer->metrics, aes_time, decrypted - start);
+	}
+
+	/* Decode ALAC audio data, the output holds one full frame */
+	alac_decode_frame(raop_buffer->alac, packetbuf, payloadlen,
+	                  output, outputlen);
+
+	if (raop_buffer->metrics) {
+		raop_metrics_record(raop_buffer->metrics, decode_time, raop_metrics_now() - decrypted);
+	}
+}
+
 int
 raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, int use_seqnum)
 {
-	unsigned char packetbuf[RAOP_PACKET_LEN];
 	unsigned short seqnum;
 	raop_buffer_entry_t *entry;
-	int encryptedlen;
-	AES_CTX aes_ctx;
-	int outputlen;
 
 	assert(raop_buffer);
 
@@ -252,6 +461,12 @@ raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned shor
 		return -1;
 	}
 
+	/* Nothing valid is larger than a payload slot, such a packet is left
+	 * out and concealed when its turn comes, like a lost one */
+	if (raop_buffer->lazy_decode && datalen-12 > raop_buffer->payload_size) {
+		return 0;
+	}
+
 	/* Get correct seqnum for the packet */
 	if (use_seqnum) {
 		seqnum = (data[2] << 8) | data[3];
@@ -261,20 +476,46 @@ raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned shor
 
 	/* If this packet is too late, just skip it */
 	if (!raop_buffer->is_empty && seqnum_cmp(seqnum, raop_buffer->first_seqnum) < 0) {
+		raop_metrics_count(raop_buffer->metrics, packets_late, 1);
 		return 0;
 	}
 
 	/* Check that there is always space in the buffer, otherwise flush */
-	if (seqnum_cmp(seqnum, raop_buffer->first_seqnum+RAOP_BUFFER_LENGTH) >= 0) {
+	if (seqnum_cmp(seqnum, raop_buffer->first_seqnum+raop_buffer->length) >= 0) {
 		raop_buffer_flush(raop_buffer, seqnum);
 	}
 
 	/* Get entry corresponding our seqnum */
-	entry = &raop_buffer->entries[seqnum % RAOP_BUFFER_LENGTH];
+	entry = &raop_buffer->entries[seqnum & raop_buffer->mask];
 	if (entry->available && seqnum_cmp(entry->seqnum, seqnum) == 0) {
 		/* Packet resend, we can safely ignore */
+		raop_metrics_count(raop_buffer->metrics, packets_duplicate, 1);
 		return 0;
 	}
+	if (!raop_buffer->is_empty && seqnum_cmp(seqnum, raop_buffer->last_seqnum) <= 0) {
+		if (entry->abandoned) {
+			/* Already counted as silence, too late to use */
+			raop_metrics_count(raop_buffer->metrics, packets_late, 1);
+			return 0;
+		}
+		if (is_missing(raop_buffer, seqnum)) {
+			set_missing(raop_buffer, seqnum, 0);
+			if (entry->resend_count) {
+				raop_buffer->resend_stats.recovered++;
+			}
+		}
+	}
+
+	/* Keep the payload for later or decode it right away, in lazy
+	 * mode the nominal frame size stands in for the decoded length */
+	if (raop_buffer->lazy_decode) {
+		memcpy(entry->payload, &data[12], datalen-12);
+		entry->payload_len = datalen-12;
+		entry->audio_buffer_len = entry->audio_buffer_size;
+	} else {
+		decode_payload(raop_buffer, &data[12], datalen-12,
+		               entry->audio_buffer, &entry->audio_buffer_len);
+	}
 
 	/* Update the raop_buffer entry header */
 	entry->flags = data[0];
@@ -285,33 +526,37 @@ raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned shor
 	entry->ssrc = (data[8] << 24) | (data[9] << 16) |
 	              (data[10] << 8) | data[11];
 	entry->available = 1;
+	raop_metrics_count(raop_buffer->metrics, packets_received, 1);
 
 	// update timestamp only if this isn't out of order (or retransmit)
 	if(seqnum_cmp(seqnum, raop_buffer->last_seqnum) > 0)
 		raop_buffer->latest_timestamp = entry->timestamp;
 
-	/* Decrypt audio data */
-	encryptedlen = (datalen-12)/16*16;
-	AES_set_key(&aes_ctx, raop_buffer->aeskey, raop_buffer->aesiv, AES_MODE_128);
-	AES_convert_key(&aes_ctx);
-	AES_cbc_decrypt(&aes_ctx, &data[12], packetbuf, encryptedlen);
-	memcpy(packetbuf+encryptedlen, &data[12+encryptedlen], datalen-12-encryptedlen);
-
-	/* Decode ALAC audio data */
-	outputlen = entry->audio_buffer_size;
-	alac_decode_frame(raop_buffer->alac, packetbuf,
-	                  entry->audio_buffer, &outputlen);
-	entry->audio_buffer_len = outputlen;
-
 	/* Update the raop_buffer seqnums */
 	if (raop_buffer->is_empty) {
 		raop_buffer->first_seqnum = seqnum;
 		raop_buffer->last_seqnum = seqnum;
+		raop_buffer->ready_seqnum = seqnum;
+		raop_buffer->ready_bytes = 0;
 		raop_buffer->is_empty = 0;
 	}
 	if (seqnum_cmp(seqnum, raop_buffer->last_seqnum) > 0) {
+		unsigned short missing;
+
+		/* Everything skipped over is missing until it arrives */
+		for (missing=raop_buffer->last_seqnum+1; missing!=seqnum; missing++) {
+			raop_buffer_entry_t *gap = &raop_buffer->entries[missing & raop_buffer->mask];
+			gap->resend_count = 0;
+			gap->abandoned = 0;
+			set_missing(raop_buffer, missing, 1);
+		}
 		raop_buffer->last_seqnum = seqnum;
 	}
+
+	/* Filling the first gap extends the contiguous range */
+	if (seqnum == raop_buffer->ready_seqnum) {
+		advance_ready(raop_buffer);
+	}
 	return 1;
 }
 
@@ -320,7 +565,7 @@ int
 raop_buffer_can_dequeue(raop_buffer_t *raop_buffer)
 {
 	short buflen;
-	raop_buffer_entry_t *entry;
+	int nbytes;
 
 	/* Calculate number of entries in the current buffer */
 	buflen = seqnum_cmp(raop_buffer->last_seqnum, raop_buffer->first_seqnum)+1;
@@ -329,13 +574,10 @@ raop_buffer_can_dequeue(raop_buffer_t *raop_buffer)
 	if(raop_buffer->is_empty || buflen <= 0)
 		return 0;
 
-	int nbytes = 0;
-	for(unsigned short seq = raop_buffer->first_seqnum; seqnum_cmp(seq, raop_buffer->last_seqnum)<0; seq++){
-		entry = &raop_buffer->entries[seq % RAOP_BUFFER_LENGTH];
-		if(!entry->available)
-			break;
-		nbytes += entry->audio_buffer_len;
-	}
+	/* The last entry is held back until more data arrives */
+	nbytes = raop_buffer->ready_bytes;
+	if(seqnum_cmp(raop_buffer->ready_seqnum, raop_buffer->last_seqnum) > 0)
+		nbytes -= raop_buffer->entries[raop_buffer->last_seqnum & raop_buffer->mask].audio_buffer_len;
 
 	return nbytes;
 }
@@ -346,8 +588,36 @@ raop_buffer_latest_timestamp(raop_buffer_t *raop_buffer)
 	return raop_buffer->latest_timestamp;
 }
 
+int
+raop_buffer_get_first_timestamp(raop_buffer_t *raop_buffer, unsigned int *timestamp)
+{
+	raop_buffer_entry_t *entry;
+
+	assert(raop_buffer);
+	assert(timestamp);
+
+	if (raop_buffer->is_empty || seqnum_cmp(raop_buffer->last_seqnum, raop_buffer->first_seqnum) < 0) {
+		return -1;
+	}
+	entry = &raop_buffer->entries[raop_buffer->first_seqnum & raop_buffer->mask];
+	if (entry->available) {
+		*timestamp = entry->timestamp;
+	} else if (raop_buffer->has_next_timestamp) {
+		*timestamp = raop_buffer->next_timestamp;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
 const void *
 raop_buffer_dequeue(raop_buffer_t *raop_buffer, int *length, unsigned int *timestamp, int no_resend)
+{
+	return raop_buffer_dequeue_into(raop_buffer, NULL, length, timestamp, no_resend);
+}
+
+const void *
+raop_buffer_dequeue_into(raop_buffer_t *raop_buffer, void *output, int *length, unsigned int *timestamp, int no_resend)
 {
 	short buflen;
 	raop_buffer_entry_t *entry;
@@ -361,75 +631,210 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, int *length, unsigned int *times
 	}
 
 	/* Get the first buffer entry for inspection */
-	entry = &raop_buffer->entries[raop_buffer->first_seqnum % RAOP_BUFFER_LENGTH];
+	entry = &raop_buffer->entries[raop_buffer->first_seqnum & raop_buffer->mask];
 	if (no_resend) {
 		/* If we do no resends, always return the first entry */
-	} else if (!entry->available) {
+	} else if (!entry->available && !entry->abandoned) {
 		/* Check how much we have space left in the buffer */
-		if (buflen < RAOP_BUFFER_LENGTH) {
+		if (buflen < raop_buffer->length) {
 			/* Return nothing and hope resend gets on time */
 			return NULL;
 		}
 		/* Risk of buffer overrun, return empty buffer */
 	}
+	if (!output) {
+		output = entry->audio_buffer;
+	}
 
 	/* Update buffer and validate entry */
 	raop_buffer->first_seqnum += 1;
 	if (!entry->available) {
-		/* Return an empty audio buffer to skip audio */
+		if (is_missing(raop_buffer, raop_buffer->first_seqnum-1)) {
+			set_missing(raop_buffer, raop_buffer->first_seqnum-1, 0);
+			raop_buffer->resend_stats.abandoned++;
+		}
+		entry->abandoned = 0;
+
+		/* Skipped the gap, count the next contiguous range */
+		raop_buffer->ready_seqnum = raop_buffer->first_seqnum;
+		raop_buffer->ready_bytes = 0;
+		advance_ready(raop_buffer);
+
+		/* Return a concealed audio buffer to skip audio */
+		raop_metrics_count(raop_buffer->metrics, packets_lost, 1);
+		if (raop_buffer->has_next_timestamp) {
+			*timestamp = raop_buffer->next_timestamp;
+			raop_buffer->next_timestamp += raop_buffer->alacConfig.frameLength;
+		}
 		*length = entry->audio_buffer_size;
-		memset(entry->audio_buffer, 0, *length);
-		return entry->audio_buffer;
+		raop_plc_conceal(raop_buffer->plc, output, raop_buffer->alacConfig.frameLength);
+		return output;
 	}
 	entry->available = 0;
+	raop_buffer->ready_bytes -= entry->audio_buffer_len;
+	if (raop_buffer->lazy_decode) {
+		decode_payload(raop_buffer, entry->payload, entry->payload_len,
+		               output, &entry->audio_buffer_len);
+	} else if (output != entry->audio_buffer) {
+		memcpy(output, entry->audio_buffer, entry->audio_buffer_len);
+	}
+	raop_plc_good_frame(raop_buffer->plc, output,
+	                    entry->audio_buffer_len / (raop_buffer->alacConfig.numChannels*2));
 
 	/* Return entry audio buffer */
 	*length = entry->audio_buffer_len;
 	*timestamp = entry->timestamp;
+	raop_buffer->has_next_timestamp = 1;
+	raop_buffer->next_timestamp = entry->timestamp + raop_buffer->alacConfig.frameLength;
 	entry->audio_buffer_len = 0;
-	return entry->audio_buffer;
+	return output;
+}
+
+/* Sends one request per run of due seqnums and returns the seqnum after the run */
+static unsigned short
+request_run(raop_buffer_t *raop_buffer, unsigned short seqnum, unsigned short end,
+            uint64_t now, uint64_t timeout, raop_resend_cb_t resend_cb, void *opaque)
+{
+	unsigned short first = seqnum;
+
+	while (seqnum != end && is_missing(raop_buffer, seqnum)) {
+		raop_buffer_entry_t *entry = &raop_buffer->entries[seqnum & raop_buffer->mask];
+
+		/* Wait twice as long after every unanswered request */
+		if (entry->resend_count >= RAOP_BUFFER_MAX_RESENDS ||
+		    (entry->resend_count && now - entry->resend_time < (timeout << (entry->resend_count-1)))) {
+			break;
+		}
+		if (entry->resend_count) {
+			raop_buffer->resend_stats.retried++;
+		} else {
+			raop_buffer->resend_stats.requested++;
+		}
+		entry->resend_count++;
+		entry->resend_time = now;
+		seqnum++;
+	}
+	if (seqnum != first) {
+		resend_cb(opaque, first, seqnum_cmp(seqnum, first));
+		return seqnum;
+	}
+	return seqnum+1;
+}
+
+static void
+abandon_entry(raop_buffer_t *raop_buffer, unsigned short seqnum)
+{
+	raop_buffer->entries[seqnum & raop_buffer->mask].abandoned = 1;
+	set_missing(raop_buffer, seqnum, 0);
+	raop_buffer->resend_stats.abandoned++;
 }
 
 void
-raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque)
+raop_buffer_handle_resends(raop_buffer_t *raop_buffer, uint64_t now, uint64_t timeout,
+                           int has_deadline, unsigned int deadline,
+                           raop_resend_cb_t resend_cb, void *opaque)
 {
-	raop_buffer_entry_t *entry;
+	unsigned short seqnum, end;
+	unsigned int frame_length;
 
 	assert(raop_buffer);
 	assert(resend_cb);
 
-	if (seqnum_cmp(raop_buffer->first_seqnum, raop_buffer->last_seqnum) < 0) {
-		int seqnum, count;
+	if (raop_buffer->is_empty || seqnum_cmp(raop_buffer->first_seqnum, raop_buffer->last_seqnum) >= 0) {
+		return;
+	}
+
+	/* The last entry is always available, missing ones are all before it */
+	frame_length = raop_buffer->alacConfig.frameLength;
+	seqnum = raop_buffer->first_seqnum;
+	end = raop_buffer->last_seqnum;
+	while (seqnum != end) {
+		unsigned short index = seqnum & raop_buffer->mask;
+		uint32_t word = raop_buffer->missing[index >> 5] >> (index & 31);
+		raop_buffer_entry_t *entry;
+		int skip;
+
+		/* Jump over whole words of available packets */
+		if (!word) {
+			skip = 32 - (index & 31);
+			if (skip > raop_buffer->length - index) {
+				skip = raop_buffer->length - index;
+			}
+			if (skip > seqnum_cmp(end, seqnum)) {
+				skip = seqnum_cmp(end, seqnum);
+			}
+			seqnum += skip;
+			continue;
+		}
+		skip = __builtin_ctz(word);
+		if (skip) {
+			seqnum += (skip < seqnum_cmp(end, seqnum)) ? skip : seqnum_cmp(end, seqnum);
+			continue;
+		}
 
-		for (seqnum=raop_buffer->first_seqnum; seqnum_cmp(seqnum, raop_buffer->last_seqnum)<0; seqnum++) {
-			entry = &raop_buffer->entries[seqnum % RAOP_BUFFER_LENGTH];
-			if (entry->available) {
-				break;
+		/* Give up when the packet could not arrive before it is played,
+		 * its timestamp is extrapolated back from the latest packet */
+		entry = &raop_buffer->entries[index];
+		if (has_deadline) {
+			unsigned int timestamp = raop_buffer->latest_timestamp -
+			                         seqnum_cmp(end, seqnum) * frame_length;
+			if ((int)(timestamp - deadline) < 0) {
+				abandon_entry(raop_buffer, seqnum);
+				seqnum++;
+				continue;
 			}
 		}
-		if (seqnum_cmp(seqnum, raop_buffer->first_seqnum) == 0) {
-			return;
+		if (entry->resend_count >= RAOP_BUFFER_MAX_RESENDS &&
+		    now - entry->resend_time >= (timeout << (entry->resend_count-1))) {
+			abandon_entry(raop_buffer, seqnum);
+			seqnum++;
+			continue;
+		}
+		if (entry->resend_count >= RAOP_BUFFER_MAX_RESENDS) {
+			seqnum++;
+			continue;
 		}
-		count = seqnum_cmp(seqnum, raop_buffer->first_seqnum);
-		resend_cb(opaque, raop_buffer->first_seqnum, count);
+		seqnum = request_run(raop_buffer, seqnum, end, now, timeout, resend_cb, opaque);
 	}
+
+	/* Abandoned entries at the head can be played now */
+	advance_ready(raop_buffer);
+}
+
+void
+raop_buffer_get_resend_stats(raop_buffer_t *raop_buffer, raop_buffer_resend_stats_t *stats)
+{
+	assert(raop_buffer);
+	assert(stats);
+
+	memcpy(stats, &raop_buffer->resend_stats, sizeof(raop_buffer_resend_stats_t));
 }
 
 void
 raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq)
 {
-	int i;
+	unsigned short seqnum;
 
 	assert(raop_buffer);
 
-	for (i=0; i<RAOP_BUFFER_LENGTH; i++) {
-		raop_buffer->entries[i].available = 0;
-		raop_buffer->entries[i].audio_buffer_len = 0;
+	/* Only entries between first and last seqnum can be in use */
+	if (!raop_buffer->is_empty) {
+		for (seqnum=raop_buffer->first_seqnum; seqnum_cmp(seqnum, raop_buffer->last_seqnum)<=0; seqnum++) {
+			raop_buffer_entry_t *entry = &raop_buffer->entries[seqnum & raop_buffer->mask];
+			entry->available = 0;
+			entry->abandoned = 0;
+			entry->audio_buffer_len = 0;
+		}
 	}
+	memset(raop_buffer->missing, 0, (raop_buffer->length+31)/32 * sizeof(uint32_t));
+	raop_plc_reset(raop_buffer->plc);
 	if (next_seq < 0 || next_seq > 0xffff) {
 		raop_buffer->is_empty = 1;
 	} else {
 		raop_buffer->first_seqnum = next_seq;
 		raop_buffer->last_seqnum = next_seq-1;
 	}
+	raop_buffer->ready_seqnum = raop_buffer->first_seqnum;
+	raop_buffer->ready_bytes = 0;
+	raop_buffer->has_next_timestamp = 0;
 }
@@ -15,8 +15,21 @@
 #ifndef RAOP_BUFFER_H
 #define RAOP_BUFFER_H
 
+#include <stdint.h>
+
+#include "raop_plc.h"
+#include "raop_metrics.h"
+
 typedef struct raop_buffer_s raop_buffer_t;
 
+/* Buffer length in packets, always a power of two */
+#define RAOP_BUFFER_DEFAULT_LENGTH 256
+#define RAOP_BUFFER_MIN_LENGTH     4
+#define RAOP_BUFFER_MAX_LENGTH     16384
+
+/* Requests sent for a missing packet before it is given up on */
+#define RAOP_BUFFER_MAX_RESENDS    4
+
 /* From ALACMagicCookieDescription.txt at http://http://alac.macosforge.org/ */
 typedef struct {
 	unsigned int frameLength;
@@ -34,17 +47,45 @@ typedef struct {
 
 typedef int (*raop_resend_cb_t)(void *opaque, unsigned short seqno, unsigned short count);
 
+/* Missing packets requested for the first time, requested again,
+ * received after a request, and never received */
+typedef struct {
+	unsigned long long requested;
+	unsigned long long retried;
+	unsigned long long recovered;
+	unsigned long long abandoned;
+} raop_buffer_resend_stats_t;
+
+int raop_buffer_valid_length(int length);
 raop_buffer_t *raop_buffer_init(const char *rtpmap,
                                 const char *fmtp,
                                 const unsigned char *aeskey,
-                                const unsigned char *aesiv);
+                                const unsigned char *aesiv,
+                                int length,
+                                int lazy_decode);
 
 const ALACSpecificConfig *raop_buffer_get_config(raop_buffer_t *raop_buffer);
+int raop_buffer_get_length(raop_buffer_t *raop_buffer);
+void raop_buffer_set_plc_mode(raop_buffer_t *raop_buffer, int mode);
+void raop_buffer_set_metrics(raop_buffer_t *raop_buffer, raop_metrics_t *metrics);
+void raop_buffer_get_plc_stats(raop_buffer_t *raop_buffer, raop_plc_stats_t *stats);
 int raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, int use_seqnum);
 int raop_buffer_can_dequeue(raop_buffer_t *raop_buffer);
 unsigned int raop_buffer_latest_timestamp(raop_buffer_t *raop_buffer);
+int raop_buffer_get_first_timestamp(raop_buffer_t *raop_buffer, unsigned int *timestamp);
 const void *raop_buffer_dequeue(raop_buffer_t *raop_buffer, int *length, unsigned int *timestamp, int no_resend);
-void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque);
+
+/* Same as above, but the frame is decoded or concealed straight into output,
+ * which has room for one decoded frame, and output is returned */
+const void *raop_buffer_dequeue_into(raop_buffer_t *raop_buffer, void *output, int *length,
+                                     unsigned int *timestamp, int no_resend);
+
+/* Requests missing packets, re-requests back off exponentially from timeout
+ * (both in ns), and packets with a timestamp before deadline are given up */
+void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, uint64_t now, uint64_t timeout,
+                                int has_deadline, unsigned int deadline,
+                                raop_resend_cb_t resend_cb, void *opaque);
+void raop_buffer_get_resend_stats(raop_buffer_t *raop_buffer, raop_buffer_resend_stats_t *stats);
 void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq);
 
 void raop_buffer_destroy(raop_buffer_t *raop_buffer);
@@ -0,0 +1,207 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "raop_capture.h"
+#include "threads.h"
+
+/* A file starts with the magic, then each record is a 16 byte header of
+ * receive time in ns, session, type and length, all big endian, and data */
+#define RAOP_CAPTURE_MAGIC      "RAOPCAP1"
+#define RAOP_CAPTURE_MAGIC_LEN  8
+#define RAOP_CAPTURE_HEADER_LEN 16
+#define RAOP_CAPTURE_MAX_LEN    0xffffff
+
+struct raop_capture_s {
+	FILE *file;
+	int writing;
+
+	/* Guards the file and the session counter while writing */
+	mutex_handle_t mutex;
+	unsigned int sessions;
+
+	/* Data of the last record read */
+	unsigned char *buffer;
+	int buffer_size;
+};
+
+static void
+put_be(unsigned char *buf, uint64_t value, int bytes)
+{
+	while (bytes--) {
+		buf[bytes] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+static uint64_t
+get_be(const unsigned char *buf, int bytes)
+{
+	uint64_t value = 0;
+	int i;
+
+	for (i=0; i<bytes; i++) {
+		value = (value << 8) | buf[i];
+	}
+	return value;
+}
+
+raop_capture_t *
+raop_capture_init(const char *filename)
+{
+	raop_capture_t *raop_capture;
+
+	assert(filename);
+
+	raop_capture = calloc(1, sizeof(raop_capture_t));
+	if (!raop_capture) {
+		return NULL;
+	}
+	raop_capture->file = fopen(filename, "ab");
+	if (!raop_capture->file) {
+		free(raop_capture);
+		return NULL;
+	}
+
+	/* Captures of several runs go one after another into the same file */
+	if (ftell(raop_capture->file) == 0) {
+		fwrite(RAOP_CAPTURE_MAGIC, 1, RAOP_CAPTURE_MAGIC_LEN, raop_capture->file);
+	}
+	raop_capture->writing = 1;
+	MUTEX_CREATE(raop_capture->mutex);
+
+	/* Runs after a restart or reboot reuse session ids and may have an
+	 * earlier clock, so the reader needs to know where one begins */
+	raop_capture_write(raop_capture, 0, RAOP_CAPTURE_RUN, NULL, 0);
+	return raop_capture;
+}
+
+unsigned int
+raop_capture_new_session(raop_capture_t *raop_capture)
+{
+	unsigned int session;
+
+	assert(raop_capture);
+
+	MUTEX_LOCK(raop_capture->mutex);
+	session = ++raop_capture->sessions;
+	MUTEX_UNLOCK(raop_capture->mutex);
+	return session;
+}
+
+void
+raop_capture_write(raop_capture_t *raop_capture, unsigned int session, int type,
+                   const void *data, int datalen)
+{
+	unsigned char header[RAOP_CAPTURE_HEADER_LEN];
+	struct timespec ts;
+
+	assert(raop_capture);
+	assert(raop_capture->writing);
+
+	if (datalen < 0 || datalen > RAOP_CAPTURE_MAX_LEN) {
+		return;
+	}
+
+	put_be(header+8, session, 4);
+	put_be(header+12, ((uint64_t)type << 24) | datalen, 4);
+
+	/* Stamped under the lock so the file is in time order, with the clock
+	 * of the timing exchange so replies replay with their receive times */
+	MUTEX_LOCK(raop_capture->mutex);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	put_be(header, (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec, 8);
+	if (fwrite(header, 1, sizeof(header), raop_capture->file) == sizeof(header) && datalen > 0) {
+		fwrite(data, 1, datalen, raop_capture->file);
+	}
+	MUTEX_UNLOCK(raop_capture->mutex);
+}
+
+raop_capture_t *
+raop_capture_open(const char *filename)
+{
+	raop_capture_t *raop_capture;
+	char magic[RAOP_CAPTURE_MAGIC_LEN];
+
+	assert(filename);
+
+	raop_capture = calloc(1, sizeof(raop_capture_t));
+	if (!raop_capture) {
+		return NULL;
+	}
+	raop_capture->file = fopen(filename, "rb");
+	if (!raop_capture->file) {
+		free(raop_capture);
+		return NULL;
+	}
+	if (fread(magic, 1, sizeof(magic), raop_capture->file) != sizeof(magic) ||
+	    memcmp(magic, RAOP_CAPTURE_MAGIC, sizeof(magic))) {
+		fclose(raop_capture->file);
+		free(raop_capture);
+		return NULL;
+	}
+	MUTEX_CREATE(raop_capture->mutex);
+	return raop_capture;
+}
+
+int
+raop_capture_read(raop_capture_t *raop_capture, raop_capture_record_t *record)
+{
+	unsigned char header[RAOP_CAPTURE_HEADER_LEN];
+	uint64_t typelen;
+
+	assert(raop_capture);
+	assert(!raop_capture->writing);
+	assert(record);
+
+	if (fread(header, 1, sizeof(header), raop_capture->file) != sizeof(header)) {
+		return 0;
+	}
+	typelen = get_be(header+12, 4);
+	record->time = get_be(header, 8);
+	record->session = get_be(header+8, 4);
+	record->type = typelen >> 24;
+	record->datalen = typelen & RAOP_CAPTURE_MAX_LEN;
+
+	if (record->datalen > raop_capture->buffer_size) {
+		unsigned char *buffer = realloc(raop_capture->buffer, record->datalen);
+		if (!buffer) {
+			return -1;
+		}
+		raop_capture->buffer = buffer;
+		raop_capture->buffer_size = record->datalen;
+	}
+	if (fread(raop_capture->buffer, 1, record->datalen, raop_capture->file) != (size_t)record->datalen) {
+		/* Cut short by a crash while writing */
+		return 0;
+	}
+	record->data = raop_capture->buffer;
+	return 1;
+}
+
+void
+raop_capture_destroy(raop_capture_t *raop_capture)
+{
+	if (raop_capture) {
+		fclose(raop_capture->file);
+		MUTEX_DESTROY(raop_capture->mutex);
+		free(raop_capture->buffer);
+		free(raop_capture);
+	}
+}
@@ -0,0 +1,52 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_CAPTURE_H
+#define RAOP_CAPTURE_H
+
+#include <stdint.h>
+
+/* What a record holds, sessions are numbered per RTSP connection */
+#define RAOP_CAPTURE_OPEN     0 /* connection accepted, local and remote address */
+#define RAOP_CAPTURE_RTSP     1 /* bytes read from the connection */
+#define RAOP_CAPTURE_CLOSE    2 /* connection removed */
+#define RAOP_CAPTURE_DATA     3 /* RTP audio datagram */
+#define RAOP_CAPTURE_CONTROL  4 /* control datagram, syncs and resent packets */
+#define RAOP_CAPTURE_TIMING   5 /* timing datagram */
+#define RAOP_CAPTURE_STREAM   6 /* RTP audio packet from a TCP stream */
+#define RAOP_CAPTURE_RUN      7 /* writer opened the file, sessions and clock start over */
+
+typedef struct raop_capture_s raop_capture_t;
+
+typedef struct {
+	uint64_t time;
+	unsigned int session;
+	int type;
+	const unsigned char *data;
+	int datalen;
+} raop_capture_record_t;
+
+/* Appends to filename, safe to write from any thread */
+raop_capture_t *raop_capture_init(const char *filename);
+unsigned int raop_capture_new_session(raop_capture_t *raop_capture);
+void raop_capture_write(raop_capture_t *raop_capture, unsigned int session, int type,
+                        const void *data, int datalen);
+
+/* Reads the records back, data is valid until the next read */
+raop_capture_t *raop_capture_open(const char *filename);
+int raop_capture_read(raop_capture_t *raop_capture, raop_capture_record_t *record);
+
+void raop_capture_destroy(raop_capture_t *raop_capture);
+
+#endif
@@ -165,7 +165,7 @@ raop_handler_announce(raop_conn_t *conn,
 	data = http_request_get_data(request, &datalen);
 	if (data) {
 		sdp_t *sdp;
-		const char *remotestr, *rtpmapstr, *fmtpstr, *rsaaeskeystr, *fpaeskeystr, *aesivstr;
+		const char *remotestr, *rtpmapstr, *fmtpstr, *rsaaeskeystr, *fpaeskeystr, *aesivstr, *minlatencystr;
 
 		sdp = sdp_init(data, datalen);
 		remotestr = sdp_get_connection(sdp);
@@ -174,6 +174,7 @@ raop_handler_announce(raop_conn_t *conn,
 		rsaaeskeystr = sdp_get_rsaaeskey(sdp);
 		fpaeskeystr = sdp_get_fpaeskey(sdp);
 		aesivstr = sdp_get_aesiv(sdp);
+		minlatencystr = sdp_get_min_latency(sdp);
 
 		logger_log(conn->raop->logger, LOGGER_DEBUG, "connection: %s", remotestr);
 		logger_log(conn->raop->logger, LOGGER_DEBUG, "rtpmap: %s", rtpmapstr);
@@ -209,7 +210,21 @@ raop_handler_announce(raop_conn_t *conn,
 		}
 		if (aeskeylen == sizeof(aeskey) && aesivlen == sizeof(aesiv)) {
 			conn->raop_rtp = raop_rtp_init(conn->raop->logger, &conn->raop->callbacks,
-						       remotestr, rtpmapstr, fmtpstr, aeskey, aesiv);
+						       remotestr, rtpmapstr, fmtpstr, aeskey, aesiv,
+						       conn->raop->buffer_length, conn->raop->lazy_decode);
+		}
+		if (conn->raop_rtp) {
+			raop_rtp_set_plc_mode(conn->raop_rtp, conn->raop->plc_mode);
+			raop_rtp_set_resample(conn->raop_rtp, conn->raop->resample);
+			raop_rtp_set_pool(conn->raop_rtp, conn->raop->pool);
+			raop_rtp_set_metrics(conn->raop_rtp, &conn->raop->metrics);
+			if (conn->capture_session) {
+				raop_rtp_set_capture(conn->raop_rtp, conn->raop->capture, conn->capture_session);
+			}
+		}
+		if (conn->raop_rtp && minlatencystr) {
+			logger_log(conn->raop->logger, LOGGER_DEBUG, "min-latency: %s", minlatencystr);
+			raop_rtp_set_min_latency(conn->raop_rtp, strtoul(minlatencystr, NULL, 10));
 		}
 		if (!conn->raop_rtp) {
 			logger_log(conn->raop->logger, LOGGER_ERR, "Error initializing the audio decoder");
@@ -271,7 +286,9 @@ raop_handler_setup(raop_conn_t *conn,
 		}
 		free(original);
 	}
-	if (conn->raop_rtp) {
+	if (conn->raop_rtp && conn->raop->replaying) {
+		raop_rtp_start_replay(conn->raop_rtp, remote_cport);
+	} else if (conn->raop_rtp) {
 		raop_rtp_start(conn->raop_rtp, use_udp, remote_cport, remote_tport, &cport, &tport, &dport);
 	} else {
 		logger_log(conn->raop->logger, LOGGER_ERR, "RAOP not initialized at SETUP, playing will fail!");
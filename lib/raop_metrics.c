@@ -0,0 +1,76 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <assert.h>
+#include <time.h>
+
+#include "raop_metrics.h"
+
+void
+raop_metrics_add(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+void
+raop_metrics_set(long long *gauge, long long value)
+{
+	__atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+void
+raop_metrics_histogram(raop_histogram_t *histogram, unsigned long long value)
+{
+	unsigned long long max;
+	int bucket;
+
+	/* Bucket by the bit length of the value */
+	bucket = value ? 64 - __builtin_clzll(value) : 0;
+	if (bucket >= RAOP_METRICS_BUCKETS) {
+		bucket = RAOP_METRICS_BUCKETS-1;
+	}
+	__atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, 1,
+	                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t
+raop_metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+raop_metrics_read(const raop_metrics_t *metrics, raop_metrics_t *snapshot)
+{
+	const unsigned long long *src = (const unsigned long long *)metrics;
+	unsigned long long *dst = (unsigned long long *)snapshot;
+	unsigned int i;
+
+	assert(metrics);
+	assert(snapshot);
+
+	/* Every field is a 64-bit counter or gauge, each one is read whole
+	 * but they are not read at the same instant */
+	for (i=0; i<sizeof(raop_metrics_t)/sizeof(unsigned long long); i++) {
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+}
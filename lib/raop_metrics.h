@@ -0,0 +1,41 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_METRICS_H
+#define RAOP_METRICS_H
+
+#include <stdint.h>
+
+/* For raop_metrics_t */
+#include "raop.h"
+
+/* Updates are relaxed atomics, any thread may update or read at any time.
+ * All of them accept a NULL metrics, which is a session without one. */
+#define raop_metrics_count(metrics, field, n) \
+	do { if (metrics) raop_metrics_add(&(metrics)->field, (n)); } while (0)
+#define raop_metrics_record(metrics, field, value) \
+	do { if (metrics) raop_metrics_histogram(&(metrics)->field, (value)); } while (0)
+#define raop_metrics_gauge(metrics, field, value) \
+	do { if (metrics) raop_metrics_set(&(metrics)->field, (value)); } while (0)
+
+void raop_metrics_add(unsigned long long *counter, unsigned long long n);
+void raop_metrics_histogram(raop_histogram_t *histogram, unsigned long long value);
+void raop_metrics_set(long long *gauge, long long value);
+
+/* Monotonic nanoseconds for the timing histograms */
+uint64_t raop_metrics_now(void);
+
+void raop_metrics_read(const raop_metrics_t *metrics, raop_metrics_t *snapshot);
+
+#endif
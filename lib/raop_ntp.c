@@ -0,0 +1,274 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "raop_ntp.h"
+
+/* Gains of the offset and skew filter, and the largest skew accepted */
+#define RAOP_NTP_OFFSET_GAIN 0.3
+#define RAOP_NTP_SKEW_GAIN   0.05
+#define RAOP_NTP_MAX_SKEW    500e-6
+
+typedef struct {
+	/* Local time of the exchange midpoint */
+	uint64_t local_time;
+	/* Remote minus local clock, and round trip delay */
+	int64_t offset;
+	uint64_t delay;
+} raop_ntp_sample_t;
+
+struct raop_ntp_s {
+	unsigned int sample_rate;
+
+	/* Last exchanges, the one with the lowest delay is trusted */
+	raop_ntp_sample_t samples[RAOP_NTP_WINDOW];
+	int sample_count;
+	int sample_next;
+	uint64_t best_time;
+
+	/* Filtered offset at filter_time and skew in ns per ns */
+	int synced;
+	uint64_t filter_time;
+	int64_t filter_offset;
+	double filter_skew;
+	uint64_t filter_delay;
+
+	/* RTP timestamp of the sender at a remote time, from sync packets */
+	int has_anchor;
+	unsigned int anchor_rtp;
+	uint64_t anchor_remote;
+	unsigned int latency;
+};
+
+raop_ntp_t *
+raop_ntp_init(unsigned int sample_rate)
+{
+	raop_ntp_t *raop_ntp;
+
+	assert(sample_rate);
+
+	raop_ntp = calloc(1, sizeof(raop_ntp_t));
+	if (!raop_ntp) {
+		return NULL;
+	}
+	raop_ntp->sample_rate = sample_rate;
+	return raop_ntp;
+}
+
+void
+raop_ntp_destroy(raop_ntp_t *raop_ntp)
+{
+	free(raop_ntp);
+}
+
+uint64_t
+raop_ntp_get_local_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t
+raop_ntp_timestamp_to_nano(uint64_t timestamp)
+{
+	return (timestamp >> 32) * 1000000000ull +
+	       (((timestamp & 0xffffffffull) * 1000000000ull) >> 32);
+}
+
+uint64_t
+raop_ntp_nano_to_timestamp(uint64_t nano)
+{
+	uint64_t sec = nano / 1000000000ull;
+	uint64_t frac = ((nano % 1000000000ull) << 32) / 1000000000ull;
+
+	return (sec << 32) | frac;
+}
+
+static void
+raop_ntp_update_filter(raop_ntp_t *raop_ntp, const raop_ntp_sample_t *sample)
+{
+	double dt, error;
+	int64_t predicted;
+
+	if (!raop_ntp->synced || sample->local_time <= raop_ntp->filter_time) {
+		raop_ntp->filter_time = sample->local_time;
+		raop_ntp->filter_offset = sample->offset;
+		raop_ntp->filter_delay = sample->delay;
+		raop_ntp->synced = 1;
+		return;
+	}
+
+	/* Predict the offset with the current skew and correct both with the error */
+	dt = (double)(sample->local_time - raop_ntp->filter_time);
+	predicted = raop_ntp->filter_offset + (int64_t)(raop_ntp->filter_skew * dt);
+	error = (double)(sample->offset - predicted);
+
+	raop_ntp->filter_offset = predicted + (int64_t)(RAOP_NTP_OFFSET_GAIN * error);
+	raop_ntp->filter_skew += RAOP_NTP_SKEW_GAIN * error / dt;
+	if (raop_ntp->filter_skew > RAOP_NTP_MAX_SKEW) {
+		raop_ntp->filter_skew = RAOP_NTP_MAX_SKEW;
+	} else if (raop_ntp->filter_skew < -RAOP_NTP_MAX_SKEW) {
+		raop_ntp->filter_skew = -RAOP_NTP_MAX_SKEW;
+	}
+	raop_ntp->filter_time = sample->local_time;
+	raop_ntp->filter_delay = sample->delay;
+}
+
+int
+raop_ntp_process_reply(raop_ntp_t *raop_ntp, uint64_t origin, uint64_t receive,
+                       uint64_t transmit, uint64_t local_time)
+{
+	raop_ntp_sample_t *sample, *best;
+	int64_t remote_time;
+	int i;
+
+	assert(raop_ntp);
+
+	/* Reject replies that are not to our queries */
+	if (origin > local_time || transmit < receive) {
+		return -1;
+	}
+
+	/* Store the offset and delay of this exchange */
+	sample = &raop_ntp->samples[raop_ntp->sample_next];
+	remote_time = (int64_t)(transmit - receive);
+	sample->delay = (local_time - origin) - remote_time;
+	if ((int64_t)sample->delay < 0) {
+		sample->delay = 0;
+	}
+	sample->offset = ((int64_t)(receive - origin) + (int64_t)(transmit - local_time)) / 2;
+	sample->local_time = origin + (local_time - origin) / 2;
+	raop_ntp->sample_next = (raop_ntp->sample_next + 1) % RAOP_NTP_WINDOW;
+	if (raop_ntp->sample_count < RAOP_NTP_WINDOW) {
+		raop_ntp->sample_count++;
+	}
+
+	/* Queueing only adds delay, so the fastest exchange is the most accurate */
+	best = &raop_ntp->samples[0];
+	for (i=1; i<raop_ntp->sample_count; i++) {
+		if (raop_ntp->samples[i].delay < best->delay) {
+			best = &raop_ntp->samples[i];
+		}
+	}
+	if (best->local_time != raop_ntp->best_time) {
+		raop_ntp->best_time = best->local_time;
+		raop_ntp_update_filter(raop_ntp, best);
+	}
+	return 0;
+}
+
+void
+raop_ntp_process_sync(raop_ntp_t *raop_ntp, unsigned int rtp_time,
+                      uint64_t remote_time, unsigned int latency)
+{
+	assert(raop_ntp);
+
+	raop_ntp->anchor_rtp = rtp_time;
+	raop_ntp->anchor_remote = remote_time;
+	raop_ntp->latency = latency;
+	raop_ntp->has_anchor = 1;
+}
+
+void
+raop_ntp_reset(raop_ntp_t *raop_ntp)
+{
+	unsigned int sample_rate;
+
+	assert(raop_ntp);
+
+	sample_rate = raop_ntp->sample_rate;
+	memset(raop_ntp, 0, sizeof(raop_ntp_t));
+	raop_ntp->sample_rate = sample_rate;
+}
+
+int
+raop_ntp_is_synced(raop_ntp_t *raop_ntp)
+{
+	assert(raop_ntp);
+
+	return raop_ntp->synced;
+}
+
+int64_t
+raop_ntp_get_offset(raop_ntp_t *raop_ntp, uint64_t local_time)
+{
+	double dt;
+
+	assert(raop_ntp);
+
+	dt = (double)(int64_t)(local_time - raop_ntp->filter_time);
+	return raop_ntp->filter_offset + (int64_t)(raop_ntp->filter_skew * dt);
+}
+
+double
+raop_ntp_get_skew(raop_ntp_t *raop_ntp)
+{
+	assert(raop_ntp);
+
+	return raop_ntp->filter_skew;
+}
+
+uint64_t
+raop_ntp_get_delay(raop_ntp_t *raop_ntp)
+{
+	assert(raop_ntp);
+
+	return raop_ntp->filter_delay;
+}
+
+unsigned int
+raop_ntp_get_latency(raop_ntp_t *raop_ntp)
+{
+	assert(raop_ntp);
+
+	return raop_ntp->latency;
+}
+
+uint64_t
+raop_ntp_remote_to_local(raop_ntp_t *raop_ntp, uint64_t remote_time)
+{
+	uint64_t local_time;
+
+	assert(raop_ntp);
+
+	/* Evaluate the offset at the approximate local time */
+	local_time = remote_time - raop_ntp->filter_offset;
+	return remote_time - raop_ntp_get_offset(raop_ntp, local_time);
+}
+
+int
+raop_ntp_rtp_to_local(raop_ntp_t *raop_ntp, unsigned int rtp_time, uint64_t *local_time)
+{
+	int64_t samples;
+	uint64_t remote_time;
+
+	assert(raop_ntp);
+	assert(local_time);
+
+	if (!raop_ntp->synced || !raop_ntp->has_anchor) {
+		return -1;
+	}
+
+	/* RTP timestamps wrap, so only the signed distance is meaningful */
+	samples = (int32_t)(rtp_time - raop_ntp->anchor_rtp);
+	remote_time = raop_ntp->anchor_remote + samples * 1000000000ll / raop_ntp->sample_rate;
+	*local_time = raop_ntp_remote_to_local(raop_ntp, remote_time);
+	return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_NTP_H
+#define RAOP_NTP_H
+
+#include <stdint.h>
+
+typedef struct raop_ntp_s raop_ntp_t;
+
+/* Number of timing exchanges the minimum delay is picked from */
+#define RAOP_NTP_WINDOW 8
+
+raop_ntp_t *raop_ntp_init(unsigned int sample_rate);
+
+/* Local clock in nanoseconds, monotonic */
+uint64_t raop_ntp_get_local_time();
+
+/* Conversions between 32.32 NTP timestamps and nanoseconds */
+uint64_t raop_ntp_timestamp_to_nano(uint64_t timestamp);
+uint64_t raop_ntp_nano_to_timestamp(uint64_t nano);
+
+/* Origin is our local transmit time echoed back, receive and transmit
+ * are remote times and local_time is when the reply arrived */
+int raop_ntp_process_reply(raop_ntp_t *raop_ntp, uint64_t origin, uint64_t receive,
+                           uint64_t transmit, uint64_t local_time);
+void raop_ntp_process_sync(raop_ntp_t *raop_ntp, unsigned int rtp_time,
+                           uint64_t remote_time, unsigned int latency);
+void raop_ntp_reset(raop_ntp_t *raop_ntp);
+
+int raop_ntp_is_synced(raop_ntp_t *raop_ntp);
+int64_t raop_ntp_get_offset(raop_ntp_t *raop_ntp, uint64_t local_time);
+double raop_ntp_get_skew(raop_ntp_t *raop_ntp);
+uint64_t raop_ntp_get_delay(raop_ntp_t *raop_ntp);
+unsigned int raop_ntp_get_latency(raop_ntp_t *raop_ntp);
+
+uint64_t raop_ntp_remote_to_local(raop_ntp_t *raop_ntp, uint64_t remote_time);
+int raop_ntp_rtp_to_local(raop_ntp_t *raop_ntp, unsigned int rtp_time, uint64_t *local_time);
+
+void raop_ntp_destroy(raop_ntp_t *raop_ntp);
+
+#endif
@@ -0,0 +1,312 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "raop_plc.h"
+
+/* Frames smoothing the joins into and out of a concealed gap */
+#define RAOP_PLC_OVERLAP    32
+
+/* Consecutive concealed frames until the output is faded to silence */
+#define RAOP_PLC_FADE       5
+
+/* Window matched when searching the pitch period, and the shortest period */
+#define RAOP_PLC_MATCH      64
+#define RAOP_PLC_MIN_PERIOD 32
+
+/* Below this normalised correlation the signal is treated as noise */
+#define RAOP_PLC_MIN_CORRELATION 0.3
+
+struct raop_plc_s {
+	int mode;
+	int channels;
+	int frame_length;
+
+	/* Last decoded frame, the concealment is built from it, and
+	 * its channels summed for the pitch search */
+	short *history;
+	int history_len;
+	int *mono;
+
+	/* Consecutive concealed frames, and the position in the periodic extension */
+	int count;
+	int period;
+	int phase;
+
+	/* Last two output samples per channel, the next frame starts from them */
+	int *last;
+
+	/* Continuation of the concealment, crossfaded into the next decoded frame */
+	short *tail;
+	int pending;
+
+	raop_plc_stats_t stats;
+};
+
+raop_plc_t *
+raop_plc_init(int channels, int frame_length)
+{
+	raop_plc_t *raop_plc;
+
+	assert(channels > 0);
+	assert(frame_length > 0);
+
+	raop_plc = calloc(1, sizeof(raop_plc_t));
+	if (!raop_plc) {
+		return NULL;
+	}
+	raop_plc->mode = RAOP_PLC_REPEAT;
+	raop_plc->channels = channels;
+	raop_plc->frame_length = frame_length;
+	raop_plc->history = malloc(frame_length * channels * sizeof(short));
+	raop_plc->mono = malloc(frame_length * sizeof(int));
+	raop_plc->last = malloc(2 * channels * sizeof(int));
+	raop_plc->tail = malloc(RAOP_PLC_OVERLAP * channels * sizeof(short));
+	if (!raop_plc->history || !raop_plc->mono || !raop_plc->last || !raop_plc->tail) {
+		raop_plc_destroy(raop_plc);
+		return NULL;
+	}
+	return raop_plc;
+}
+
+void
+raop_plc_destroy(raop_plc_t *raop_plc)
+{
+	if (raop_plc) {
+		free(raop_plc->history);
+		free(raop_plc->mono);
+		free(raop_plc->last);
+		free(raop_plc->tail);
+		free(raop_plc);
+	}
+}
+
+void
+raop_plc_set_mode(raop_plc_t *raop_plc, int mode)
+{
+	assert(raop_plc);
+
+	if (mode < RAOP_PLC_SILENCE || mode > RAOP_PLC_EXTRAPOLATE) {
+		mode = RAOP_PLC_SILENCE;
+	}
+	raop_plc->mode = mode;
+	raop_plc_reset(raop_plc);
+}
+
+int
+raop_plc_get_mode(raop_plc_t *raop_plc)
+{
+	assert(raop_plc);
+
+	return raop_plc->mode;
+}
+
+void
+raop_plc_reset(raop_plc_t *raop_plc)
+{
+	assert(raop_plc);
+
+	raop_plc->history_len = 0;
+	raop_plc->count = 0;
+	raop_plc->pending = 0;
+}
+
+void
+raop_plc_get_stats(raop_plc_t *raop_plc, raop_plc_stats_t *stats)
+{
+	assert(raop_plc);
+	assert(stats);
+
+	memcpy(stats, &raop_plc->stats, sizeof(raop_plc_stats_t));
+}
+
+static short
+clamp_sample(int value)
+{
+	return (value > 32767) ? 32767 : (value < -32768) ? -32768 : value;
+}
+
+void
+raop_plc_good_frame(raop_plc_t *raop_plc, short *frame, int frames)
+{
+	int channels;
+	int i, ch;
+
+	assert(raop_plc);
+	assert(frame);
+
+	if (raop_plc->mode == RAOP_PLC_SILENCE) {
+		return;
+	}
+	channels = raop_plc->channels;
+	if (frames > raop_plc->frame_length) {
+		frames = raop_plc->frame_length;
+	}
+
+	/* Fade from the concealment back into the real signal */
+	if (raop_plc->pending) {
+		int overlap = (frames < RAOP_PLC_OVERLAP) ? frames : RAOP_PLC_OVERLAP;
+		for (i=0; i<overlap; i++) {
+			int w = (i+1) * 256 / (RAOP_PLC_OVERLAP+1);
+			for (ch=0; ch<channels; ch++) {
+				int real = frame[i*channels+ch];
+				int tail = raop_plc->tail[i*channels+ch];
+				frame[i*channels+ch] = clamp_sample((real*w + tail*(256-w)) / 256);
+			}
+		}
+		raop_plc->pending = 0;
+	}
+	raop_plc->count = 0;
+
+	memcpy(raop_plc->history, frame, frames * channels * sizeof(short));
+	raop_plc->history_len = frames;
+}
+
+/* Period whose preceding samples best match the end of the history */
+static int
+find_period(raop_plc_t *raop_plc)
+{
+	const short *history = raop_plc->history;
+	int channels = raop_plc->channels;
+	int length = raop_plc->history_len;
+	double tail_energy = 0.0, energy = 0.0, best = RAOP_PLC_MIN_CORRELATION;
+	int best_period = length;
+	int period, i, ch;
+	int *mono = raop_plc->mono;
+
+	if (length < RAOP_PLC_MATCH + RAOP_PLC_MIN_PERIOD) {
+		return length;
+	}
+	for (i=0; i<length; i++) {
+		mono[i] = 0;
+		for (ch=0; ch<channels; ch++) {
+			mono[i] += history[i*channels+ch];
+		}
+	}
+
+	for (i=length-RAOP_PLC_MATCH; i<length; i++) {
+		tail_energy += (double)mono[i] * mono[i];
+	}
+	for (i=length-RAOP_PLC_MATCH-RAOP_PLC_MIN_PERIOD; i<length-RAOP_PLC_MIN_PERIOD; i++) {
+		energy += (double)mono[i] * mono[i];
+	}
+	for (period=RAOP_PLC_MIN_PERIOD; period<=length-RAOP_PLC_MATCH; period++) {
+		const int *tail = mono + length - RAOP_PLC_MATCH;
+		const int *candidate = tail - period;
+		double correlation = 0.0;
+
+		for (i=0; i<RAOP_PLC_MATCH; i++) {
+			correlation += (double)tail[i] * candidate[i];
+		}
+		if (energy > 0.0 && tail_energy > 0.0) {
+			correlation /= sqrt(energy * tail_energy);
+			if (correlation > best) {
+				best = correlation;
+				best_period = period;
+			}
+		}
+
+		/* Slide the candidate window back by one */
+		if (period < length - RAOP_PLC_MATCH) {
+			energy += (double)candidate[-1] * candidate[-1];
+			energy -= (double)candidate[RAOP_PLC_MATCH-1] * candidate[RAOP_PLC_MATCH-1];
+		}
+	}
+	return best_period;
+}
+
+void
+raop_plc_conceal(raop_plc_t *raop_plc, short *frame, int frames)
+{
+	const short *source;
+	int channels, length, period;
+	int gain_start, gain_end;
+	int i, ch;
+
+	assert(raop_plc);
+	assert(frame);
+
+	channels = raop_plc->channels;
+	length = raop_plc->history_len;
+	raop_plc->stats.concealed++;
+	raop_plc->count++;
+
+	/* Nothing to build from, or faded out already */
+	gain_start = 256 - (raop_plc->count-1) * 256 / RAOP_PLC_FADE;
+	if (raop_plc->mode == RAOP_PLC_SILENCE || length < 2 || gain_start <= 0) {
+		memset(frame, 0, frames * channels * sizeof(short));
+		raop_plc->stats.muted++;
+		raop_plc->pending = 0;
+		return;
+	}
+	gain_end = 256 - raop_plc->count * 256 / RAOP_PLC_FADE;
+	if (gain_end < 0) {
+		gain_end = 0;
+	}
+
+	/* The first frame of a gap picks the period and starts from the history */
+	if (raop_plc->count == 1) {
+		raop_plc->period = length;
+		if (raop_plc->mode == RAOP_PLC_EXTRAPOLATE) {
+			raop_plc->period = find_period(raop_plc);
+		}
+		raop_plc->phase = 0;
+		for (ch=0; ch<channels; ch++) {
+			raop_plc->last[ch*2] = raop_plc->history[(length-2)*channels+ch];
+			raop_plc->last[ch*2+1] = raop_plc->history[(length-1)*channels+ch];
+		}
+	}
+	period = raop_plc->period;
+	source = raop_plc->history + (length-period)*channels;
+
+	for (ch=0; ch<channels; ch++) {
+		/* Continue the slope of the previous output and ramp the step away */
+		int expected = 2*raop_plc->last[ch*2+1] - raop_plc->last[ch*2];
+		int phase = raop_plc->phase;
+		int offset = expected - source[phase*channels+ch] * gain_start / 256;
+
+		for (i=0; i<frames; i++) {
+			int gain = gain_start + (gain_end-gain_start) * i / frames;
+			int value = source[phase*channels+ch] * gain / 256;
+			if (i < RAOP_PLC_OVERLAP) {
+				value += offset * (RAOP_PLC_OVERLAP-i) / RAOP_PLC_OVERLAP;
+			}
+			frame[i*channels+ch] = clamp_sample(value);
+			if (++phase == period) {
+				phase = 0;
+			}
+		}
+		raop_plc->last[ch*2] = (frames > 1) ? frame[(frames-2)*channels+ch] : raop_plc->last[ch*2+1];
+		raop_plc->last[ch*2+1] = frame[(frames-1)*channels+ch];
+
+		/* Keep going for the crossfade into the next decoded frame, the
+		 * extension may wrap at the frame end so it is smoothed the same way */
+		expected = 2*raop_plc->last[ch*2+1] - raop_plc->last[ch*2];
+		offset = expected - source[phase*channels+ch] * gain_end / 256;
+		for (i=0; i<RAOP_PLC_OVERLAP; i++) {
+			int value = source[phase*channels+ch] * gain_end / 256;
+			value += offset * (RAOP_PLC_OVERLAP-i) / RAOP_PLC_OVERLAP;
+			raop_plc->tail[i*channels+ch] = clamp_sample(value);
+			if (++phase == period) {
+				phase = 0;
+			}
+		}
+	}
+	raop_plc->phase = (raop_plc->phase + frames) % period;
+	raop_plc->pending = 1;
+}
@@ -0,0 +1,45 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_PLC_H
+#define RAOP_PLC_H
+
+/* For the RAOP_PLC_* modes */
+#include "raop.h"
+
+typedef struct raop_plc_s raop_plc_t;
+
+/* Missing frames replaced, and those of them that were faded out to silence */
+typedef struct {
+	unsigned long long concealed;
+	unsigned long long muted;
+} raop_plc_stats_t;
+
+raop_plc_t *raop_plc_init(int channels, int frame_length);
+
+void raop_plc_set_mode(raop_plc_t *raop_plc, int mode);
+int raop_plc_get_mode(raop_plc_t *raop_plc);
+
+/* Called with every decoded frame, smooths the return from a concealed gap */
+void raop_plc_good_frame(raop_plc_t *raop_plc, short *frame, int frames);
+
+/* Fills a missing frame of 16-bit interleaved samples */
+void raop_plc_conceal(raop_plc_t *raop_plc, short *frame, int frames);
+
+void raop_plc_get_stats(raop_plc_t *raop_plc, raop_plc_stats_t *stats);
+void raop_plc_reset(raop_plc_t *raop_plc);
+
+void raop_plc_destroy(raop_plc_t *raop_plc);
+
+#endif
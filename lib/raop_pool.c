@@ -0,0 +1,263 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/* For pthread_setaffinity_np */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "raop_pool.h"
+#include "threads.h"
+#include "compat.h"
+
+/* Events handled per epoll_wait call of a worker */
+#define RAOP_POOL_EVENTS 32
+
+typedef struct raop_pool_worker_s raop_pool_worker_t;
+
+typedef struct {
+	int fd;
+	raop_pool_step_t step;
+	raop_pool_done_t done;
+	void *opaque;
+	raop_pool_worker_t *worker;
+} raop_pool_session_t;
+
+struct raop_pool_worker_s {
+	raop_pool_t *pool;
+	int index;
+
+	/* Sessions and the stop event share one epoll descriptor */
+	int epoll_fd;
+	int stop_fd;
+	thread_handle_t thread;
+
+	/* Protected by the pool mutex */
+	int sessions;
+};
+
+struct raop_pool_s {
+	logger_t *logger;
+
+	int workers;
+	raop_pool_worker_t *worker;
+
+	mutex_handle_t mutex;
+};
+
+static THREAD_RETVAL
+raop_pool_thread(void *arg)
+{
+	raop_pool_worker_t *worker = arg;
+	raop_pool_t *raop_pool = worker->pool;
+	struct epoll_event events[RAOP_POOL_EVENTS];
+
+	while (1) {
+		int nevents, i;
+
+		nevents = epoll_wait(worker->epoll_fd, events, RAOP_POOL_EVENTS, -1);
+		if (nevents == -1) {
+			if (errno == EINTR)
+				continue;
+			logger_log(raop_pool->logger, LOGGER_ERR, "raop_pool_thread: epoll error %s, exiting", strerror(errno));
+			break;
+		}
+		for (i=0; i<nevents; i++) {
+			raop_pool_session_t *session = events[i].data.ptr;
+
+			if (!session) {
+				/* Only signalled when the pool is destroyed */
+				return 0;
+			}
+			if (session->step(session->opaque)) {
+				epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+				MUTEX_LOCK(raop_pool->mutex);
+				worker->sessions--;
+				MUTEX_UNLOCK(raop_pool->mutex);
+
+				/* The owner may free opaque once done returns, nothing else
+				 * in this batch refers to it as each descriptor is added once */
+				session->done(session->opaque);
+				free(session);
+			}
+		}
+	}
+	return 0;
+}
+
+static void
+raop_pool_pin(raop_pool_t *raop_pool, raop_pool_worker_t *worker)
+{
+#if defined(__linux__)
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if (cpus < 1) {
+		return;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(worker->index % cpus, &set);
+	if (pthread_setaffinity_np(worker->thread, sizeof(set), &set)) {
+		logger_log(raop_pool->logger, LOGGER_WARNING, "Pinning worker %d failed", worker->index);
+	}
+#endif
+}
+
+raop_pool_t *
+raop_pool_init(logger_t *logger, int workers)
+{
+	raop_pool_t *raop_pool;
+	int i;
+
+	assert(logger);
+
+	if (workers < 1) {
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (workers < 1) {
+			workers = 1;
+		}
+	}
+
+	raop_pool = calloc(1, sizeof(raop_pool_t));
+	if (!raop_pool) {
+		return NULL;
+	}
+	raop_pool->logger = logger;
+	raop_pool->worker = calloc(workers, sizeof(raop_pool_worker_t));
+	if (!raop_pool->worker) {
+		free(raop_pool);
+		return NULL;
+	}
+	MUTEX_CREATE(raop_pool->mutex);
+
+	for (i=0; i<workers; i++) {
+		raop_pool_worker_t *worker = &raop_pool->worker[i];
+		struct epoll_event ev;
+
+		worker->pool = raop_pool;
+		worker->index = i;
+		worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		worker->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (worker->epoll_fd == -1 || worker->stop_fd == -1) {
+			if (worker->epoll_fd != -1) close(worker->epoll_fd);
+			if (worker->stop_fd != -1) close(worker->stop_fd);
+			break;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->stop_fd, &ev);
+
+		THREAD_CREATE(worker->thread, raop_pool_thread, worker);
+		if (!worker->thread) {
+			close(worker->epoll_fd);
+			close(worker->stop_fd);
+			break;
+		}
+		raop_pool_pin(raop_pool, worker);
+	}
+	raop_pool->workers = i;
+	if (!raop_pool->workers) {
+		logger_log(logger, LOGGER_ERR, "Error starting worker threads");
+		raop_pool_destroy(raop_pool);
+		return NULL;
+	}
+	logger_log(logger, LOGGER_INFO, "Started %d RTP worker threads", raop_pool->workers);
+	return raop_pool;
+}
+
+int
+raop_pool_get_workers(raop_pool_t *raop_pool)
+{
+	assert(raop_pool);
+
+	return raop_pool->workers;
+}
+
+int
+raop_pool_add(raop_pool_t *raop_pool, int fd, raop_pool_step_t step, raop_pool_done_t done, void *opaque)
+{
+	raop_pool_session_t *session;
+	raop_pool_worker_t *worker;
+	struct epoll_event ev;
+	int i;
+
+	assert(raop_pool);
+	assert(step);
+	assert(done);
+
+	session = calloc(1, sizeof(raop_pool_session_t));
+	if (!session) {
+		return -1;
+	}
+	session->fd = fd;
+	session->step = step;
+	session->done = done;
+	session->opaque = opaque;
+
+	MUTEX_LOCK(raop_pool->mutex);
+	worker = &raop_pool->worker[0];
+	for (i=1; i<raop_pool->workers; i++) {
+		if (raop_pool->worker[i].sessions < worker->sessions) {
+			worker = &raop_pool->worker[i];
+		}
+	}
+	worker->sessions++;
+	MUTEX_UNLOCK(raop_pool->mutex);
+	session->worker = worker;
+
+	/* The worker picks it up from here on, epoll_ctl is safe across threads */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = session;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		logger_log(raop_pool->logger, LOGGER_ERR, "Error adding session to worker: %s", strerror(errno));
+		MUTEX_LOCK(raop_pool->mutex);
+		worker->sessions--;
+		MUTEX_UNLOCK(raop_pool->mutex);
+		free(session);
+		return -1;
+	}
+	return 0;
+}
+
+void
+raop_pool_destroy(raop_pool_t *raop_pool)
+{
+	int i;
+
+	if (!raop_pool) {
+		return;
+	}
+	for (i=0; i<raop_pool->workers; i++) {
+		raop_pool_worker_t *worker = &raop_pool->worker[i];
+		uint64_t value = 1;
+
+		if (write(worker->stop_fd, &value, sizeof(value)) == -1) {
+			logger_log(raop_pool->logger, LOGGER_WARNING, "Stopping worker %d failed", i);
+		}
+		THREAD_JOIN(worker->thread);
+		close(worker->epoll_fd);
+		close(worker->stop_fd);
+	}
+	MUTEX_DESTROY(raop_pool->mutex);
+	free(raop_pool->worker);
+	free(raop_pool);
+}
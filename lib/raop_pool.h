@@ -0,0 +1,37 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_POOL_H
+#define RAOP_POOL_H
+
+#include "logger.h"
+
+typedef struct raop_pool_s raop_pool_t;
+
+/* Called by a worker whenever the session descriptor is readable, returns
+ * non-zero when the session is over, done is called after it is removed */
+typedef int (*raop_pool_step_t)(void *opaque);
+typedef void (*raop_pool_done_t)(void *opaque);
+
+/* Workers are pinned one per core, workers < 1 means one per online core */
+raop_pool_t *raop_pool_init(logger_t *logger, int workers);
+int raop_pool_get_workers(raop_pool_t *raop_pool);
+
+/* Hands the session to the least loaded worker */
+int raop_pool_add(raop_pool_t *raop_pool, int fd, raop_pool_step_t step, raop_pool_done_t done, void *opaque);
+
+/* All sessions must be over before the pool is destroyed */
+void raop_pool_destroy(raop_pool_t *raop_pool);
+
+#endif
@@ -0,0 +1,368 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "raop_resample.h"
+#include "compat.h"
+
+/* The dot product kernels have SSE2 and AVX2 versions on x86, they are
+ * compiled with target attributes and picked at runtime */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RESAMPLE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Windowed sinc filter, coefficients are interpolated between phases */
+#define RESAMPLE_TAPS        64
+#define RESAMPLE_PHASES      256
+#define RESAMPLE_CUTOFF      0.95
+#define RESAMPLE_KAISER_BETA 8.0
+
+/* Proportional gain per second of error, integral gain per second of
+ * error and of time, and the time constant smoothing the error */
+#define RESAMPLE_KP        0.05
+#define RESAMPLE_KI        0.00125
+#define RESAMPLE_SMOOTHING 1.0
+
+/* Corrections smaller than this leave the audio untouched, filtering
+ * stops again below half of it */
+#define RESAMPLE_DEADBAND  0.00002
+
+/* Returns the sum of (c + frac*d)*x over RESAMPLE_TAPS values */
+typedef float (*resample_dot_t)(const float *c, const float *d, float frac, const float *x);
+
+struct raop_resample_s {
+	int channels;
+	int capacity;
+
+	/* For each phase the coefficients and the difference to the next phase */
+	float *coefs;
+	resample_dot_t dot;
+
+	/* Planar input history of history_len frames per channel, the next
+	 * output is centered between frames floor(position) and +1 */
+	float *history;
+	int history_len;
+	double position;
+
+	/* Output frames per input frame, and the control loop state */
+	double ratio;
+	double error;
+	double integral;
+};
+
+static double
+bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	int k;
+
+	for (k=1; k<32; k++) {
+		term *= (x / (2.0*k)) * (x / (2.0*k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void
+init_coefs(float *coefs)
+{
+	double phase[RESAMPLE_TAPS];
+	float *prev = NULL;
+	int p, k;
+
+	for (p=0; p<=RESAMPLE_PHASES; p++) {
+		float *c = coefs + p*2*RESAMPLE_TAPS;
+		double sum = 0.0;
+
+		for (k=0; k<RESAMPLE_TAPS; k++) {
+			/* Distance of tap k from the output position */
+			double x = k - (RESAMPLE_TAPS/2 - 1) - (double)p/RESAMPLE_PHASES;
+			double w = x / (RESAMPLE_TAPS/2);
+			double s = (x == 0.0) ? 1.0 : sin(M_PI*RESAMPLE_CUTOFF*x) / (M_PI*RESAMPLE_CUTOFF*x);
+
+			w = (w*w < 1.0) ? bessel_i0(RESAMPLE_KAISER_BETA*sqrt(1.0-w*w)) / bessel_i0(RESAMPLE_KAISER_BETA) : 0.0;
+			phase[k] = s * w;
+			sum += phase[k];
+		}
+
+		/* Unity gain at DC for every phase */
+		for (k=0; k<RESAMPLE_TAPS; k++) {
+			c[k] = phase[k] / sum;
+			if (prev) {
+				prev[RESAMPLE_TAPS+k] = c[k] - prev[k];
+			}
+		}
+		prev = c;
+	}
+	memset(prev+RESAMPLE_TAPS, 0, RESAMPLE_TAPS*sizeof(float));
+}
+
+static float
+resample_dot_c(const float *c, const float *d, float frac, const float *x)
+{
+	float a = 0.0f, b = 0.0f;
+	int k;
+
+	for (k=0; k<RESAMPLE_TAPS; k++) {
+		a += c[k] * x[k];
+		b += d[k] * x[k];
+	}
+	return a + frac*b;
+}
+
+#ifdef RESAMPLE_X86_SIMD
+__attribute__((target("sse2")))
+static float
+resample_dot_sse2(const float *c, const float *d, float frac, const float *x)
+{
+	__m128 a = _mm_setzero_ps(), b = _mm_setzero_ps();
+	float out[4];
+	int k;
+
+	for (k=0; k<RESAMPLE_TAPS; k+=4) {
+		__m128 v = _mm_loadu_ps(x+k);
+		a = _mm_add_ps(a, _mm_mul_ps(_mm_load_ps(c+k), v));
+		b = _mm_add_ps(b, _mm_mul_ps(_mm_load_ps(d+k), v));
+	}
+	a = _mm_add_ps(a, _mm_mul_ps(b, _mm_set1_ps(frac)));
+	_mm_storeu_ps(out, a);
+	return (out[0] + out[1]) + (out[2] + out[3]);
+}
+
+__attribute__((target("avx2")))
+static float
+resample_dot_avx2(const float *c, const float *d, float frac, const float *x)
+{
+	__m256 a = _mm256_setzero_ps(), b = _mm256_setzero_ps();
+	__m128 sum;
+	int k;
+
+	for (k=0; k<RESAMPLE_TAPS; k+=8) {
+		__m256 v = _mm256_loadu_ps(x+k);
+		a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_load_ps(c+k), v));
+		b = _mm256_add_ps(b, _mm256_mul_ps(_mm256_load_ps(d+k), v));
+	}
+	a = _mm256_add_ps(a, _mm256_mul_ps(b, _mm256_set1_ps(frac)));
+	sum = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+}
+#endif /* RESAMPLE_X86_SIMD */
+
+static resample_dot_t
+select_dot(void)
+{
+#ifdef RESAMPLE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return resample_dot_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return resample_dot_sse2;
+#endif
+	return resample_dot_c;
+}
+
+raop_resample_t *
+raop_resample_init(int channels, int max_frames)
+{
+	raop_resample_t *raop_resample;
+
+	assert(channels > 0);
+	assert(max_frames > 0);
+
+	raop_resample = calloc(1, sizeof(raop_resample_t));
+	if (!raop_resample) {
+		return NULL;
+	}
+	raop_resample->channels = channels;
+	raop_resample->capacity = RESAMPLE_TAPS + 2*max_frames;
+
+	ALIGNED_MALLOC(raop_resample->coefs, 32, (RESAMPLE_PHASES+1)*2*RESAMPLE_TAPS*sizeof(float));
+	raop_resample->history = malloc(channels*raop_resample->capacity*sizeof(float));
+	if (!raop_resample->coefs || !raop_resample->history) {
+		if (raop_resample->coefs) ALIGNED_FREE(raop_resample->coefs);
+		free(raop_resample->history);
+		free(raop_resample);
+		return NULL;
+	}
+	init_coefs(raop_resample->coefs);
+	raop_resample->dot = select_dot();
+	raop_resample->ratio = 1.0;
+	raop_resample_reset(raop_resample);
+	return raop_resample;
+}
+
+void
+raop_resample_destroy(raop_resample_t *raop_resample)
+{
+	if (raop_resample) {
+		ALIGNED_FREE(raop_resample->coefs);
+		free(raop_resample->history);
+		free(raop_resample);
+	}
+}
+
+void
+raop_resample_reset(raop_resample_t *raop_resample)
+{
+	assert(raop_resample);
+
+	/* Start with silence before the first sample, the filter delay is half the taps */
+	raop_resample->history_len = RESAMPLE_TAPS/2 - 1;
+	raop_resample->position = RESAMPLE_TAPS/2 - 1;
+	memset(raop_resample->history, 0, raop_resample->channels*raop_resample->capacity*sizeof(float));
+}
+
+int
+raop_resample_get_max_output(raop_resample_t *raop_resample, int inframes)
+{
+	assert(raop_resample);
+
+	return (int)ceil(inframes * (1.0 + RAOP_RESAMPLE_MAX_CORRECTION)) + 2;
+}
+
+int
+raop_resample_process(raop_resample_t *raop_resample, const short *input, int inframes,
+                      short *output, int maxframes)
+{
+	int channels = raop_resample->channels;
+	int capacity = raop_resample->capacity;
+	double step = 1.0 / raop_resample->ratio;
+	int outframes = 0;
+	int i, ch, start;
+
+	assert(input);
+	assert(output);
+
+	/* Append the input to the planar history */
+	if (inframes > capacity - raop_resample->history_len) {
+		inframes = capacity - raop_resample->history_len;
+	}
+	for (ch=0; ch<channels; ch++) {
+		float *h = raop_resample->history + ch*capacity + raop_resample->history_len;
+		for (i=0; i<inframes; i++) {
+			h[i] = input[i*channels+ch];
+		}
+	}
+	raop_resample->history_len += inframes;
+
+	/* At ratio 1.0 the frames are copied through bit-exact. The history is
+	 * kept either way, so switching mode leaves no gap in the audio. */
+	if (raop_resample->ratio == 1.0) {
+		int index = (int)(raop_resample->position + 0.5);
+
+		for (; outframes < maxframes && index < raop_resample->history_len; outframes++, index++) {
+			for (ch=0; ch<channels; ch++) {
+				output[outframes*channels+ch] = (short)raop_resample->history[ch*capacity + index];
+			}
+		}
+		raop_resample->position = index;
+	}
+
+	/* Produce output while the filter has all its input */
+	while (raop_resample->ratio != 1.0 && outframes < maxframes) {
+		double position = raop_resample->position;
+		int index = (int)position;
+		double phase = (position - index) * RESAMPLE_PHASES;
+		int p = (int)phase;
+		float frac = (float)(phase - p);
+		const float *c = raop_resample->coefs + p*2*RESAMPLE_TAPS;
+
+		if (index + RESAMPLE_TAPS/2 >= raop_resample->history_len) {
+			break;
+		}
+		for (ch=0; ch<channels; ch++) {
+			const float *x = raop_resample->history + ch*capacity + index - (RESAMPLE_TAPS/2 - 1);
+			float y = raop_resample->dot(c, c+RESAMPLE_TAPS, frac, x);
+			long v = lrintf(y);
+			output[outframes*channels+ch] = (v > 32767) ? 32767 : (v < -32768) ? -32768 : v;
+		}
+		raop_resample->position += step;
+		outframes++;
+	}
+
+	/* Drop history the next output no longer needs */
+	start = (int)raop_resample->position - (RESAMPLE_TAPS/2 - 1);
+	if (start > raop_resample->history_len) {
+		start = raop_resample->history_len;
+	}
+	if (start > 0) {
+		for (ch=0; ch<channels; ch++) {
+			float *h = raop_resample->history + ch*capacity;
+			memmove(h, h+start, (raop_resample->history_len-start)*sizeof(float));
+		}
+		raop_resample->history_len -= start;
+		raop_resample->position -= start;
+	}
+	return outframes;
+}
+
+void
+raop_resample_update(raop_resample_t *raop_resample, double error, double interval)
+{
+	double correction;
+
+	assert(raop_resample);
+
+	/* Smooth out network jitter, then a PI loop steers the ratio */
+	raop_resample->error += (error - raop_resample->error) * interval / (RESAMPLE_SMOOTHING + interval);
+	raop_resample->integral += RESAMPLE_KI * raop_resample->error * interval;
+	if (raop_resample->integral > RAOP_RESAMPLE_MAX_CORRECTION) {
+		raop_resample->integral = RAOP_RESAMPLE_MAX_CORRECTION;
+	} else if (raop_resample->integral < -RAOP_RESAMPLE_MAX_CORRECTION) {
+		raop_resample->integral = -RAOP_RESAMPLE_MAX_CORRECTION;
+	}
+	correction = RESAMPLE_KP * raop_resample->error + raop_resample->integral;
+	if (correction > RAOP_RESAMPLE_MAX_CORRECTION) {
+		correction = RAOP_RESAMPLE_MAX_CORRECTION;
+	} else if (correction < -RAOP_RESAMPLE_MAX_CORRECTION) {
+		correction = -RAOP_RESAMPLE_MAX_CORRECTION;
+	}
+
+	/* Too much queued means the output is slow, so produce fewer frames */
+	if (fabs(correction) < ((raop_resample->ratio == 1.0) ? RESAMPLE_DEADBAND : RESAMPLE_DEADBAND/2)) {
+		correction = 0.0;
+	}
+	raop_resample->ratio = 1.0 - correction;
+}
+
+void
+raop_resample_set_ratio(raop_resample_t *raop_resample, double ratio)
+{
+	assert(raop_resample);
+
+	raop_resample->ratio = ratio;
+}
+
+double
+raop_resample_get_ratio(raop_resample_t *raop_resample)
+{
+	assert(raop_resample);
+
+	return raop_resample->ratio;
+}
+
+double
+raop_resample_get_error(raop_resample_t *raop_resample)
+{
+	assert(raop_resample);
+
+	return raop_resample->error;
+}
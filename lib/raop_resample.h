@@ -0,0 +1,43 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_RESAMPLE_H
+#define RAOP_RESAMPLE_H
+
+typedef struct raop_resample_s raop_resample_t;
+
+/* Largest ratio correction the control loop applies, 0.1% */
+#define RAOP_RESAMPLE_MAX_CORRECTION 0.001
+
+raop_resample_t *raop_resample_init(int channels, int max_frames);
+
+/* Output frames for inframes of input are at most this many */
+int raop_resample_get_max_output(raop_resample_t *raop_resample, int inframes);
+
+/* Resamples interleaved 16-bit input, returns the output frame count.
+ * Output may be the input buffer. At ratio 1.0 the frames come out unchanged. */
+int raop_resample_process(raop_resample_t *raop_resample, const short *input, int inframes,
+                          short *output, int maxframes);
+
+/* Error is in seconds, positive when more audio is queued than wanted */
+void raop_resample_update(raop_resample_t *raop_resample, double error, double interval);
+
+void raop_resample_set_ratio(raop_resample_t *raop_resample, double ratio);
+double raop_resample_get_ratio(raop_resample_t *raop_resample);
+double raop_resample_get_error(raop_resample_t *raop_resample);
+void raop_resample_reset(raop_resample_t *raop_resample);
+
+void raop_resample_destroy(raop_resample_t *raop_resample);
+
+#endif
@@ -12,15 +12,26 @@
  *  Lesser General Public License for more details.
  */
 
+/* For recvmmsg */
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "raop_rtp.h"
 #include "raop.h"
 #include "raop_buffer.h"
+#include "raop_ntp.h"
+#include "raop_resample.h"
+#include "raop_pool.h"
+#include "raop_capture.h"
 #include "netutils.h"
 #include "utils.h"
 #include "compat.h"
@@ -28,10 +39,30 @@
 
 #define NO_FLUSH (-42)
 
+/* Interval of the NTP timing queries sent to the remote */
+#define RAOP_RTP_NTP_INTERVAL_MS 3000
+
+/* Frames are written at most this early, and dropped when later than a frame */
+#define RAOP_RTP_PLAY_EARLY_NS 1000000
+
+/* Shortest wait before a missing packet is requested again */
+#define RAOP_RTP_RESEND_TIMEOUT_NS 20000000
+
+/* Datagrams read per recvmmsg call, UDP audio packets fit in the MTU */
+#define RAOP_RTP_BATCH 16
+#define RAOP_RTP_BATCH_PACKET_LEN 2048
+
 typedef unsigned char uchar;
 typedef unsigned short ushort;
 typedef unsigned int uint;
 
+typedef struct {
+	struct mmsghdr msgs[RAOP_RTP_BATCH];
+	struct iovec iovecs[RAOP_RTP_BATCH];
+	struct sockaddr_storage saddrs[RAOP_RTP_BATCH];
+	unsigned char packets[RAOP_RTP_BATCH][RAOP_RTP_BATCH_PACKET_LEN];
+} raop_rtp_batch_t;
+
 struct raop_rtp_s {
 	logger_t *logger;
 	raop_callbacks_t callbacks;
@@ -39,6 +70,9 @@ struct raop_rtp_s {
 	/* Buffer to handle all resends */
 	raop_buffer_t *buffer;
 
+	/* Clock synchronisation with the sender */
+	raop_ntp_t *ntp;
+
 	/* Remote address as sockaddr */
 	struct sockaddr_storage remote_saddr;
 	socklen_t remote_saddr_len;
@@ -62,10 +96,19 @@ struct raop_rtp_s {
 	int progress_changed;
 
 	int flush;
+	struct timespec flush_time;
 	thread_handle_t thread;
 	mutex_handle_t run_mutex;
 	/* MUTEX LOCKED VARIABLES END */
 
+	/* Signalled after changing the variables above */
+	int event_fd;
+
+	/* Runs the UDP session instead of a thread, signals done_fd when over */
+	raop_pool_t *pool;
+	int pooled;
+	int done_fd;
+
 	/* Remote control and timing ports */
 	unsigned short control_rport;
 	unsigned short timing_rport;
@@ -82,6 +125,44 @@ struct raop_rtp_s {
 	struct sockaddr_storage control_saddr;
 	socklen_t control_saddr_len;
 	unsigned short control_seqnum;
+
+	/* Receive calls and packets on the control and data sockets */
+	unsigned long long recv_calls;
+	unsigned long long recv_packets;
+
+	/* Sender min-latency in samples, and playout state of the UDP thread */
+	unsigned int min_latency;
+	int buffering;
+	int buffer_bytes;
+	unsigned long long late_frames;
+
+	/* UDP session state, owned by the thread or worker running it */
+	int opened;
+	void *cb_data;
+	int epoll_fd, timer_fd, play_fd, audio_fd;
+	uint32_t audio_events;
+	struct itimerspec ntprate;
+	raop_rtp_batch_t *batch;
+	unsigned long long last_recv_calls;
+	unsigned long long last_recv_packets;
+
+	/* Shared counters of the receiver, may be NULL */
+	raop_metrics_t *metrics;
+
+	/* Optional record of the received packets */
+	raop_capture_t *capture;
+	unsigned int capture_session;
+
+	/* Fed from a capture by raop_rtp_replay instead of the sockets */
+	int replaying;
+
+	/* Drift compensation between dequeue and output, only for 16-bit audio */
+	int resample_enabled;
+	raop_resample_t *resample;
+	short *resample_buf;
+	int resample_frames;
+	int has_playout_error;
+	double playout_error;
 };
 
 static unsigned long long
@@ -175,7 +256,8 @@ raop_rtp_parse_remote(raop_rtp_t *raop_rtp, const char *remote)
 raop_rtp_t *
 raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote,
               const char *rtpmap, const char *fmtp,
-              const unsigned char *aeskey, const unsigned char *aesiv)
+              const unsigned char *aeskey, const unsigned char *aesiv,
+              int buffer_length, int lazy_decode)
 {
 	raop_rtp_t *raop_rtp;
 
@@ -191,7 +273,7 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote,
 	}
 	raop_rtp->logger = logger;
 	memcpy(&raop_rtp->callbacks, callbacks, sizeof(raop_callbacks_t));
-	raop_rtp->buffer = raop_buffer_init(rtpmap, fmtp, aeskey, aesiv);
+	raop_rtp->buffer = raop_buffer_init(rtpmap, fmtp, aeskey, aesiv, buffer_length, lazy_decode);
 	if (!raop_rtp->buffer) {
 		free(raop_rtp);
 		return NULL;
@@ -200,6 +282,24 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote,
 		free(raop_rtp);
 		return NULL;
 	}
+	raop_rtp->ntp = raop_ntp_init(raop_buffer_get_config(raop_rtp->buffer)->sampleRate);
+	if (!raop_rtp->ntp) {
+		raop_buffer_destroy(raop_rtp->buffer);
+		free(raop_rtp);
+		return NULL;
+	}
+	raop_rtp->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	raop_rtp->done_fd = eventfd(0, EFD_CLOEXEC);
+	if (raop_rtp->event_fd == -1 || raop_rtp->done_fd == -1) {
+		if (raop_rtp->event_fd != -1) close(raop_rtp->event_fd);
+		if (raop_rtp->done_fd != -1) close(raop_rtp->done_fd);
+		raop_ntp_destroy(raop_rtp->ntp);
+		raop_buffer_destroy(raop_rtp->buffer);
+		free(raop_rtp);
+		return NULL;
+	}
+	raop_rtp->epoll_fd = raop_rtp->timer_fd = raop_rtp->play_fd = -1;
+	raop_rtp->resample_enabled = 1;
 
 	raop_rtp->running = 0;
 	raop_rtp->joined = 1;
@@ -216,6 +316,9 @@ raop_rtp_destroy(raop_rtp_t *raop_rtp)
 		raop_rtp_stop(raop_rtp);
 
 		MUTEX_DESTROY(raop_rtp->run_mutex);
+		close(raop_rtp->event_fd);
+		close(raop_rtp->done_fd);
+		raop_ntp_destroy(raop_rtp->ntp);
 		raop_buffer_destroy(raop_rtp->buffer);
 		free(raop_rtp->metadata);
 		free(raop_rtp->coverart);
@@ -269,6 +372,17 @@ sockets_cleanup:
 	return -1;
 }
 
+static void
+raop_rtp_wakeup(raop_rtp_t *raop_rtp)
+{
+	uint64_t value = 1;
+
+	/* Only fails when the counter is about to overflow, it is signalled anyway */
+	if (write(raop_rtp->event_fd, &value, sizeof(value)) == -1) {
+		logger_log(raop_rtp->logger, LOGGER_DEBUG, "Wakeup failed: %d", errno);
+	}
+}
+
 static int
 raop_rtp_resend_callback(void *opaque, unsigned short seqnum, unsigned short count)
 {
@@ -283,6 +397,7 @@ raop_rtp_resend_callback(void *opaque, unsigned short seqnum, unsigned short cou
 	addrlen = raop_rtp->control_saddr_len;
 
 	logger_log(raop_rtp->logger, LOGGER_DEBUG, "Got resend request %d %d", seqnum, count);
+	raop_metrics_count(raop_rtp->metrics, resend_requests, 1);
 	ourseqnum = raop_rtp->control_seqnum++;
 
 	/* Fill the request buffer */
@@ -307,6 +422,7 @@ static int
 raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
 {
 	int flush;
+	struct timespec flush_time;
 	float volume;
 	int volume_changed;
 	unsigned char *metadata;
@@ -335,6 +451,7 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
 
 	/* Read the flush value */
 	flush = raop_rtp->flush;
+	flush_time = raop_rtp->flush_time;
 	raop_rtp->flush = NO_FLUSH;
 
 	/* Read the metadata */
@@ -373,10 +490,19 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
 
 	/* Handle flush if requested */
 	if (flush != NO_FLUSH) {
+		struct timespec now;
+
 		raop_buffer_flush(raop_rtp->buffer, flush);
+		if (raop_rtp->resample) {
+			/* The drift estimate is kept, only the audio history goes */
+			raop_resample_reset(raop_rtp->resample);
+		}
 		if (raop_rtp->callbacks.audio_flush) {
 			raop_rtp->callbacks.audio_flush(raop_rtp->callbacks.cls, cb_data);
 		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		logger_log(raop_rtp->logger, LOGGER_DEBUG, "Flush handled in %ld us",
+		           (long)(now.tv_sec-flush_time.tv_sec)*1000000 + (now.tv_nsec-flush_time.tv_nsec)/1000);
 	}
 
 	if (metadata != NULL) {
@@ -412,250 +538,656 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
 	return 0;
 }
 
+static int
+raop_rtp_recv_batch(raop_rtp_t *raop_rtp, int sock, raop_rtp_batch_t *batch)
+{
+	int i, ret;
+
+	for (i=0; i<RAOP_RTP_BATCH; i++) {
+		batch->iovecs[i].iov_base = batch->packets[i];
+		batch->iovecs[i].iov_len = RAOP_RTP_BATCH_PACKET_LEN;
+		memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+		batch->msgs[i].msg_hdr.msg_name = &batch->saddrs[i];
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	ret = recvmmsg(sock, batch->msgs, RAOP_RTP_BATCH, MSG_DONTWAIT, NULL);
+	raop_rtp->recv_calls++;
+	raop_metrics_count(raop_rtp->metrics, recv_calls, 1);
+	if (ret == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			logger_log(raop_rtp->logger, LOGGER_WARNING, "Error in recvmmsg: %s", strerror(errno));
+		}
+		return 0;
+	}
+	raop_rtp->recv_packets += ret;
+	raop_metrics_count(raop_rtp->metrics, recv_packets, ret);
+	return ret;
+}
+
+static void
+raop_rtp_process_control(raop_rtp_t *raop_rtp, unsigned char *packet, unsigned int packetlen)
+{
+	if (packetlen >= 12) {
+		struct {
+			uchar ver;
+			uchar pad;
+			uchar ext;
+			uchar src_id_count;
+			uchar marker;
+			uchar type;
+			ushort seq;
+			unsigned int rtp_time;
+		} hdr;
+
+		hdr.ver = (packet[0] >> 6) & 0x3;
+		hdr.pad = (packet[0] >> 5) & 0x1;
+		hdr.ext = (packet[0] >> 4) & 0x1;
+		hdr.src_id_count = packet[0] & 0xf;
+		hdr.marker = packet[1] >> 7;
+		hdr.type = packet[1] & 0x7f;
+		hdr.seq = get16be(packet+2);
+		hdr.rtp_time = get32be(packet+4);
+
+		logger_log(raop_rtp->logger, LOGGER_DEBUG,
+		           "Control packet ver %u pad %u ext %u src_id_count %u marker %u type %u seq %u time %u",
+		           hdr.ver, hdr.pad, hdr.ext, hdr.src_id_count, hdr.marker, hdr.type, hdr.seq, hdr.rtp_time);
+
+		if (hdr.type == 0x56) {
+			/* Handle resent data packet */
+			/* Too short to hold an RTP header, from the network or a damaged capture */
+			if (raop_buffer_queue(raop_rtp->buffer, packet+4, packetlen-4, 1) >= 0) {
+				raop_metrics_count(raop_rtp->metrics, packets_resent, 1);
+			}
+		}
+		if(hdr.type == 0x54 && packetlen >= 20) {
+			// timing sync packet, the sender plays rtp_time at its ntp time
+			// and the first timestamp trails it by the sender latency.
+			uint64_t remote_time = raop_ntp_timestamp_to_nano(get64be(packet+8));
+			unsigned int rtp_time = get32be(packet+16);
+			unsigned int latency = rtp_time - hdr.rtp_time;
+
+			raop_ntp_process_sync(raop_rtp->ntp, rtp_time, remote_time, latency);
+			logger_log(raop_rtp->logger, LOGGER_DEBUG, "Timing sync rtp_time %u at %llu ns, latency %u",
+			           rtp_time, (unsigned long long)remote_time, latency);
+		}
+	}
+}
+
 static void
-tvadd(struct timeval *sum, struct timeval *a, struct timeval *b)
+raop_rtp_process_timing(raop_rtp_t *raop_rtp, unsigned char *packet, int packetlen, uint64_t local_time)
 {
-	sum->tv_sec = a->tv_sec + b->tv_sec;
-	sum->tv_usec = a->tv_usec + b->tv_usec;
-	if(sum->tv_usec >= 1000000){
-		sum->tv_usec -= 1000000;
-		sum->tv_sec++;
+	if (packetlen >= 32 && (packet[1] & 0x7f) == 83) {
+		uint64_t origin = raop_ntp_timestamp_to_nano(get64be(packet+8));
+		uint64_t receive = raop_ntp_timestamp_to_nano(get64be(packet+16));
+		uint64_t transmit = raop_ntp_timestamp_to_nano(get64be(packet+24));
+
+		if (raop_ntp_process_reply(raop_rtp->ntp, origin, receive, transmit, local_time) == 0) {
+			logger_log(raop_rtp->logger, LOGGER_DEBUG, "Clock offset %lld ns, delay %llu ns, skew %.2f ppm",
+			           (long long)raop_ntp_get_offset(raop_rtp->ntp, local_time),
+			           (unsigned long long)raop_ntp_get_delay(raop_rtp->ntp),
+			           raop_ntp_get_skew(raop_rtp->ntp) * 1e6);
+		}
 	}
 }
 
 static int
-tvcmp(struct timeval *a, struct timeval *b)
+raop_rtp_get_sink_delay(raop_rtp_t *raop_rtp, void *cb_data)
 {
-	int dsec = a->tv_sec - b->tv_sec;
-	int dusec = b->tv_usec - b->tv_usec;
-	if(dsec > 0)
-		return 1;
-	if(dsec < 0)
-		return -1;
-	if(dusec < 0)
+	int delay = -1;
+
+	if (raop_rtp->callbacks.audio_get_delay) {
+		delay = raop_rtp->callbacks.audio_get_delay(raop_rtp->callbacks.cls, cb_data);
+	}
+	return delay;
+}
+
+/* Local time a frame has to be written to the sink to be heard in sync */
+static int
+raop_rtp_get_play_time(raop_rtp_t *raop_rtp, void *cb_data, unsigned int timestamp, uint64_t *play_time)
+{
+	const ALACSpecificConfig *config;
+	unsigned int latency;
+	int delay;
+
+	if (raop_ntp_rtp_to_local(raop_rtp->ntp, timestamp, play_time) < 0) {
 		return -1;
-	if(dusec > 0)
+	}
+
+	/* The frame is heard after the sender latency, minus what the sink holds */
+	config = raop_buffer_get_config(raop_rtp->buffer);
+	latency = raop_ntp_get_latency(raop_rtp->ntp);
+	if (!latency) {
+		latency = raop_rtp->min_latency;
+	}
+	*play_time += (uint64_t)latency * 1000000000ull / config->sampleRate;
+	delay = raop_rtp_get_sink_delay(raop_rtp, cb_data);
+	if (delay > 0) {
+		*play_time -= (uint64_t)delay * 1000000000ull / config->sampleRate;
+	}
+	return 0;
+}
+
+static int
+raop_rtp_check_playout(raop_rtp_t *raop_rtp, void *cb_data, int play_fd)
+{
+	const ALACSpecificConfig *config;
+	unsigned int timestamp;
+	uint64_t play_time, frame_time;
+	int64_t early;
+	int nbytes, delay, has_timestamp;
+
+	config = raop_buffer_get_config(raop_rtp->buffer);
+	frame_time = (uint64_t)config->frameLength * 1000000000ull / config->sampleRate;
+	while ((nbytes = raop_buffer_can_dequeue(raop_rtp->buffer)) > 0) {
+		has_timestamp = (raop_buffer_get_first_timestamp(raop_rtp->buffer, &timestamp) == 0);
+		if (!has_timestamp && raop_ntp_is_synced(raop_rtp->ntp)) {
+			/* Only a lost frame right after a flush has no timestamp,
+			 * it is concealed now and the playout error is kept */
+			raop_rtp->buffering = 0;
+			return 1;
+		}
+		if (!has_timestamp || raop_rtp_get_play_time(raop_rtp, cb_data, timestamp, &play_time) < 0) {
+			/* Not synchronised yet, prebuffer and write whenever the sink has room */
+			if (raop_rtp->buffering) {
+				if (nbytes >= raop_rtp->buffer_bytes) {
+					raop_rtp->buffering = 0;
+				} else {
+					logger_log(raop_rtp->logger, LOGGER_DEBUG, "Buffering more, has %d bytes", nbytes);
+				}
+			}
+
+			/* Without a clock the fill of buffer and sink is held at the prebuffer level */
+			delay = raop_rtp_get_sink_delay(raop_rtp, cb_data);
+			raop_rtp->has_playout_error = (delay >= 0);
+			if (raop_rtp->has_playout_error) {
+				int frame_bytes = config->numChannels * config->bitDepth / 8;
+				raop_rtp->playout_error = (double)((nbytes - raop_rtp->buffer_bytes) / frame_bytes + delay) / config->sampleRate;
+			}
+			return !raop_rtp->buffering;
+		}
+		raop_rtp->buffering = 0;
+
+		early = (int64_t)(play_time - raop_ntp_get_local_time());
+		if (early > RAOP_RTP_PLAY_EARLY_NS) {
+			/* Come back when the frame is due */
+			struct itimerspec due;
+
+			memset(&due, 0, sizeof(due));
+			play_time -= RAOP_RTP_PLAY_EARLY_NS;
+			due.it_value.tv_sec = play_time / 1000000000ull;
+			due.it_value.tv_nsec = play_time % 1000000000ull;
+			timerfd_settime(play_fd, TFD_TIMER_ABSTIME, &due, NULL);
+			return 0;
+		}
+		if (early < -(int64_t)frame_time) {
+			/* Too late to be played in sync, skip it */
+			int audiobuflen;
+			raop_buffer_dequeue(raop_rtp->buffer, &audiobuflen, &timestamp, 1);
+			raop_rtp->late_frames++;
+			raop_metrics_count(raop_rtp->metrics, frames_dropped, 1);
+			logger_log(raop_rtp->logger, LOGGER_DEBUG, "Dropped frame %u, %lld us late",
+			           timestamp, (long long)-early / 1000);
+			continue;
+		}
+
+		/* Positive when the output lags, then fewer frames are produced */
+		raop_rtp->has_playout_error = 1;
+		raop_rtp->playout_error = (double)-early / 1000000000.0;
 		return 1;
+	}
 	return 0;
 }
 
-static THREAD_RETVAL
-raop_rtp_thread_udp(void *arg)
+static void
+raop_rtp_request_resends(raop_rtp_t *raop_rtp, void *cb_data)
 {
-	raop_rtp_t *raop_rtp = arg;
-	unsigned char packet[RAOP_PACKET_LEN];
-	unsigned int packetlen;
-	struct sockaddr_storage saddr;
-	socklen_t saddrlen;
-	int audio_fd = -1;
+	const ALACSpecificConfig *config;
+	uint64_t now, rtt, timeout, play_time;
+	unsigned int deadline = 0;
+	int has_deadline;
+
+	/* Re-requests wait for a round trip, measured by the timing exchange */
+	config = raop_buffer_get_config(raop_rtp->buffer);
+	now = raop_ntp_get_local_time();
+	rtt = raop_ntp_get_delay(raop_rtp->ntp);
+	timeout = 2 * rtt;
+	if (timeout < RAOP_RTP_RESEND_TIMEOUT_NS) {
+		timeout = RAOP_RTP_RESEND_TIMEOUT_NS;
+	}
+
+	/* Packets written before a resend could arrive are not worth asking for */
+	has_deadline = (raop_rtp_get_play_time(raop_rtp, cb_data,
+	                                       raop_buffer_latest_timestamp(raop_rtp->buffer), &play_time) == 0);
+	if (has_deadline) {
+		int64_t slack = (int64_t)(play_time - now - rtt);
+		deadline = raop_buffer_latest_timestamp(raop_rtp->buffer) -
+		           (int)(slack * config->sampleRate / 1000000000ll);
+	}
+	raop_buffer_handle_resends(raop_rtp->buffer, now, timeout, has_deadline, deadline,
+	                           raop_rtp_resend_callback, raop_rtp);
+}
 
+/* Dequeues one frame and hands it to the sink, returns 0 if none was ready */
+static int
+raop_rtp_output_frame(raop_rtp_t *raop_rtp, void *cb_data, int no_resend)
+{
 	const ALACSpecificConfig *config;
-	void *cb_data = NULL;
+	const void *audiobuf;
+	void *sinkbuf = NULL;
+	int audiobuflen, frame_bytes;
+	unsigned int timestamp = 0, ltime;
+	uint64_t start = 0;
 
-	assert(raop_rtp);
+	config = raop_buffer_get_config(raop_rtp->buffer);
+	frame_bytes = config->numChannels * config->bitDepth / 8;
+	if (raop_rtp->metrics) {
+		raop_metrics_record(raop_rtp->metrics, buffer_fill, raop_buffer_can_dequeue(raop_rtp->buffer) / frame_bytes);
+		if (raop_rtp->has_playout_error) {
+			double error = raop_rtp->playout_error * 1000000.0;
+			raop_metrics_record(raop_rtp->metrics, playout_error, error < 0 ? -error : error);
+		}
+	}
+
+	/* Borrow sink memory so the frame is decoded or resampled right into it */
+	if (raop_rtp->callbacks.audio_get_buffer && raop_rtp->callbacks.audio_put_buffer) {
+		int frames = raop_rtp->resample ? raop_rtp->resample_frames : (int)config->frameLength;
+		sinkbuf = raop_rtp->callbacks.audio_get_buffer(raop_rtp->callbacks.cls, cb_data, frames);
+	}
+
+	/* The resampler works in place, so sink memory takes the decode either way */
+	audiobuf = raop_buffer_dequeue_into(raop_rtp->buffer, sinkbuf, &audiobuflen, &timestamp, no_resend);
+	ltime = raop_buffer_latest_timestamp(raop_rtp->buffer);
+	if (audiobuf && raop_rtp->resample) {
+		short *output = sinkbuf ? sinkbuf : raop_rtp->resample_buf;
+		int inframes = audiobuflen / frame_bytes;
+
+		/* Steer the ratio once per frame with the playout error */
+		if (raop_rtp->has_playout_error) {
+			raop_resample_update(raop_rtp->resample, raop_rtp->playout_error,
+			                     (double)inframes / config->sampleRate);
+			raop_metrics_gauge(raop_rtp->metrics, resample_ratio,
+			                   (long long)(raop_resample_get_ratio(raop_rtp->resample) * 1e9));
+			raop_metrics_gauge(raop_rtp->metrics, resample_error,
+			                   (long long)(raop_resample_get_error(raop_rtp->resample) * 1e6));
+		}
+		audiobuflen = raop_resample_process(raop_rtp->resample, audiobuf, inframes,
+		                                    output, raop_rtp->resample_frames) * frame_bytes;
+		audiobuf = output;
+	}
+
+	if (raop_rtp->metrics) {
+		start = raop_metrics_now();
+	}
+	if (sinkbuf) {
+		raop_rtp->callbacks.audio_put_buffer(raop_rtp->callbacks.cls, cb_data, sinkbuf,
+		                                     audiobuf ? audiobuflen : 0, timestamp, ltime);
+	} else if (audiobuf) {
+		raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, cb_data, audiobuf, audiobuflen, timestamp, ltime);
+	}
+	if (raop_rtp->metrics && audiobuf) {
+		raop_metrics_record(raop_rtp->metrics, callback_time, raop_metrics_now() - start);
+		raop_metrics_count(raop_rtp->metrics, frames_output, 1);
+	}
+	return (audiobuf != NULL);
+}
+
+/* Polls the audio output for writing only while the first frame is due */
+static void
+raop_rtp_update_output(raop_rtp_t *raop_rtp)
+{
+	struct epoll_event ev;
+	uint32_t want_events = 0;
+
+	if (raop_rtp->audio_fd < 0) {
+		return;
+	}
+	if (raop_rtp_check_playout(raop_rtp, raop_rtp->cb_data, raop_rtp->play_fd)) {
+		want_events = EPOLLOUT;
+	}
+	if (want_events != raop_rtp->audio_events) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = want_events;
+		ev.data.fd = raop_rtp->audio_fd;
+		epoll_ctl(raop_rtp->epoll_fd, EPOLL_CTL_MOD, raop_rtp->audio_fd, &ev);
+		raop_rtp->audio_events = want_events;
+	}
+}
+
+/* Opens the audio output and sets the prebuffer of a UDP session */
+static void
+raop_rtp_open_output(raop_rtp_t *raop_rtp)
+{
+	const ALACSpecificConfig *config;
+	int frame_bytes, max_bytes;
 
 	config = raop_buffer_get_config(raop_rtp->buffer);
-	cb_data = raop_rtp->callbacks.audio_init(raop_rtp->callbacks.cls,
+	raop_rtp->audio_fd = -1;
+	raop_rtp->cb_data = raop_rtp->callbacks.audio_init(raop_rtp->callbacks.cls,
 				config->bitDepth,
 				config->numChannels,
 				config->sampleRate,
-				&audio_fd);
+				&raop_rtp->audio_fd);
+	raop_rtp->opened = 1;
+	raop_metrics_count(raop_rtp->metrics, sessions, 1);
 
-	int buffering = 1;
+	/* Until the clocks are synchronised, prebuffer the sender latency */
 	int buffer_ms = 250;
-	struct timeval now, nextntp;
-	struct timeval ntprate = { .tv_sec = 0, .tv_usec = 250 };
-	gettimeofday(&now, NULL);
-	memcpy(&nextntp, &now, sizeof nextntp);
-	while(1) {
-		fd_set rfds, wfds;
-		struct timeval tv, now, dt;
-		int nfds, ret;
+	frame_bytes = config->numChannels * config->bitDepth / 8;
+	raop_rtp->buffering = 1;
+	raop_rtp->buffer_bytes = (config->sampleRate*frame_bytes*buffer_ms) / 1000;
+	if (raop_rtp->min_latency) {
+		raop_rtp->buffer_bytes = raop_rtp->min_latency * frame_bytes;
+	}
 
-		if(tvcmp(&nextntp, &now) < 0){
-			struct sockaddr_storage timing_saddr;
-			struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&timing_saddr;
-			memcpy(&timing_saddr, &raop_rtp->control_saddr, sizeof timing_saddr);
-			sin6->sin6_port = htons(raop_rtp->timing_rport);
-
-			uchar buf[32];
-			buf[0] = 0x80;
-			buf[1] = 0x80 | 82;
-			put16be(buf+2, raop_rtp->control_seqnum);
-			put32be(buf+4, 0); // rtp_time
-			put32be(buf+8, 0); // origin ntp sec
-			put32be(buf+12, 0); // origin ntp frac
-			put32be(buf+16, 0); // receive ntp sec
-			put32be(buf+20, 0); // receive ntp frac
-			put32be(buf+24, now.tv_sec); // transmit ntp sec
-			put32be(buf+28,((unsigned long long)now.tv_usec * 4294967296) / 1000000); // transmit ntp usec
-
-			sendto(raop_rtp->tsock, buf, sizeof(buf), 0, (struct sockaddr *)&timing_saddr, raop_rtp->control_saddr_len);
-			fprintf(stderr, "sent next ntp query, %d.%06d\n", now.tv_sec, now.tv_usec);
-			tvadd(&nextntp, &now, &ntprate);
-		}
+	/* A short buffer can never reach the default prebuffer, wait for half of it */
+	max_bytes = raop_buffer_get_length(raop_rtp->buffer)/2 * (int)config->frameLength * frame_bytes;
+	if (raop_rtp->buffer_bytes > max_bytes) {
+		raop_rtp->buffer_bytes = max_bytes;
+	}
+}
 
-		/* Check if we are still running and process callbacks */
-		if (raop_rtp_process_events(raop_rtp, cb_data)) {
-			break;
+/* Sets up the UDP session, runs in the thread or worker that drives it */
+static int
+raop_rtp_udp_open(raop_rtp_t *raop_rtp)
+{
+	const ALACSpecificConfig *config;
+	struct epoll_event ev;
+	int epoll_fd = raop_rtp->epoll_fd;
+	int frame_bytes;
+
+	raop_rtp_open_output(raop_rtp);
+	config = raop_buffer_get_config(raop_rtp->buffer);
+	frame_bytes = config->numChannels * config->bitDepth / 8;
+
+	/* The resampler works on 16-bit samples, other depths are passed through */
+	raop_rtp->has_playout_error = 0;
+	if (raop_rtp->resample_enabled && config->bitDepth == 16) {
+		raop_rtp->resample = raop_resample_init(config->numChannels, config->frameLength);
+		if (raop_rtp->resample) {
+			raop_rtp->resample_frames = raop_resample_get_max_output(raop_rtp->resample, config->frameLength);
+			raop_rtp->resample_buf = malloc(raop_rtp->resample_frames * frame_bytes);
+		}
+		if (!raop_rtp->resample_buf) {
+			logger_log(raop_rtp->logger, LOGGER_WARNING, "Error allocating resampler, drift is not compensated");
+			raop_resample_destroy(raop_rtp->resample);
+			raop_rtp->resample = NULL;
 		}
+	}
 
-		/* Set timeout value to 5ms... why?*/
-		tv.tv_sec = 0;
-		tv.tv_usec = 5000;
+	raop_rtp->batch = malloc(sizeof(raop_rtp_batch_t));
+	if (!raop_rtp->batch) {
+		logger_log(raop_rtp->logger, LOGGER_ERR, "Error allocating receive buffers");
+		return -1;
+	}
 
-		/* Get the correct nfds value */
-		nfds = raop_rtp->csock+1;
-		if (raop_rtp->tsock >= nfds)
-			nfds = raop_rtp->tsock+1;
-		if (raop_rtp->dsock >= nfds)
-			nfds = raop_rtp->dsock+1;
+	/* Sockets, setter events and the NTP timer all wake up one epoll loop,
+	 * the epoll descriptor and event_fd in it are set up by raop_rtp_start */
+	raop_rtp->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	raop_rtp->play_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (raop_rtp->timer_fd == -1 || raop_rtp->play_fd == -1) {
+		logger_log(raop_rtp->logger, LOGGER_ERR, "Error creating timer descriptor: %s", strerror(errno));
+		return -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = raop_rtp->csock;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, raop_rtp->csock, &ev);
+	ev.data.fd = raop_rtp->tsock;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, raop_rtp->tsock, &ev);
+	ev.data.fd = raop_rtp->dsock;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, raop_rtp->dsock, &ev);
+	ev.data.fd = raop_rtp->timer_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, raop_rtp->timer_fd, &ev);
+	ev.data.fd = raop_rtp->play_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, raop_rtp->play_fd, &ev);
+
+	/* Audio output is only polled while there is something to dequeue */
+	raop_rtp->audio_events = 0;
+	if (raop_rtp->audio_fd >= 0) {
+		ev.events = 0;
+		ev.data.fd = raop_rtp->audio_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, raop_rtp->audio_fd, &ev);
+	}
 
-		// check all sockets for read
-		FD_ZERO(&rfds);
-		FD_SET(raop_rtp->csock, &rfds);
-		FD_SET(raop_rtp->tsock, &rfds);
-		FD_SET(raop_rtp->dsock, &rfds);
-
-		// check for audio write if there's something to dequeue
-		FD_ZERO(&wfds);
-		if(buffering){
-			int nbytes = raop_buffer_can_dequeue(raop_rtp->buffer);
-			if(nbytes >= (44100*2*2*buffer_ms) / 1000){
-				buffering = 0;
-			} else {
-				fprintf(stderr, "raop_rtp_thread_udp: has %d bytes, buffering more\n", nbytes);
-			}
-		}
-		if(!buffering){
-			if(raop_buffer_can_dequeue(raop_rtp->buffer) > 0){
-				if(audio_fd >= nfds)
-					nfds = audio_fd+1;
-				FD_SET(audio_fd, &wfds);
-			}
-		}
+	/* First NTP query right away, then at a fixed rate */
+	memset(&raop_rtp->ntprate, 0, sizeof(raop_rtp->ntprate));
+	raop_rtp->ntprate.it_value.tv_nsec = 1;
+	raop_rtp->ntprate.it_interval.tv_sec = RAOP_RTP_NTP_INTERVAL_MS / 1000;
+	raop_rtp->ntprate.it_interval.tv_nsec = (RAOP_RTP_NTP_INTERVAL_MS % 1000) * 1000000;
+	timerfd_settime(raop_rtp->timer_fd, 0, &raop_rtp->ntprate, NULL);
+	raop_rtp->last_recv_calls = 0;
+	raop_rtp->last_recv_packets = 0;
+
+	/* Pick up anything set before the session started */
+	if (raop_rtp_process_events(raop_rtp, raop_rtp->cb_data)) {
+		return -1;
+	}
+	return 0;
+}
 
-		// block until there's something to do.
-		ret = select(nfds, &rfds, &wfds, NULL, &tv);
+static void
+raop_rtp_udp_close(raop_rtp_t *raop_rtp)
+{
+	if (raop_rtp->play_fd != -1) close(raop_rtp->play_fd);
+	if (raop_rtp->timer_fd != -1) close(raop_rtp->timer_fd);
+	if (raop_rtp->epoll_fd != -1) close(raop_rtp->epoll_fd);
+	raop_rtp->play_fd = raop_rtp->timer_fd = raop_rtp->epoll_fd = -1;
+	free(raop_rtp->batch);
+	raop_rtp->batch = NULL;
+	raop_resample_destroy(raop_rtp->resample);
+	free(raop_rtp->resample_buf);
+	raop_rtp->resample = NULL;
+	raop_rtp->resample_buf = NULL;
+	logger_log(raop_rtp->logger, LOGGER_INFO, "Exiting UDP RAOP session");
+	if (raop_rtp->opened) {
+		raop_rtp->callbacks.audio_destroy(raop_rtp->callbacks.cls, raop_rtp->cb_data);
+		raop_rtp->opened = 0;
+	}
+}
 
-		// update current time before we process anything..
-		// the processing might be also above this line!
-		gettimeofday(&now, NULL);
+/* Handles what is ready within timeout ms, returns non-zero once the session is over */
+static int
+raop_rtp_udp_step(raop_rtp_t *raop_rtp, int timeout)
+{
+	raop_rtp_batch_t *batch;
+	struct sockaddr_storage saddr;
+	socklen_t saddrlen;
+	struct epoll_event events[8];
+	int can_read_c = 0, can_read_t = 0, can_read_d = 0;
+	int can_ntp = 0, can_write = 0;
+	int nevents, i;
+	uint64_t counter;
+	void *cb_data;
+	int audio_fd, play_fd;
+
+	if (!raop_rtp->opened && raop_rtp_udp_open(raop_rtp) < 0) {
+		return 1;
+	}
+	batch = raop_rtp->batch;
+	cb_data = raop_rtp->cb_data;
+	audio_fd = raop_rtp->audio_fd;
+	play_fd = raop_rtp->play_fd;
+
+	// block until there's something to do.
+	nevents = epoll_wait(raop_rtp->epoll_fd, events, sizeof(events)/sizeof(events[0]), timeout);
+
+	if (nevents == -1) {
+		if (errno == EINTR)
+			return 0;
+		logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp_udp_step: epoll error %s, exiting", strerror(errno));
+		return 1;
+	}
+	raop_metrics_count(raop_rtp->metrics, wakeups, 1);
+	for (i=0; i<nevents; i++) {
+		int fd = events[i].data.fd;
+		if (fd == raop_rtp->csock) can_read_c = 1;
+		else if (fd == raop_rtp->tsock) can_read_t = 1;
+		else if (fd == raop_rtp->dsock) can_read_d = 1;
+		else if (fd == audio_fd) can_write = 1;
+		else if (fd == raop_rtp->timer_fd) {
+			if (read(raop_rtp->timer_fd, &counter, sizeof(counter)) == sizeof(counter))
+				can_ntp = 1;
+		} else if (fd == play_fd) {
+			/* Playout is checked again at the end of the step */
+			if (read(play_fd, &counter, sizeof(counter)) != sizeof(counter))
+				continue;
+		} else if (fd == raop_rtp->event_fd) {
+			if (read(raop_rtp->event_fd, &counter, sizeof(counter)) != sizeof(counter))
+				continue;
+			/* Check if we are still running and process callbacks */
+			if (raop_rtp_process_events(raop_rtp, cb_data)) {
+				return 1;
+			}
+		}
+	}
 
-		if (ret == 0) {
-			/* Timeout happened */
-			continue;
-		} else if (ret == -1) {
-			fprintf(stderr, "raop_rtp_thread_udp: select error %s\n", strerror(errno));
-			fprintf(stderr, "exiting\n");
-			/* FIXME: Error happened */
-			break;
+	if(can_ntp){
+		raop_buffer_resend_stats_t resend_stats;
+		raop_plc_stats_t plc_stats;
+		struct sockaddr_storage timing_saddr;
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&timing_saddr;
+		memcpy(&timing_saddr, &raop_rtp->control_saddr, sizeof timing_saddr);
+		sin6->sin6_port = htons(raop_rtp->timing_rport);
+
+		uchar buf[32];
+		buf[0] = 0x80;
+		buf[1] = 0x80 | 82;
+		put16be(buf+2, raop_rtp->control_seqnum);
+		put32be(buf+4, 0); // rtp_time
+		put32be(buf+8, 0); // origin ntp sec
+		put32be(buf+12, 0); // origin ntp frac
+		put32be(buf+16, 0); // receive ntp sec
+		put32be(buf+20, 0); // receive ntp frac
+		// transmit time is our monotonic clock, the reply echoes it as origin
+		uint64_t transmit = raop_ntp_nano_to_timestamp(raop_ntp_get_local_time());
+		put32be(buf+24, transmit >> 32); // transmit ntp sec
+		put32be(buf+28, transmit); // transmit ntp frac
+
+		sendto(raop_rtp->tsock, buf, sizeof(buf), 0, (struct sockaddr *)&timing_saddr, raop_rtp->control_saddr_len);
+
+		logger_log(raop_rtp->logger, LOGGER_DEBUG, "Receive rate %.1f calls/s, %.1f packets/s",
+		           (raop_rtp->recv_calls-raop_rtp->last_recv_calls) * 1000.0 / RAOP_RTP_NTP_INTERVAL_MS,
+		           (raop_rtp->recv_packets-raop_rtp->last_recv_packets) * 1000.0 / RAOP_RTP_NTP_INTERVAL_MS);
+		raop_rtp->last_recv_calls = raop_rtp->recv_calls;
+		raop_rtp->last_recv_packets = raop_rtp->recv_packets;
+
+		raop_buffer_get_resend_stats(raop_rtp->buffer, &resend_stats);
+		logger_log(raop_rtp->logger, LOGGER_DEBUG, "Resends: %llu requested, %llu retried, %llu recovered, %llu abandoned",
+		           resend_stats.requested, resend_stats.retried, resend_stats.recovered, resend_stats.abandoned);
+		raop_buffer_get_plc_stats(raop_rtp->buffer, &plc_stats);
+		logger_log(raop_rtp->logger, LOGGER_DEBUG, "Concealed %llu frames, %llu of them muted",
+		           plc_stats.concealed, plc_stats.muted);
+		if (raop_rtp->resample) {
+			logger_log(raop_rtp->logger, LOGGER_DEBUG, "Resample ratio %.6f, playout error %.2f ms, buffered %d bytes",
+			           raop_resample_get_ratio(raop_rtp->resample),
+			           raop_resample_get_error(raop_rtp->resample) * 1000.0,
+			           raop_buffer_can_dequeue(raop_rtp->buffer));
 		}
+	}
 
-		if(FD_ISSET(raop_rtp->csock, &rfds)){
-			saddrlen = sizeof(saddr);
-			packetlen = recvfrom(raop_rtp->csock, (char *)packet, sizeof(packet), 0,
-			                     (struct sockaddr *)&saddr, &saddrlen);
-
-			/* Get the destination address here, because we need the sin6_scope_id */
-			memcpy(&raop_rtp->control_saddr, &saddr, saddrlen);
-			raop_rtp->control_saddr_len = saddrlen;
-
-			if (packetlen >= 12) {
-				struct {
-					uchar ver;
-					uchar pad;
-					uchar ext;
-					uchar src_id_count;
-					uchar marker;
-					uchar type;
-					ushort seq;
-					unsigned int rtp_time;
-				} hdr;
-
-				hdr.ver = (packet[0] >> 6) & 0x3;
-				hdr.pad = (packet[0] >> 5) & 0x1;
-				hdr.ext = (packet[0] >> 4) & 0x1;
-				hdr.src_id_count = packet[0] & 0xf;
-				hdr.marker = packet[1] >> 7;
-				hdr.type = packet[1] & 0x7f;
-				hdr.seq = get16be(packet+2);
-				hdr.rtp_time = get32be(packet+4);
-
-				fprintf(stderr, "control packet ver %u pad %u ext %u src_id_count %u marker %u type %u seq %u time %u\n",
-					hdr.ver, hdr.pad, hdr.ext, hdr.src_id_count, hdr.marker, hdr.type, hdr.seq, hdr.rtp_time
-				);
-
-				if (hdr.type == 0x56) {
-					/* Handle resent data packet */
-					int ret = raop_buffer_queue(raop_rtp->buffer, packet+4, packetlen-4, 1);
-					assert(ret >= 0);
+	if(can_read_c){
+		int had_control = (raop_rtp->control_saddr_len != 0);
+		int count;
+		do {
+			count = raop_rtp_recv_batch(raop_rtp, raop_rtp->csock, batch);
+			for (i=0; i<count; i++) {
+				struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+
+				/* Get the destination address here, because we need the sin6_scope_id */
+				memcpy(&raop_rtp->control_saddr, hdr->msg_name, hdr->msg_namelen);
+				raop_rtp->control_saddr_len = hdr->msg_namelen;
+
+				if (hdr->msg_flags & MSG_TRUNC) {
+					logger_log(raop_rtp->logger, LOGGER_WARNING, "Dropping truncated control packet");
+					continue;
 				}
-				if(hdr.type == 0x54) {
-					// timing sync packet.
-					// convert ntp timestamp to seconds + nanoseconds right away.
-					unsigned int ntp_sec = get32be(packet+8);
-					unsigned int ntp_nsec = (unsigned long long)get32be(packet+12) * 1000000000ull >> 32;
-					unsigned int rtp_time = get32be(packet+16);
-					fprintf(stderr, "timing sync ntp_sec %u.%09u rtp_time %u\n",
-						ntp_sec, ntp_nsec, rtp_time
-					);
+				if (raop_rtp->capture) {
+					raop_capture_write(raop_rtp->capture, raop_rtp->capture_session, RAOP_CAPTURE_CONTROL,
+					                   batch->packets[i], batch->msgs[i].msg_len);
 				}
+				raop_rtp_process_control(raop_rtp, batch->packets[i], batch->msgs[i].msg_len);
 			}
-		}
-
-		if(FD_ISSET(raop_rtp->tsock, &rfds)){
-			uchar buf[64];
-			int len;
-			saddrlen = sizeof(saddr);
-			len = recvfrom(raop_rtp->tsock, (char *)buf, sizeof buf, 0, (struct sockaddr *)&saddr, &saddrlen);
+		} while (count == RAOP_RTP_BATCH);
 
-			uint orig_sec = get32be(buf+8); // origin ntp sec
-			uint orig_nsec = (unsigned long long)get32be(buf+12) * 1000000000ull >> 32; // origin ntp frac
-			uint recv_sec = get32be(buf+16); // receive ntp sec
-			uint recv_nsec = (unsigned long long)get32be(buf+20) * 1000000000ull >> 32; // receive ntp frac
-			uint xmit_sec = get32be(buf+24); // transmit ntp sec
-			uint xmit_nsec = (unsigned long long)get32be(buf+28) * 1000000000ull >> 32; // transmit ntp frac
-			uint now_sec = now.tv_sec;
-			uint now_nsec = now.tv_usec * 1000;
+		// timing queries go to the control address, start as soon as it is known
+		if (!had_control && raop_rtp->control_saddr_len != 0)
+			timerfd_settime(raop_rtp->timer_fd, 0, &raop_rtp->ntprate, NULL);
+	}
 
-			fprintf(stderr, "got ntp replylen %d ooh!\n", len);
-			fprintf(stderr, "orig %u.%09u recv %u.%09u xmit %u.%09u now %u.%09u\n", orig_sec, orig_nsec, recv_sec, recv_nsec, xmit_sec, xmit_nsec, now_sec, now_nsec);
+	if(can_read_t){
+		uchar buf[64];
+		int len;
+		uint64_t local_time;
+		saddrlen = sizeof(saddr);
+		len = recvfrom(raop_rtp->tsock, (char *)buf, sizeof buf, 0, (struct sockaddr *)&saddr, &saddrlen);
+		local_time = raop_ntp_get_local_time();
+		if (len > 0 && raop_rtp->capture) {
+			raop_capture_write(raop_rtp->capture, raop_rtp->capture_session, RAOP_CAPTURE_TIMING, buf, len);
 		}
+		raop_rtp_process_timing(raop_rtp, buf, len, local_time);
+	}
 
-		if(FD_ISSET(raop_rtp->dsock, &rfds)){
-			saddrlen = sizeof(saddr);
-			packetlen = recvfrom(raop_rtp->dsock, (char *)packet, sizeof(packet), 0,
-			                     (struct sockaddr *)&saddr, &saddrlen);
-			if (packetlen >= 12) {
-				int no_resend = (raop_rtp->control_rport == 0);
+	if(can_read_d){
+		int no_resend = (raop_rtp->control_rport == 0);
+		int count, queued = 0;
+		do {
+			count = raop_rtp_recv_batch(raop_rtp, raop_rtp->dsock, batch);
+			for (i=0; i<count; i++) {
 				int ret;
 
-
-				ret = raop_buffer_queue(raop_rtp->buffer, packet, packetlen, 1);
-				assert(ret >= 0);
-
-				// there is lots of room for improvement in the ARQ logic if
-				// raop_buffer_handle_resends()
-				if (!no_resend) {
-					raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_resend_callback, raop_rtp);
+				if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+					logger_log(raop_rtp->logger, LOGGER_WARNING, "Dropping truncated data packet");
+					continue;
+				}
+				if (batch->msgs[i].msg_len < 12) {
+					continue;
 				}
+				if (raop_rtp->capture) {
+					raop_capture_write(raop_rtp->capture, raop_rtp->capture_session, RAOP_CAPTURE_DATA,
+					                   batch->packets[i], batch->msgs[i].msg_len);
+				}
+				ret = raop_buffer_queue(raop_rtp->buffer, batch->packets[i], batch->msgs[i].msg_len, 1);
+				assert(ret >= 0);
+				queued++;
 			}
+		} while (count == RAOP_RTP_BATCH);
+
+		if (queued && !no_resend) {
+			raop_rtp_request_resends(raop_rtp, cb_data);
 		}
+	}
 
-		// if we can write to the audio device, dequeue and output one airplay frame
-		if(FD_ISSET(audio_fd, &wfds)){
-			const void *audiobuf;
-			int audiobuflen;
-			unsigned int timestamp, ltime;
-			int no_resend = (raop_rtp->control_rport == 0);
-			audiobuf = raop_buffer_dequeue(raop_rtp->buffer, &audiobuflen, &timestamp, no_resend);
-			ltime = raop_buffer_latest_timestamp(raop_rtp->buffer);
-			raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, cb_data, audiobuf, audiobuflen, timestamp, ltime);
+	// without an audio descriptor every due frame is pushed out
+	if(audio_fd < 0)
+		can_write = raop_rtp_check_playout(raop_rtp, cb_data, play_fd);
+
+	// if we can write to the audio device, dequeue and output one airplay frame
+	while(can_write){
+		int no_resend = (raop_rtp->control_rport == 0);
+		if (!raop_rtp_output_frame(raop_rtp, cb_data, no_resend)) {
+			break;
 		}
+		can_write = (audio_fd < 0 && raop_rtp_check_playout(raop_rtp, cb_data, play_fd));
 	}
-	logger_log(raop_rtp->logger, LOGGER_INFO, "Exiting UDP RAOP thread");
-	raop_rtp->callbacks.audio_destroy(raop_rtp->callbacks.cls, cb_data);
+
+	raop_rtp_update_output(raop_rtp);
+	return 0;
+}
+
+static THREAD_RETVAL
+raop_rtp_thread_udp(void *arg)
+{
+	raop_rtp_t *raop_rtp = arg;
+
+	assert(raop_rtp);
+
+	if (raop_rtp_udp_open(raop_rtp) == 0) {
+		raop_rtp_update_output(raop_rtp);
+		while (!raop_rtp_udp_step(raop_rtp, -1));
+	}
+	raop_rtp_udp_close(raop_rtp);
 
 	return 0;
 }
@@ -679,6 +1211,7 @@ raop_rtp_thread_tcp(void *arg)
 	                               config->numChannels,
 	                               config->sampleRate,
 					&audio_fd);
+	raop_metrics_count(raop_rtp->metrics, sessions, 1);
 
 	while (1) {
 		fd_set rfds;
@@ -704,6 +1237,7 @@ raop_rtp_thread_tcp(void *arg)
 			nfds = stream_fd+1;
 		}
 		ret = select(nfds, &rfds, NULL, NULL, &tv);
+		raop_metrics_count(raop_rtp->metrics, wakeups, 1);
 		if (ret == 0) {
 			/* Timeout happened */
 			continue;
@@ -728,9 +1262,6 @@ raop_rtp_thread_tcp(void *arg)
 		if (stream_fd != -1 && FD_ISSET(stream_fd, &rfds)) {
 			unsigned int rtplen=0;
 
-			const void *audiobuf;
-			int audiobuflen;
-
 			ret = recv(stream_fd, (char *)(packet+packetlen), sizeof(packet)-packetlen, 0);
 			if (ret == 0) {
 				/* TCP socket closed */
@@ -762,19 +1293,23 @@ raop_rtp_thread_tcp(void *arg)
 			}
 
 			/* Packet is valid, process it */
+			if (raop_rtp->capture) {
+				raop_capture_write(raop_rtp->capture, raop_rtp->capture_session, RAOP_CAPTURE_STREAM,
+				                   packet+4, rtplen);
+			}
 			ret = raop_buffer_queue(raop_rtp->buffer, packet+4, rtplen, 0);
-			assert(ret >= 0);
 
 			/* Remove processed bytes from packet buffer */
 			memmove(packet, packet+4+rtplen, packetlen-rtplen);
 			packetlen -= 4+rtplen;
 
-			/* Decode the received frame */
-			unsigned int timestamp;
-			if ((audiobuf = raop_buffer_dequeue(raop_rtp->buffer, &audiobuflen, &timestamp, 1))) {
-				unsigned int ltime = raop_buffer_latest_timestamp(raop_rtp->buffer);
-				raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, cb_data, audiobuf, audiobuflen, timestamp, ltime);
+			/* Too short for an RTP header, skip it */
+			if (ret < 0) {
+				continue;
 			}
+
+			/* Decode the received frame */
+			raop_rtp_output_frame(raop_rtp, cb_data, 1);
 		}
 	}
 
@@ -789,6 +1324,80 @@ raop_rtp_thread_tcp(void *arg)
 	return 0;
 }
 
+void
+raop_rtp_set_min_latency(raop_rtp_t *raop_rtp, unsigned int latency)
+{
+	assert(raop_rtp);
+
+	/* Read by the thread at startup, set before raop_rtp_start */
+	raop_rtp->min_latency = latency;
+}
+
+void
+raop_rtp_set_plc_mode(raop_rtp_t *raop_rtp, int mode)
+{
+	assert(raop_rtp);
+
+	/* The buffer belongs to the thread, set before raop_rtp_start */
+	raop_buffer_set_plc_mode(raop_rtp->buffer, mode);
+}
+
+void
+raop_rtp_set_resample(raop_rtp_t *raop_rtp, int enabled)
+{
+	assert(raop_rtp);
+
+	/* Read when the session opens, set before raop_rtp_start */
+	raop_rtp->resample_enabled = enabled;
+}
+
+void
+raop_rtp_set_pool(raop_rtp_t *raop_rtp, raop_pool_t *pool)
+{
+	assert(raop_rtp);
+
+	/* Only UDP sessions run in the pool, set before raop_rtp_start */
+	raop_rtp->pool = pool;
+}
+
+void
+raop_rtp_set_metrics(raop_rtp_t *raop_rtp, raop_metrics_t *metrics)
+{
+	assert(raop_rtp);
+
+	/* Updated by the session thread, set before raop_rtp_start */
+	raop_rtp->metrics = metrics;
+	raop_buffer_set_metrics(raop_rtp->buffer, metrics);
+}
+
+void
+raop_rtp_set_capture(raop_rtp_t *raop_rtp, raop_capture_t *capture, unsigned int session)
+{
+	assert(raop_rtp);
+
+	/* Written by the session thread, set before raop_rtp_start */
+	raop_rtp->capture = capture;
+	raop_rtp->capture_session = session;
+}
+
+static int
+raop_rtp_pool_step(void *opaque)
+{
+	return raop_rtp_udp_step(opaque, 0);
+}
+
+static void
+raop_rtp_pool_done(void *opaque)
+{
+	raop_rtp_t *raop_rtp = opaque;
+	uint64_t value = 1;
+
+	raop_rtp_udp_close(raop_rtp);
+	if (write(raop_rtp->done_fd, &value, sizeof(value)) == -1) {
+		logger_log(raop_rtp->logger, LOGGER_ERR, "Signalling session end failed: %d", errno);
+	}
+}
+
 void
 raop_rtp_start(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_rport, unsigned short timing_rport,
                unsigned short *control_lport, unsigned short *timing_lport, unsigned short *data_lport)
@@ -818,10 +1427,36 @@ raop_rtp_start(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_rport,
 	if (timing_lport) *timing_lport = raop_rtp->timing_lport;
 	if (data_lport) *data_lport = raop_rtp->data_lport;
 	
+	/* The session loop waits on one epoll descriptor, setters wake it up */
+	if (use_udp) {
+		struct epoll_event ev;
+
+		raop_rtp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (raop_rtp->epoll_fd == -1) {
+			logger_log(raop_rtp->logger, LOGGER_ERR, "Error creating epoll descriptor: %s", strerror(errno));
+			MUTEX_UNLOCK(raop_rtp->run_mutex);
+			return;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = raop_rtp->event_fd;
+		epoll_ctl(raop_rtp->epoll_fd, EPOLL_CTL_ADD, raop_rtp->event_fd, &ev);
+	}
+
 	/* Create the thread and initialize running values */
 	raop_rtp->running = 1;
 	raop_rtp->joined = 0;
-	if (use_udp) {
+	raop_rtp->pooled = 0;
+	if (use_udp && raop_rtp->pool) {
+		/* The first wakeup makes the worker open the session */
+		raop_rtp->pooled = (raop_pool_add(raop_rtp->pool, raop_rtp->epoll_fd,
+		                                  raop_rtp_pool_step, raop_rtp_pool_done, raop_rtp) == 0);
+		if (raop_rtp->pooled) {
+			raop_rtp_wakeup(raop_rtp);
+		} else {
+			THREAD_CREATE(raop_rtp->thread, raop_rtp_thread_udp, raop_rtp);
+		}
+	} else if (use_udp) {
 		THREAD_CREATE(raop_rtp->thread, raop_rtp_thread_udp, raop_rtp);
 	} else {
 		THREAD_CREATE(raop_rtp->thread, raop_rtp_thread_tcp, raop_rtp);
@@ -829,6 +1464,95 @@ raop_rtp_start(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_rport,
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
 }
 
+void
+raop_rtp_start_replay(raop_rtp_t *raop_rtp, unsigned short control_rport)
+{
+	assert(raop_rtp);
+
+	MUTEX_LOCK(raop_rtp->run_mutex);
+	if (raop_rtp->running || !raop_rtp->joined) {
+		MUTEX_UNLOCK(raop_rtp->run_mutex);
+		return;
+	}
+	raop_rtp->control_rport = control_rport;
+	raop_rtp->csock = raop_rtp->tsock = raop_rtp->dsock = -1;
+	raop_rtp->replaying = 1;
+	raop_rtp->running = 1;
+	raop_rtp->joined = 0;
+	MUTEX_UNLOCK(raop_rtp->run_mutex);
+
+	/* The packets are fed by the caller, the output is opened right away */
+	raop_rtp_open_output(raop_rtp);
+}
+
+/* Outputs the frames beyond the prebuffer, or all of them when draining */
+static void
+raop_rtp_replay_output(raop_rtp_t *raop_rtp, int drain)
+{
+	int nbytes;
+
+	while ((nbytes = raop_buffer_can_dequeue(raop_rtp->buffer)) > 0) {
+		if (!drain && nbytes < raop_rtp->buffer_bytes) {
+			break;
+		}
+		if (!raop_rtp_output_frame(raop_rtp, raop_rtp->cb_data, 1)) {
+			break;
+		}
+	}
+}
+
+void
+raop_rtp_replay(raop_rtp_t *raop_rtp, int type, const unsigned char *data, int datalen, uint64_t time)
+{
+	unsigned char packet[RAOP_PACKET_LEN];
+	int ret;
+
+	assert(raop_rtp);
+	assert(raop_rtp->replaying);
+
+	/* Requests handled since the last packet take effect first */
+	if (datalen < 0 || (size_t)datalen > sizeof(packet) ||
+	    raop_rtp_process_events(raop_rtp, raop_rtp->cb_data)) {
+		return;
+	}
+	memcpy(packet, data, datalen);
+
+	/* Frames are output as soon as the prebuffer allows, there is no sink clock
+	 * to wait for, so at full speed this measures the receive and decode path */
+	switch (type) {
+	case RAOP_CAPTURE_DATA:
+		/* A damaged record is dropped like a bad datagram would be */
+		if (datalen < 12) {
+			return;
+		}
+		ret = raop_buffer_queue(raop_rtp->buffer, packet, datalen, 1);
+		if (ret < 0) {
+			return;
+		}
+		break;
+	case RAOP_CAPTURE_STREAM:
+		if (datalen < 12) {
+			return;
+		}
+		/* Like the TCP thread, every packet is output as it comes */
+		ret = raop_buffer_queue(raop_rtp->buffer, packet, datalen, 0);
+		if (ret < 0) {
+			return;
+		}
+		raop_rtp_output_frame(raop_rtp, raop_rtp->cb_data, 1);
+		return;
+	case RAOP_CAPTURE_CONTROL:
+		raop_rtp_process_control(raop_rtp, packet, datalen);
+		break;
+	case RAOP_CAPTURE_TIMING:
+		raop_rtp_process_timing(raop_rtp, packet, datalen, time);
+		return;
+	default:
+		return;
+	}
+	raop_rtp_replay_output(raop_rtp, 0);
+}
+
 void
 raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume)
 {
@@ -845,6 +1569,7 @@ raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume)
 	raop_rtp->volume = volume;
 	raop_rtp->volume_changed = 1;
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	raop_rtp_wakeup(raop_rtp);
 }
 
 void
@@ -866,6 +1591,7 @@ raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen)
 	raop_rtp->metadata = metadata;
 	raop_rtp->metadata_len = datalen;
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	raop_rtp_wakeup(raop_rtp);
 }
 
 void
@@ -887,6 +1613,7 @@ raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen)
 	raop_rtp->coverart = coverart;
 	raop_rtp->coverart_len = datalen;
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	raop_rtp_wakeup(raop_rtp);
 }
 
 void 
@@ -903,6 +1630,7 @@ raop_rtp_remote_control_id(raop_rtp_t *raop_rtp, const char *dacp_id, const char
 	raop_rtp->dacp_id = strdup(dacp_id);
 	raop_rtp->active_remote_header = strdup(active_remote_header);
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	raop_rtp_wakeup(raop_rtp);
 }
 
 void
@@ -917,6 +1645,7 @@ raop_rtp_set_progress(raop_rtp_t *raop_rtp, unsigned int start, unsigned int cur
 	raop_rtp->progress_end = end;
 	raop_rtp->progress_changed = 1;
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	raop_rtp_wakeup(raop_rtp);
 }
 
 void
@@ -927,7 +1656,9 @@ raop_rtp_flush(raop_rtp_t *raop_rtp, int next_seq)
 	/* Call flush in thread instead */
 	MUTEX_LOCK(raop_rtp->run_mutex);
 	raop_rtp->flush = next_seq;
+	clock_gettime(CLOCK_MONOTONIC, &raop_rtp->flush_time);
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	raop_rtp_wakeup(raop_rtp);
 }
 
 void
@@ -945,14 +1676,29 @@ raop_rtp_stop(raop_rtp_t *raop_rtp)
 	raop_rtp->running = 0;
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
 
-	/* Join the thread */
-	THREAD_JOIN(raop_rtp->thread);
+	if (raop_rtp->replaying) {
+		/* Nothing runs, play out what is left and close the output */
+		raop_rtp_replay_output(raop_rtp, 1);
+		raop_rtp->callbacks.audio_destroy(raop_rtp->callbacks.cls, raop_rtp->cb_data);
+		raop_rtp->opened = 0;
+		raop_rtp->replaying = 0;
+	} else if (raop_rtp->pooled) {
+		/* Wait for the worker to finish the session */
+		uint64_t value;
+		raop_rtp_wakeup(raop_rtp);
+		while (read(raop_rtp->done_fd, &value, sizeof(value)) == -1 && errno == EINTR);
+	} else {
+		raop_rtp_wakeup(raop_rtp);
+		THREAD_JOIN(raop_rtp->thread);
+	}
 	if (raop_rtp->csock != -1) closesocket(raop_rtp->csock);
 	if (raop_rtp->tsock != -1) closesocket(raop_rtp->tsock);
 	if (raop_rtp->dsock != -1) closesocket(raop_rtp->dsock);
 
-	/* Flush buffer into initial state */
+	/* Flush buffer and clock sync into initial state, a restarted
+	 * session may come from another sender clock */
 	raop_buffer_flush(raop_rtp->buffer, -1);
+	raop_ntp_reset(raop_rtp->ntp);
 
 	/* Mark thread as joined */
 	MUTEX_LOCK(raop_rtp->run_mutex);
@@ -18,6 +18,9 @@
 /* For raop_callbacks_t */
 #include "raop.h"
 #include "logger.h"
+#include "raop_pool.h"
+#include "raop_capture.h"
+#include "raop_metrics.h"
 
 #define RAOP_AESKEY_LEN 16
 #define RAOP_AESIV_LEN  16
@@ -27,9 +30,21 @@ typedef struct raop_rtp_s raop_rtp_t;
 
 raop_rtp_t *raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote,
                           const char *rtpmap, const char *fmtp,
-                          const unsigned char *aeskey, const unsigned char *aesiv);
+                          const unsigned char *aeskey, const unsigned char *aesiv,
+                          int buffer_length, int lazy_decode);
+void raop_rtp_set_min_latency(raop_rtp_t *raop_rtp, unsigned int latency);
+void raop_rtp_set_plc_mode(raop_rtp_t *raop_rtp, int mode);
+void raop_rtp_set_resample(raop_rtp_t *raop_rtp, int enabled);
+void raop_rtp_set_pool(raop_rtp_t *raop_rtp, raop_pool_t *pool);
+void raop_rtp_set_metrics(raop_rtp_t *raop_rtp, raop_metrics_t *metrics);
+void raop_rtp_set_capture(raop_rtp_t *raop_rtp, raop_capture_t *capture, unsigned int session);
 void raop_rtp_start(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_rport, unsigned short timing_rport,
                     unsigned short *control_lport, unsigned short *timing_lport, unsigned short *data_lport);
+
+/* Starts without sockets or thread, raop_rtp_replay then feeds the captured packets */
+void raop_rtp_start_replay(raop_rtp_t *raop_rtp, unsigned short control_rport);
+void raop_rtp_replay(raop_rtp_t *raop_rtp, int type, const unsigned char *data, int datalen, uint64_t time);
+
 void raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume);
 void raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen);
 void raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen);
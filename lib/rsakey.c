@@ -21,6 +21,7 @@
 #include "rsapem.h"
 #include "base64.h"
 #include "crypto/crypto.h"
+#include "ed25519/ed25519.h"
 
 #define RSA_MIN_PADLEN 8
 #define MAX_KEYLEN 512
@@ -360,6 +361,70 @@ rsakey_decrypt(rsakey_t *rsakey, unsigned char *dst, int dstlen, const char *b64
 	return outlen;
 }
 
+/* OAEP encryption with SHA-1 hash using the public key */
+/* See RFC 3447 7.1.1 for more information */
+int
+rsakey_encrypt(rsakey_t *rsakey, char *dst, int dstlen, const unsigned char *input, int inputlen)
+{
+	unsigned char buffer[MAX_KEYLEN];
+	unsigned char maskbuf[MAX_KEYLEN];
+	unsigned char seed[32];
+	unsigned char *db;
+	SHA1_CTX sha_ctx;
+	bigint *bi_in;
+	bigint *bi_out;
+	int dblen;
+	int i, ret;
+
+	assert(rsakey);
+	if (!dst || !input) {
+		return -1;
+	}
+	if (dstlen < base64_encoded_length(rsakey->base64, rsakey->keylen)) {
+		return -1;
+	}
+	if (inputlen > rsakey->keylen-2-2*SHA1_SIZE) {
+		return -2;
+	}
+	if (ed25519_create_seed(seed)) {
+		return -3;
+	}
+
+	/* Data block is the hash of an empty label, zero padding, 0x01 and the message */
+	memset(buffer, 0, sizeof(buffer));
+	db = buffer+1+SHA1_SIZE;
+	dblen = rsakey->keylen-1-SHA1_SIZE;
+	SHA1_Init(&sha_ctx);
+	SHA1_Final(db, &sha_ctx);
+	db[dblen-inputlen-1] = 0x01;
+	memcpy(db+dblen-inputlen, input, inputlen);
+
+	/* Mask the data block with the seed, then the seed with the masked block */
+	ret = rsakey_mfg1(maskbuf, sizeof(maskbuf), seed, SHA1_SIZE, dblen);
+	if (ret < 0) {
+		return -4;
+	}
+	for (i=0; i<ret; i++) {
+		db[i] ^= maskbuf[i];
+	}
+	ret = rsakey_mfg1(maskbuf, sizeof(maskbuf), db, dblen, SHA1_SIZE);
+	if (ret < 0) {
+		return -5;
+	}
+	for (i=0; i<ret; i++) {
+		buffer[1+i] = seed[i] ^ maskbuf[i];
+	}
+
+	/* Encrypt the padded data c = m^e (mod n) */
+	bi_in = bi_import(rsakey->bi_ctx, buffer, rsakey->keylen);
+	rsakey->bi_ctx->mod_offset = BIGINT_M_OFFSET;
+	bi_out = bi_mod_power(rsakey->bi_ctx, bi_in, rsakey->e);
+
+	bi_export(rsakey->bi_ctx, bi_out, buffer, rsakey->keylen);
+	base64_encode(rsakey->base64, dst, buffer, rsakey->keylen);
+	return 0;
+}
+
 int
 rsakey_decode(rsakey_t *rsakey, unsigned char *dst, int dstlen, const char *b64input)
 {
@@ -28,22 +28,27 @@
 #include <unistd.h>
 #include <assert.h>
 #include <signal.h>
+#include <errno.h>
 
 
 #include <shairplay/dnssd.h>
 #include <shairplay/raop.h>
 
-#include <alsa/asoundlib.h>
-
-#define nelem(x) sizeof(x)/sizeof(x[0])
+#include "sinks/sink.h"
 
 typedef struct ShairSession ShairSession;
 struct ShairSession {
-	snd_pcm_t *pcmdev;
+	const sink_t *sink;
+	void *handle;
 };
 
 
 static int running;
+static volatile sig_atomic_t dump_metrics;
+
+// chosen with -o, every session plays to it
+static const sink_t *sink;
+static const char *sink_arg;
 
 
 static void
@@ -54,6 +59,9 @@ signal_handler(int sig)
 	case SIGTERM:
 		running = 0;
 		break;
+	case SIGUSR1:
+		dump_metrics = 1;
+		break;
 	}
 }
 static void
@@ -66,31 +74,11 @@ init_signals(void)
 	sigact.sa_flags = 0;
 	sigaction(SIGINT, &sigact, NULL);
 	sigaction(SIGTERM, &sigact, NULL);
-}
+	sigaction(SIGUSR1, &sigact, NULL);
 
-static snd_pcm_t *
-audio_open_device(int bits, int channels, int samplerate)
-{
-	snd_pcm_t *pcm;
-
-	// nonblocking mode.. but we also don't want to buffer much. so we should
-	// slightly speed up or slow down to stay in the middle. to be implemented.
-	snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
-
-	snd_pcm_hw_params_t *hw_params;
-	snd_pcm_hw_params_malloc(&hw_params);
-	snd_pcm_hw_params_any(pcm, hw_params);
-	snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
-	snd_pcm_hw_params_set_format(pcm, hw_params, SND_PCM_FORMAT_S16_LE);
-	snd_pcm_hw_params_set_channels(pcm, hw_params, 2);
-	snd_pcm_hw_params_set_rate(pcm, hw_params, 44100, 0);
-	snd_pcm_hw_params_set_periods(pcm, hw_params, 13, 0);
-	snd_pcm_hw_params_set_period_time(pcm, hw_params, 8*1000, 0);
-	snd_pcm_hw_params_set_period_size(pcm, hw_params, 352, 0);
-	snd_pcm_hw_params(pcm, hw_params);
-	snd_pcm_hw_params_free(hw_params);
-
-	return pcm;
+	// a pipe sink whose reader went away must not kill us
+	sigact.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sigact, NULL);
 }
 
 static void *
@@ -99,49 +87,12 @@ audio_init(void *cls, int bits, int channels, int samplerate, int *audio_fd)
 	ShairSession *sp = malloc(sizeof sp[0]);
 	memset(sp, 0, sizeof sp[0]);
 
-	sp->pcmdev = audio_open_device(bits, channels, samplerate);
-	if (sp->pcmdev == NULL) {
-		printf("Error opening device %d\n", errno);
+	sp->sink = sink;
+	sp->handle = sink->open(sink_arg, bits, channels, samplerate, audio_fd);
+	if (sp->handle == NULL) {
+		printf("Error opening %s output %d\n", sink->name, errno);
 		printf("The device might already be in use");
 	}
-
-	// the rtp thread uses select, so we dig into the poll descriptors,
-	// find the output fd and return it. also spit out as much info as possible
-
-	struct pollfd pollfds[8];
-	int npoll = snd_pcm_poll_descriptors(sp->pcmdev, pollfds, nelem(pollfds));
-
-	// just for debug purposes.
-	static int pollflags[] = {
-		POLLIN,
-		POLLPRI,
-		POLLOUT,
-		POLLERR,
-		POLLHUP,
-		POLLNVAL,
-	};
-
-	static char *pollnames[] = {
-		"POLLIN",
-		"POLLPRI",
-		"POLLOUT",
-		"POLLERR",
-		"POLLHUP",
-		"POLLNVAL"
-	};
-
-	for(int i = 0; i < npoll; i++){
-		fprintf(stderr, "audio_init: pollfds[%d]: fd %d", i, pollfds[i].fd);
-		for(int fi = 0; fi < nelem(pollflags); fi++)
-			if(pollfds[i].events & pollflags[fi])
-				fprintf(stderr, " %s", pollnames[fi]);
-		if(pollfds[i].events & POLLOUT){
-			fprintf(stderr, " - passing this to rtp thread");
-			*audio_fd = pollfds[i].fd;
-		}
-		fprintf(stderr, "\n");
-	}
-
 	return sp;
 }
 
@@ -149,46 +100,38 @@ static void
 audio_process(void *cls, void *opaque, const void *abuf, int len, unsigned int timestamp, unsigned int ltime)
 {
 	ShairSession *sp = opaque;
-	const char *buf = abuf;
-
-	struct {
-		short left;
-		short right;
-	} frames[1024];
-
-	while(len > 0){
-		int nbytes = (len < sizeof frames) ? len : sizeof frames;
-		memcpy(frames, buf, nbytes);
-		int nframes = nbytes / sizeof frames[0];
-		for(int i = 0; i < nframes; i++){
-			int sum = (frames[i].left + frames[i].right) / 2;
-			frames[i].left = sum;
-			frames[i].right = sum;
-		}
-		if(sp->pcmdev != NULL){
-			int nwr = snd_pcm_writei(sp->pcmdev, frames, nframes);
-			if(nwr > 0 && nwr < nframes){
-				fprintf(stderr, "pcmdev short write: buffers full\n");
-			} else if(nwr == -EAGAIN){
-				fprintf(stderr, "pcmdev eagain: buffers full\n");
-			} else if(nwr == -EPIPE || nwr == -EINTR || nwr == -ESTRPIPE ){
-				snd_pcm_recover(sp->pcmdev, nwr, 0);
-				fprintf(stderr, "pcmdev broken pipe nframes %d\n", nframes);
-			}
 
-			// we just wrote nframes after timestamp.
-			// the sample emanating from the speaker is (timestamp+nframes)-snd_pcm_delay.
-			// ... in theory.
-			// we've written upto timestamp+532, last byte in the buffer is ltime+532
-			// so there's (ltime+532)-(timestamp+532) = ltime-timestamp bytes in the buffer
-			// there's delay bytes in the hardware.
-			long delay;
-			snd_pcm_delay(sp->pcmdev, &delay);
-			fprintf(stderr, "pcmdev pcmdelay %ld buffered %u\n", delay, ltime-timestamp);
-		}
-		len -= nbytes;
-		buf += nbytes;
-	}
+	if(sp->handle != NULL)
+		sp->sink->write(sp->handle, abuf, len);
+}
+
+static void *
+audio_get_buffer(void *cls, void *opaque, int frames)
+{
+	ShairSession *sp = opaque;
+
+	if(sp->handle == NULL || sp->sink->get_buffer == NULL)
+		return NULL;
+	return sp->sink->get_buffer(sp->handle, frames);
+}
+
+static void
+audio_put_buffer(void *cls, void *opaque, void *buffer, int len, unsigned int timestamp, unsigned int ltime)
+{
+	ShairSession *sp = opaque;
+
+	sp->sink->put_buffer(sp->handle, buffer, len);
+}
+
+static int
+audio_get_delay(void *cls, void *opaque)
+{
+	ShairSession *sp = opaque;
+
+	// file like sinks have nothing queued once written
+	if(sp->handle == NULL || sp->sink->delay == NULL)
+		return 0;
+	return sp->sink->delay(sp->handle);
 }
 
 static void
@@ -196,10 +139,8 @@ audio_destroy(void *cls, void *opaque)
 {
 	ShairSession *sp = opaque;
 
-	if(sp->pcmdev != NULL){
-		snd_pcm_drain(sp->pcmdev);
-		snd_pcm_close(sp->pcmdev);
-	}
+	if(sp->handle != NULL)
+		sp->sink->close(sp->handle);
 	free(sp);
 }
 
@@ -216,6 +157,35 @@ audio_set_progress(void *arg1, void *arg2, unsigned int start, unsigned int curr
 	fprintf(stderr, "progress %u/%u/%u\n", start, curr, end);
 }
 
+static void
+print_histogram(const char *name, const raop_histogram_t *h, const char *unit)
+{
+	fprintf(stderr, "  %-14s %llu samples, mean %.1f %s, max %llu %s\n", name, h->count,
+	        h->count ? (double)h->sum / h->count : 0.0, unit, h->max, unit);
+}
+
+// kill -USR1 prints the counters of the receiver
+static void
+print_metrics(raop_t *raop)
+{
+	raop_metrics_t m;
+
+	raop_get_metrics(raop, &m);
+	fprintf(stderr, "metrics: %llu sessions, %llu wakeups\n", m.sessions, m.wakeups);
+	fprintf(stderr, "  receive        %llu calls, %llu packets\n", m.recv_calls, m.recv_packets);
+	fprintf(stderr, "  packets        %llu received, %llu resent, %llu late, %llu duplicate, %llu lost\n",
+	        m.packets_received, m.packets_resent, m.packets_late, m.packets_duplicate, m.packets_lost);
+	fprintf(stderr, "  frames         %llu output, %llu dropped, %llu resend requests\n",
+	        m.frames_output, m.frames_dropped, m.resend_requests);
+	fprintf(stderr, "  resample       ratio %.9f, playout error %lld us\n",
+	        m.resample_ratio / 1e9, m.resample_error);
+	print_histogram("buffer fill", &m.buffer_fill, "frames");
+	print_histogram("playout error", &m.playout_error, "us");
+	print_histogram("aes", &m.aes_time, "ns");
+	print_histogram("decode", &m.decode_time, "ns");
+	print_histogram("callback", &m.callback_time, "ns");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -225,17 +195,51 @@ main(int argc, char *argv[])
 	raop_callbacks_t raop_cbs;
 
 	int error;
+	const char *capture = NULL;
+	// debug messages come per packet, so only with -v
+	int log_level = RAOP_LOG_INFO;
+
+	int opt;
+	while((opt = getopt(argc, argv, "o:c:v")) != -1){
+		switch(opt){
+		case 'o':
+			sink = sink_find(optarg, &sink_arg);
+			if(sink == NULL){
+				fprintf(stderr, "Unknown output %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'c':
+			// every session is appended to this file for raop_replay
+			capture = optarg;
+			break;
+		case 'v':
+			log_level = RAOP_LOG_DEBUG;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o output] [-c capture] [-v]\noutputs:\n", argv[0]);
+			sink_print_usage();
+			return -1;
+		}
+	}
+	if(sink == NULL)
+		sink = sink_default();
 
 	init_signals();
-
-	snd_pcm_t *pcmdev = audio_open_device(16, 2, 44100);
-	if(pcmdev == NULL) {
-		fprintf(stderr, "Error opening audio device %d\n", errno);
-		fprintf(stderr, "Please check your libao settings and try again\n");
-		return -1;
+	sink_set_log_level(log_level);
+
+	// make sure the output works before announcing the service, except for
+	// pipes where this would wait for the reader and then hang up on it
+	if(sink != &sink_pipe){
+		int audio_fd = -1;
+		void *handle = sink->open(sink_arg, 16, 2, 44100, &audio_fd);
+		if(handle == NULL) {
+			fprintf(stderr, "Error opening %s output %d\n", sink->name, errno);
+			fprintf(stderr, "Please check your output settings and try again\n");
+			return -1;
+		}
+		sink->close(handle);
 	}
-	snd_pcm_drain(pcmdev);
-	snd_pcm_close(pcmdev);
 
 	memset(&raop_cbs, 0, sizeof(raop_cbs));
 	raop_cbs.audio_init = audio_init;
@@ -243,6 +247,9 @@ main(int argc, char *argv[])
 	raop_cbs.audio_destroy = audio_destroy;
 	raop_cbs.audio_set_volume = audio_set_volume;
 	raop_cbs.audio_set_progress = audio_set_progress;
+	raop_cbs.audio_get_delay = audio_get_delay;
+	raop_cbs.audio_get_buffer = audio_get_buffer;
+	raop_cbs.audio_put_buffer = audio_put_buffer;
 
 	raop = raop_init_from_keyfile(10, &raop_cbs, "airport.key", NULL);
 	if(raop == NULL) {
@@ -256,7 +263,12 @@ main(int argc, char *argv[])
 	char hwaddr[] = { 0x48, 0x5d, 0x60, 0x7c, 0xee, 0x22 };
 	char *apname = "barry";
 	char *password = NULL;
-	raop_set_log_level(raop, RAOP_LOG_DEBUG);
+	raop_set_log_level(raop, log_level);
+	if(capture != NULL && raop_set_capture_file(raop, capture) < 0) {
+		fprintf(stderr, "Could not open capture file %s\n", capture);
+		raop_destroy(raop);
+		return -1;
+	}
 	raop_start(raop, &port, hwaddr, sizeof(hwaddr), password);
 
 	error = 0;
@@ -275,8 +287,13 @@ main(int argc, char *argv[])
 
 	// run until termination signal
 	running = 1;
-	while(running)
+	while(running){
 		pause();
+		if(dump_metrics){
+			dump_metrics = 0;
+			print_metrics(raop);
+		}
+	}
 
 	dnssd_unregister_raop(dnssd);
 	dnssd_destroy(dnssd);
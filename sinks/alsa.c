@@ -0,0 +1,318 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <alsa/asoundlib.h>
+
+#include "sink.h"
+
+#define nelem(x) sizeof(x)/sizeof(x[0])
+
+typedef struct AlsaSink AlsaSink;
+struct AlsaSink {
+	snd_pcm_t *pcmdev;
+	snd_pcm_uframes_t pcmsize;
+	int samplerate;
+
+	// decoded audio goes straight into the dma ring at mmap_offset,
+	// mmap_frames is what mmap_begin lent and put_buffer must commit
+	int mmap;
+	snd_pcm_uframes_t mmap_offset;
+	snd_pcm_uframes_t mmap_frames;
+
+	// lent to the library when the device has no mmap access
+	short *buffer;
+	int buffer_frames;
+};
+
+static snd_pcm_t *
+alsa_open_device(const char *device, int bits, int channels, int samplerate, int *mmap)
+{
+	snd_pcm_t *pcm;
+
+	// nonblocking mode.. but we also don't want to buffer much. the resampler
+	// in raop_rtp slightly speeds up or slows down to stay in the middle.
+	if(snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0)
+		return NULL;
+
+	snd_pcm_hw_params_t *hw_params;
+	snd_pcm_hw_params_malloc(&hw_params);
+	snd_pcm_hw_params_any(pcm, hw_params);
+	// write into the dma ring directly where the device allows it
+	*mmap = (snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0);
+	if(!*mmap)
+		snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+	snd_pcm_hw_params_set_format(pcm, hw_params, SND_PCM_FORMAT_S16_LE);
+	snd_pcm_hw_params_set_channels(pcm, hw_params, 2);
+	snd_pcm_hw_params_set_rate(pcm, hw_params, 44100, 0);
+	snd_pcm_hw_params_set_periods(pcm, hw_params, 13, 0);
+	snd_pcm_hw_params_set_period_time(pcm, hw_params, 8*1000, 0);
+	snd_pcm_hw_params_set_period_size(pcm, hw_params, 352, 0);
+	snd_pcm_hw_params(pcm, hw_params);
+	snd_pcm_hw_params_free(hw_params);
+
+	// timestamp the hardware pointer, alsa_delay works from it
+	snd_pcm_sw_params_t *sw_params;
+	snd_pcm_sw_params_malloc(&sw_params);
+	snd_pcm_sw_params_current(pcm, sw_params);
+	snd_pcm_sw_params_set_tstamp_mode(pcm, sw_params, SND_PCM_TSTAMP_ENABLE);
+	snd_pcm_sw_params_set_tstamp_type(pcm, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	snd_pcm_sw_params(pcm, sw_params);
+	snd_pcm_sw_params_free(sw_params);
+
+	return pcm;
+}
+
+static void *
+alsa_open(const char *arg, int bits, int channels, int samplerate, int *audio_fd)
+{
+	AlsaSink *as = malloc(sizeof as[0]);
+	memset(as, 0, sizeof as[0]);
+
+	as->pcmdev = alsa_open_device(arg ? arg : "default", bits, channels, samplerate, &as->mmap);
+	if (as->pcmdev == NULL) {
+		free(as);
+		return NULL;
+	}
+	snd_pcm_uframes_t period;
+	snd_pcm_get_params(as->pcmdev, &as->pcmsize, &period);
+	as->samplerate = samplerate;
+	sink_log(RAOP_LOG_INFO, "audio_init: %s access, %lu frame ring", as->mmap ? "mmap" : "rw", as->pcmsize);
+
+	// the rtp thread uses select, so we dig into the poll descriptors,
+	// find the output fd and return it. also spit out as much info as possible
+
+	struct pollfd pollfds[8];
+	int npoll = snd_pcm_poll_descriptors(as->pcmdev, pollfds, nelem(pollfds));
+
+	// just for debug purposes.
+	static int pollflags[] = {
+		POLLIN,
+		POLLPRI,
+		POLLOUT,
+		POLLERR,
+		POLLHUP,
+		POLLNVAL,
+	};
+
+	static char *pollnames[] = {
+		"POLLIN",
+		"POLLPRI",
+		"POLLOUT",
+		"POLLERR",
+		"POLLHUP",
+		"POLLNVAL"
+	};
+
+	for(int i = 0; i < npoll; i++){
+		char flags[64] = "";
+		for(int fi = 0; fi < nelem(pollflags); fi++)
+			if(pollfds[i].events & pollflags[fi]){
+				strcat(flags, " ");
+				strcat(flags, pollnames[fi]);
+			}
+		if(pollfds[i].events & POLLOUT)
+			*audio_fd = pollfds[i].fd;
+		sink_log(RAOP_LOG_DEBUG, "audio_init: pollfds[%d]: fd %d%s%s", i, pollfds[i].fd, flags,
+		         (pollfds[i].events & POLLOUT) ? " - passing this to rtp thread" : "");
+	}
+
+	return as;
+}
+
+// downmix to mono in place
+static void
+alsa_downmix(short *frames, int nframes)
+{
+	for(int i = 0; i < nframes; i++){
+		int sum = (frames[2*i] + frames[2*i+1]) / 2;
+		frames[2*i] = sum;
+		frames[2*i+1] = sum;
+	}
+}
+
+static void
+alsa_write_frames(AlsaSink *as, short *frames, int nframes)
+{
+	alsa_downmix(frames, nframes);
+
+	int nwr = as->mmap ? snd_pcm_mmap_writei(as->pcmdev, frames, nframes)
+	                   : snd_pcm_writei(as->pcmdev, frames, nframes);
+	if(nwr > 0 && nwr < nframes){
+		sink_log(RAOP_LOG_DEBUG, "pcmdev short write: buffers full");
+	} else if(nwr == -EAGAIN){
+		sink_log(RAOP_LOG_DEBUG, "pcmdev eagain: buffers full");
+	} else if(nwr == -EPIPE || nwr == -EINTR || nwr == -ESTRPIPE ){
+		snd_pcm_recover(as->pcmdev, nwr, 0);
+		sink_log(RAOP_LOG_WARNING, "pcmdev broken pipe nframes %d", nframes);
+	}
+}
+
+static int alsa_delay(void *handle);
+
+static void
+alsa_write(void *handle, const void *abuf, int len)
+{
+	AlsaSink *as = handle;
+	const char *buf = abuf;
+
+	struct {
+		short left;
+		short right;
+	} frames[1024];
+
+	while(len > 0){
+		int nbytes = (len < sizeof frames) ? len : sizeof frames;
+		memcpy(frames, buf, nbytes);
+		alsa_write_frames(as, (short *)frames, nbytes / sizeof frames[0]);
+
+		// the sample emanating from the speaker is what we just wrote minus the delay,
+		// only queried when debug messages are built in
+		sink_log(RAOP_LOG_DEBUG, "pcmdev pcmdelay %d", alsa_delay(as));
+
+		len -= nbytes;
+		buf += nbytes;
+	}
+}
+
+static void *
+alsa_get_buffer(void *handle, int frames)
+{
+	AlsaSink *as = handle;
+
+	if(as->mmap){
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset, nframes = frames;
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(as->pcmdev);
+
+		if(avail < 0){
+			snd_pcm_recover(as->pcmdev, avail, 0);
+			sink_log(RAOP_LOG_WARNING, "pcmdev xrun before mmap");
+			return NULL;
+		}
+		// when the ring is full alsa_write does a short write
+		if(avail < frames)
+			return NULL;
+		if(snd_pcm_mmap_begin(as->pcmdev, &areas, &offset, &nframes) < 0)
+			return NULL;
+		if(nframes < frames){
+			// the free space wraps around the end, alsa_write copies in two parts
+			snd_pcm_mmap_commit(as->pcmdev, offset, 0);
+			return NULL;
+		}
+		as->mmap_offset = offset;
+		as->mmap_frames = frames;
+		// interleaved, so the first area addresses all channels
+		return (char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+	}
+
+	if(frames > as->buffer_frames){
+		short *buffer = realloc(as->buffer, frames * 2 * sizeof(short));
+		if(buffer == NULL)
+			return NULL;
+		as->buffer = buffer;
+		as->buffer_frames = frames;
+	}
+	return as->buffer;
+}
+
+static void
+alsa_put_buffer(void *handle, void *buffer, int len)
+{
+	AlsaSink *as = handle;
+	int nframes = len / (2 * sizeof(short));
+
+	if(as->mmap){
+		// every mmap_begin is closed by one commit, of 0 frames if nothing was decoded
+		if(as->mmap_frames == 0)
+			return;
+		if(nframes > as->mmap_frames)
+			nframes = as->mmap_frames;
+		as->mmap_frames = 0;
+		alsa_downmix(buffer, nframes);
+		snd_pcm_sframes_t ret = snd_pcm_mmap_commit(as->pcmdev, as->mmap_offset, nframes);
+		if(ret < 0){
+			snd_pcm_recover(as->pcmdev, ret, 0);
+			sink_log(RAOP_LOG_WARNING, "pcmdev broken pipe nframes %d", nframes);
+		} else if(nframes > 0 && snd_pcm_state(as->pcmdev) == SND_PCM_STATE_PREPARED){
+			// mmap commits do not start the stream by themselves
+			snd_pcm_start(as->pcmdev);
+		}
+	} else if(nframes > 0){
+		if(nframes > as->buffer_frames)
+			nframes = as->buffer_frames;
+		alsa_write_frames(as, buffer, nframes);
+	}
+}
+
+static int
+alsa_delay(void *handle)
+{
+	AlsaSink *as = handle;
+	snd_pcm_uframes_t avail;
+	snd_pcm_sframes_t delay;
+	snd_htimestamp_t tstamp;
+	struct timespec now;
+
+	// frames queued when the hardware pointer last moved, less those played since
+	if(snd_pcm_state(as->pcmdev) == SND_PCM_STATE_RUNNING &&
+	   snd_pcm_htimestamp(as->pcmdev, &avail, &tstamp) == 0 &&
+	   (tstamp.tv_sec != 0 || tstamp.tv_nsec != 0) && avail <= as->pcmsize){
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long long elapsed = (now.tv_sec - tstamp.tv_sec) * 1000000000ll + (now.tv_nsec - tstamp.tv_nsec);
+		if(elapsed < 0)
+			elapsed = 0;
+		delay = (as->pcmsize - avail) - elapsed * as->samplerate / 1000000000ll;
+		return (delay > 0) ? delay : 0;
+	}
+
+	if(snd_pcm_delay(as->pcmdev, &delay) < 0)
+		return 0;
+	return delay;
+}
+
+static void
+alsa_close(void *handle)
+{
+	AlsaSink *as = handle;
+
+	snd_pcm_drain(as->pcmdev);
+	snd_pcm_close(as->pcmdev);
+	free(as->buffer);
+	free(as);
+}
+
+const sink_t sink_alsa = {
+	.name = "alsa",
+	.usage = "alsa[:device]",
+	.open = alsa_open,
+	.write = alsa_write,
+	.close = alsa_close,
+	.delay = alsa_delay,
+	.get_buffer = alsa_get_buffer,
+	.put_buffer = alsa_put_buffer,
+};
@@ -0,0 +1,180 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sink.h"
+
+// raw pcm to a pipe, fifo, file or stdout, and the same wrapped in a wav file
+typedef struct FileSink FileSink;
+struct FileSink {
+	int fd;
+	int wav;
+	unsigned int datalen;
+	int failed;
+};
+
+static void
+file_put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void
+file_put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v; p[1] = v >> 8;
+}
+
+static int
+file_write_all(int fd, const void *abuf, int len)
+{
+	const char *buf = abuf;
+
+	while(len > 0){
+		ssize_t n = write(fd, buf, len);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static FileSink *
+file_open(const char *path, int wav)
+{
+	FileSink *fs;
+	int fd;
+
+	if(path == NULL || *path == '\0'){
+		fprintf(stderr, "%s sink needs a path\n", wav ? "wav" : "pipe");
+		return NULL;
+	}
+	if(!wav && !strcmp(path, "-")){
+		fd = STDOUT_FILENO;
+	} else {
+		// opening a fifo waits for its reader
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0){
+			fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+			return NULL;
+		}
+	}
+	fs = calloc(1, sizeof fs[0]);
+	fs->fd = fd;
+	fs->wav = wav;
+	return fs;
+}
+
+static void *
+pipe_open(const char *arg, int bits, int channels, int samplerate, int *audio_fd)
+{
+	return file_open(arg, 0);
+}
+
+// the sizes are unknown until the session ends, they are patched in on close
+static void *
+wav_open(const char *arg, int bits, int channels, int samplerate, int *audio_fd)
+{
+	FileSink *fs = file_open(arg, 1);
+	unsigned char header[44];
+
+	if(fs == NULL)
+		return NULL;
+	memcpy(header, "RIFF", 4);
+	file_put32(header+4, 36);
+	memcpy(header+8, "WAVEfmt ", 8);
+	file_put32(header+16, 16);
+	file_put16(header+20, 1);
+	file_put16(header+22, channels);
+	file_put32(header+24, samplerate);
+	file_put32(header+28, samplerate * channels * bits/8);
+	file_put16(header+32, channels * bits/8);
+	file_put16(header+34, bits);
+	memcpy(header+36, "data", 4);
+	file_put32(header+40, 0);
+	if(file_write_all(fs->fd, header, sizeof header) < 0)
+		fs->failed = 1;
+	return fs;
+}
+
+static void
+file_write(void *handle, const void *buf, int len)
+{
+	FileSink *fs = handle;
+
+	if(fs->failed)
+		return;
+	if(file_write_all(fs->fd, buf, len) < 0){
+		// a reader that went away is not fatal, the rest of the session is dropped
+		fprintf(stderr, "Error writing audio: %s\n", strerror(errno));
+		fs->failed = 1;
+		return;
+	}
+	fs->datalen += len;
+}
+
+static void
+file_close(void *handle)
+{
+	FileSink *fs = handle;
+
+	if(fs->wav && lseek(fs->fd, 4, SEEK_SET) == 4){
+		unsigned char size[4];
+
+		file_put32(size, 36 + fs->datalen);
+		file_write_all(fs->fd, size, 4);
+		if(lseek(fs->fd, 40, SEEK_SET) == 40){
+			file_put32(size, fs->datalen);
+			file_write_all(fs->fd, size, 4);
+		}
+	}
+	if(fs->fd != STDOUT_FILENO)
+		close(fs->fd);
+	free(fs);
+}
+
+const sink_t sink_pipe = {
+	.name = "pipe",
+	.usage = "pipe:path|-",
+	.open = pipe_open,
+	.write = file_write,
+	.close = file_close,
+};
+
+const sink_t sink_wav = {
+	.name = "wav",
+	.usage = "wav:path",
+	.open = wav_open,
+	.write = file_write,
+	.close = file_close,
+};
@@ -0,0 +1,96 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "sink.h"
+
+// discards the audio, for benchmarks and hosts without a sound card.
+// it lends one scratch buffer so the library decodes straight into it.
+typedef struct NullSink NullSink;
+struct NullSink {
+	void *buffer;
+	int buffer_bytes;
+	int frame_bytes;
+	unsigned long long frames;
+};
+
+static void *
+null_open(const char *arg, int bits, int channels, int samplerate, int *audio_fd)
+{
+	NullSink *ns = calloc(1, sizeof ns[0]);
+
+	ns->frame_bytes = channels * bits/8;
+	return ns;
+}
+
+static void
+null_write(void *handle, const void *buf, int len)
+{
+	NullSink *ns = handle;
+
+	ns->frames += len / ns->frame_bytes;
+}
+
+static void *
+null_get_buffer(void *handle, int frames)
+{
+	NullSink *ns = handle;
+	int bytes = frames * ns->frame_bytes;
+
+	if(bytes > ns->buffer_bytes){
+		void *buffer = realloc(ns->buffer, bytes);
+		if(buffer == NULL)
+			return NULL;
+		ns->buffer = buffer;
+		ns->buffer_bytes = bytes;
+	}
+	return ns->buffer;
+}
+
+static void
+null_put_buffer(void *handle, void *buffer, int len)
+{
+	null_write(handle, buffer, len);
+}
+
+static void
+null_close(void *handle)
+{
+	NullSink *ns = handle;
+
+	fprintf(stderr, "null sink: discarded %llu frames\n", ns->frames);
+	free(ns->buffer);
+	free(ns);
+}
+
+const sink_t sink_null = {
+	.name = "null",
+	.usage = "null",
+	.open = null_open,
+	.write = null_write,
+	.close = null_close,
+	.get_buffer = null_get_buffer,
+	.put_buffer = null_put_buffer,
+};
@@ -0,0 +1,98 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "sink.h"
+
+static const sink_t *sinks[] = {
+#ifdef HAVE_ALSA
+	&sink_alsa,
+#endif
+	&sink_pipe,
+	&sink_wav,
+	&sink_null,
+};
+
+#define nelem(x) sizeof(x)/sizeof(x[0])
+
+static int log_level = RAOP_LOG_WARNING;
+
+const sink_t *
+sink_find(const char *spec, const char **arg)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+	for(int i = 0; i < nelem(sinks); i++){
+		if(strlen(sinks[i]->name) == len && !strncmp(sinks[i]->name, spec, len)){
+			*arg = colon ? colon+1 : NULL;
+			return sinks[i];
+		}
+	}
+	return NULL;
+}
+
+// the first one built in, alsa when available
+const sink_t *
+sink_default(void)
+{
+	return sinks[0];
+}
+
+void
+sink_print_usage(void)
+{
+	for(int i = 0; i < nelem(sinks); i++)
+		fprintf(stderr, "  %s%s\n", sinks[i]->usage, sinks[i] == sink_default() ? " (default)" : "");
+}
+
+void
+sink_set_log_level(int level)
+{
+	__atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int
+sink_log_enabled(int level)
+{
+	return level <= __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+void
+sink_write_log(int level, const char *fmt, ...)
+{
+	char buffer[1024];
+	va_list ap;
+
+	if(!sink_log_enabled(level))
+		return;
+
+	// one write per message so lines of two sessions do not interleave
+	va_start(ap, fmt);
+	vsnprintf(buffer, sizeof buffer, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "%s\n", buffer);
+}
@@ -0,0 +1,76 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <shairplay/raop.h>
+
+// levels of sink_log above this are compiled out, same knob as the library
+#ifndef LOGGER_MAX_LEVEL
+#define LOGGER_MAX_LEVEL RAOP_LOG_DEBUG
+#endif
+
+// an audio output the daemon plays sessions to, one handle per session.
+// open, write and close are compulsory, the others may be NULL.
+typedef struct sink_s sink_t;
+struct sink_s {
+	const char *name;
+	const char *usage;
+
+	// arg is the part after "name:" on the command line, or NULL.
+	// audio_fd is set when the output has a descriptor to poll for room.
+	void *(*open)(const char *arg, int bits, int channels, int samplerate, int *audio_fd);
+	void  (*write)(void *handle, const void *buffer, int buflen);
+	void  (*close)(void *handle);
+
+	// frames written but not yet heard
+	int   (*delay)(void *handle);
+
+	// zero-copy output, see audio_get_buffer in raop.h
+	void *(*get_buffer)(void *handle, int frames);
+	void  (*put_buffer)(void *handle, void *buffer, int buflen);
+};
+
+// spec is "name" or "name:arg", returns NULL for an unknown name
+const sink_t *sink_find(const char *spec, const char **arg);
+const sink_t *sink_default(void);
+void sink_print_usage(void);
+
+// messages of the outputs at RAOP_LOG_* levels, the ones on every write
+// are debug so they cost a compare unless asked for. the arguments are
+// only evaluated when the level is enabled, they may query the device.
+void sink_set_log_level(int level);
+int sink_log_enabled(int level);
+void sink_write_log(int level, const char *fmt, ...);
+#define sink_log(level, ...) \
+	do { if((level) <= LOGGER_MAX_LEVEL && sink_log_enabled(level)) sink_write_log((level), __VA_ARGS__); } while(0)
+
+extern const sink_t sink_null;
+extern const sink_t sink_pipe;
+extern const sink_t sink_wav;
+#ifdef HAVE_ALSA
+extern const sink_t sink_alsa;
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks AES_cbc_decrypt against the FIPS-197 AES-128 vector and compares
+ * it byte for byte with the table code on random keys and buffers. On a
+ * CPU with AES-NI the library takes the AES-NI path, so that is the one
+ * checked against the tables, otherwise both runs use the tables.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "crypto/crypto.h"
+
+/* tools/aes_table.c */
+void table_AES_set_key(AES_CTX *ctx, const uint8_t *key, const uint8_t *iv, AES_MODE mode);
+void table_AES_convert_key(AES_CTX *ctx);
+void table_AES_cbc_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length);
+void table_AES_cbc_decrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length);
+
+#define MAX_LENGTH 4096
+#define ROUNDS     2000
+
+static int failures;
+
+static void
+check(int ok, const char *what, int round, int length)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL %s, round %d, length %d\n", what, round, length);
+		failures++;
+	}
+}
+
+static void
+random_bytes(unsigned char *buf, int len)
+{
+	int i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = rand() & 0xff;
+	}
+}
+
+static void
+known_answer(void)
+{
+	/* FIPS-197 appendix C.1, one block of CBC with a zero IV is ECB */
+	static const unsigned char key[16] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+	};
+	static const unsigned char plain[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+	};
+	static const unsigned char cipher[16] = {
+		0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+		0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+	};
+	unsigned char iv[16], out[16];
+	AES_CTX ctx;
+
+	memset(iv, 0, sizeof(iv));
+
+	AES_set_key(&ctx, key, iv, AES_MODE_128);
+	AES_cbc_encrypt(&ctx, plain, out, 16);
+	check(!memcmp(out, cipher, 16), "FIPS-197 encrypt", 0, 16);
+
+	AES_set_key(&ctx, key, iv, AES_MODE_128);
+	AES_convert_key(&ctx);
+	AES_cbc_decrypt(&ctx, cipher, out, 16);
+	check(!memcmp(out, plain, 16), "FIPS-197 decrypt", 0, 16);
+
+	table_AES_set_key(&ctx, key, iv, AES_MODE_128);
+	table_AES_convert_key(&ctx);
+	table_AES_cbc_decrypt(&ctx, cipher, out, 16);
+	check(!memcmp(out, plain, 16), "FIPS-197 table decrypt", 0, 16);
+}
+
+static void
+random_buffers(void)
+{
+	static unsigned char plain[MAX_LENGTH], cipher[MAX_LENGTH];
+	static unsigned char out[MAX_LENGTH], ref[MAX_LENGTH];
+	unsigned char key[16], iv[16];
+	AES_CTX ctx, table_ctx;
+	int round;
+
+	for (round=0; round<ROUNDS; round++) {
+		/* Whole blocks, with every remainder of the four block loop */
+		int length = 16 * (1 + rand() % (MAX_LENGTH/16));
+
+		random_bytes(key, sizeof(key));
+		random_bytes(iv, sizeof(iv));
+		random_bytes(plain, length);
+
+		AES_set_key(&ctx, key, iv, AES_MODE_128);
+		AES_cbc_encrypt(&ctx, plain, cipher, length);
+
+		AES_set_key(&ctx, key, iv, AES_MODE_128);
+		AES_convert_key(&ctx);
+		AES_cbc_decrypt(&ctx, cipher, out, length);
+
+		table_AES_set_key(&table_ctx, key, iv, AES_MODE_128);
+		table_AES_convert_key(&table_ctx);
+		table_AES_cbc_decrypt(&table_ctx, cipher, ref, length);
+
+		check(!memcmp(out, ref, length), "decrypt differs from tables", round, length);
+		check(!memcmp(ctx.iv, table_ctx.iv, 16), "chained IV differs from tables", round, length);
+		check(!memcmp(out, plain, length), "decrypt does not round trip", round, length);
+
+		/* raop_buffer decrypts into a separate buffer, in place must work too */
+		memcpy(ctx.iv, iv, 16);
+		memcpy(out, cipher, length);
+		AES_cbc_decrypt(&ctx, out, out, length);
+		check(!memcmp(out, plain, length), "in place decrypt", round, length);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	known_answer();
+	random_buffers();
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	printf("aes_kat: AES-NI %s\n", __builtin_cpu_supports("aes") ? "available" : "not available");
+#endif
+	printf("aes_kat: %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
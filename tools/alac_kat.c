@@ -0,0 +1,226 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Compares the ALAC adaptive FIR predictor with a copy of the scalar
+ * version it replaced, on random frames with 0 to 31 coefficients. The
+ * kernel picked at runtime, SSE4.1 for 8 and 16 coefficients when the CPU
+ * has it, and the C kernel are both run. Samples and the adapted
+ * coefficient table must come out bit for bit the same.
+ */
+
+#include "../lib/alac/alac.c"
+
+#define MAX_SAMPLES 4096
+#define ROUNDS      20000
+
+static int failures;
+
+/* predictor_decompress_fir_adapt as it was before the kernels were split out */
+static void reference_fir_adapt(int32_t *error_buffer,
+                                int32_t *buffer_out,
+                                int output_size,
+                                int readsamplesize,
+                                int16_t *predictor_coef_table,
+                                int predictor_coef_num,
+                                int predictor_quantitization)
+{
+    int i;
+
+    /* first sample always copies */
+    *buffer_out = *error_buffer;
+
+    if (!predictor_coef_num)
+    {
+        if (output_size <= 1) return;
+        memcpy(buffer_out+1, error_buffer+1, (output_size-1) * 4);
+        return;
+    }
+
+    if (predictor_coef_num == 0x1f)
+    {
+        if (output_size <= 1) return;
+        for (i = 0; i < output_size - 1; i++)
+        {
+            int32_t prev_value;
+            int32_t error_value;
+
+            prev_value = buffer_out[i];
+            error_value = error_buffer[i+1];
+            buffer_out[i+1] = SIGN_EXTENDED32((prev_value + error_value), readsamplesize);
+        }
+        return;
+    }
+
+    /* read warm-up samples */
+    for (i = 0; i < predictor_coef_num; i++)
+    {
+        int32_t val;
+
+        val = buffer_out[i] + error_buffer[i+1];
+        val = SIGN_EXTENDED32(val, readsamplesize);
+        buffer_out[i+1] = val;
+    }
+
+    /* general case */
+    for (i = predictor_coef_num + 1;
+         i < output_size;
+         i++)
+    {
+        int j;
+        int sum = 0;
+        int outval;
+        int error_val = error_buffer[i];
+
+        for (j = 0; j < predictor_coef_num; j++)
+        {
+            sum += (buffer_out[predictor_coef_num-j] - buffer_out[0]) *
+                   predictor_coef_table[j];
+        }
+
+        outval = (1 << (predictor_quantitization-1)) + sum;
+        outval = outval >> predictor_quantitization;
+        outval = outval + buffer_out[0] + error_val;
+        outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+        buffer_out[predictor_coef_num+1] = outval;
+
+        if (error_val > 0)
+        {
+            int predictor_num = predictor_coef_num - 1;
+
+            while (predictor_num >= 0 && error_val > 0)
+            {
+                int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+                int sign = SIGN_ONLY(val);
+
+                predictor_coef_table[predictor_num] -= sign;
+
+                val *= sign; /* absolute value */
+
+                error_val -= ((val >> predictor_quantitization) *
+                              (predictor_coef_num - predictor_num));
+
+                predictor_num--;
+            }
+        }
+        else if (error_val < 0)
+        {
+            int predictor_num = predictor_coef_num - 1;
+
+            while (predictor_num >= 0 && error_val < 0)
+            {
+                int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+                int sign = - SIGN_ONLY(val);
+
+                predictor_coef_table[predictor_num] -= sign;
+
+                val *= sign; /* neg value */
+
+                error_val -= ((val >> predictor_quantitization) *
+                              (predictor_coef_num - predictor_num));
+
+                predictor_num--;
+            }
+        }
+
+        buffer_out++;
+    }
+}
+
+static int
+random_range(int bits)
+{
+    /* signed value of up to bits bits, small ones are the common case */
+    int range = 1 << (1 + rand() % bits);
+
+    return rand() % range - range / 2;
+}
+
+static void
+check_kernel(alac_file *alac, const char *name, int round,
+             int32_t *error_buffer, int output_size, int readsamplesize,
+             const int16_t *coefs, int coef_num, int quantization)
+{
+    static int32_t expected[MAX_SAMPLES + 32], got[MAX_SAMPLES + 32];
+    int16_t expected_coefs[32], got_coefs[32];
+
+    memset(expected, 0x55, sizeof(expected));
+    memset(got, 0x55, sizeof(got));
+    memcpy(expected_coefs, coefs, sizeof(expected_coefs));
+    memcpy(got_coefs, coefs, sizeof(got_coefs));
+
+    reference_fir_adapt(error_buffer, expected, output_size, readsamplesize,
+                        expected_coefs, coef_num, quantization);
+    predictor_decompress_fir_adapt(alac, error_buffer, got, output_size, readsamplesize,
+                                   got_coefs, coef_num, quantization);
+
+    if (memcmp(expected, got, sizeof(expected)) ||
+        memcmp(expected_coefs, got_coefs, sizeof(expected_coefs)))
+    {
+        fprintf(stderr, "FAIL %s, round %d, %d coefficients, shift %d, %d bits, %d samples\n",
+                name, round, coef_num, quantization, readsamplesize, output_size);
+        failures++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static int32_t error_buffer[MAX_SAMPLES];
+    alac_file selected, scalar;
+    int16_t coefs[32];
+    int round, i;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+
+    memset(&selected, 0, sizeof(selected));
+    selected.numchannels = 2;
+    select_kernels(&selected);
+    memset(&scalar, 0, sizeof(scalar));
+    scalar.predictor_fir_adapt = predictor_fir_adapt_c;
+
+    for (round = 0; round < ROUNDS; round++)
+    {
+        /* 8 and 16 take the vector kernels, so they get extra rounds */
+        int coef_num = (round % 4 == 0) ? 8 : (round % 4 == 1) ? 16 : rand() % 32;
+        int quantization = 1 + rand() % 15;
+        int readsamplesize = (rand() % 2) ? 16 : 24 + rand() % 2;
+        int output_size = (rand() % 4) ? 352 : 1 + rand() % MAX_SAMPLES;
+
+        for (i = 0; i < 32; i++)
+            coefs[i] = (rand() % 8) ? random_range(12) : random_range(16);
+        for (i = 0; i < output_size; i++)
+            error_buffer[i] = random_range(readsamplesize);
+
+        check_kernel(&selected, "selected kernel", round, error_buffer, output_size,
+                     readsamplesize, coefs, coef_num, quantization);
+        check_kernel(&scalar, "C kernel", round, error_buffer, output_size,
+                     readsamplesize, coefs, coef_num, quantization);
+    }
+
+#ifdef ALAC_X86_SIMD
+    printf("alac_kat: SSE4.1 %s\n", __builtin_cpu_supports("sse4.1") ? "available" : "not available");
+#endif
+    printf("alac_kat: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,300 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of the raop_buffer calls the receive loop makes for every
+ * packet. The buffer is held at several fill levels while batches of AES
+ * encrypted ALAC packets are queued and raop_buffer_can_dequeue is polled,
+ * and the cost of each call is printed in nanoseconds and, on x86, in TSC
+ * cycles. Dequeueing is done between the timed sections and not counted.
+ *
+ * The packet decryption is timed on its own first, with the key schedule
+ * expanded once as raop_buffer does and expanded for every packet as it
+ * used to be.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "raop_buffer.h"
+#include "raop_metrics.h"
+#include "crypto/crypto.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#define read_cycles() __rdtsc()
+#else
+#define HAVE_CYCLES 0
+#define read_cycles() 0ULL
+#endif
+
+#define FRAMES      352
+#define BATCH       16
+#define POLLS       64
+#define MAX_PACKET  (12 + 16 + 4*FRAMES)
+
+static const char rtpmap[] = "96 AppleLossless";
+static const char fmtp[] = "96 352 0 16 40 10 14 2 255 0 0 44100";
+
+typedef struct {
+	unsigned char *buf;
+	int bits;
+} bitwriter_t;
+
+typedef struct {
+	uint64_t ns;
+	unsigned long long cycles;
+	unsigned long long calls;
+} timing_t;
+
+static void
+write_bits(bitwriter_t *bw, unsigned int value, int count)
+{
+	while (count--) {
+		if ((value >> count) & 1) {
+			bw->buf[bw->bits >> 3] |= 0x80 >> (bw->bits & 7);
+		}
+		bw->bits++;
+	}
+}
+
+/* An uncompressed stereo ALAC frame of noise, returns its length */
+static int
+encode_frame(unsigned char *out)
+{
+	bitwriter_t bw = { out, 0 };
+	int i;
+
+	memset(out, 0, (23 + FRAMES*32 + 7) / 8 + 1);
+	write_bits(&bw, 1, 3);      /* two channels */
+	write_bits(&bw, 0, 4);
+	write_bits(&bw, 0, 12);
+	write_bits(&bw, 0, 1);      /* no sample count, a full frame */
+	write_bits(&bw, 0, 2);
+	write_bits(&bw, 1, 1);      /* not compressed */
+	for (i=0; i<FRAMES; i++) {
+		write_bits(&bw, rand() & 0xffff, 16);
+		write_bits(&bw, rand() & 0xffff, 16);
+	}
+	write_bits(&bw, 7, 3);      /* end of frame */
+	return (bw.bits + 7) / 8;
+}
+
+static void
+set_header(unsigned char *packet, unsigned short seqnum)
+{
+	unsigned int timestamp = seqnum * FRAMES;
+
+	packet[2] = seqnum >> 8;
+	packet[3] = seqnum;
+	packet[4] = timestamp >> 24;
+	packet[5] = timestamp >> 16;
+	packet[6] = timestamp >> 8;
+	packet[7] = timestamp;
+}
+
+static void
+print_timing(const char *name, const timing_t *t)
+{
+	printf("  %-12s %8.1f ns", name, (double)t->ns / t->calls);
+	if (HAVE_CYCLES) {
+		printf(" %9.0f cycles", (double)t->cycles / t->calls);
+	}
+}
+
+static void
+run_decrypt(const unsigned char *packet, int packetlen, const unsigned char *aeskey,
+            const unsigned char *aesiv, int rounds)
+{
+	unsigned char output[MAX_PACKET];
+	int enclen = (packetlen - 12) / 16 * 16;
+	timing_t cached = { 0, 0, 0 }, per_packet = { 0, 0, 0 };
+	AES_CTX aes;
+	int i, j;
+
+	AES_set_key(&aes, aeskey, aesiv, AES_MODE_128);
+	AES_convert_key(&aes);
+	for (i=0; i<rounds; i++) {
+		uint64_t start;
+		unsigned long long cycles;
+
+		/* Current path, only the IV is reset per packet */
+		start = raop_metrics_now();
+		cycles = read_cycles();
+		for (j=0; j<BATCH; j++) {
+			memcpy(aes.iv, aesiv, 16);
+			AES_cbc_decrypt(&aes, packet+12, output, enclen);
+		}
+		cached.cycles += read_cycles() - cycles;
+		cached.ns += raop_metrics_now() - start;
+		cached.calls += BATCH;
+
+		/* Previous path, the key schedule is expanded for every packet */
+		start = raop_metrics_now();
+		cycles = read_cycles();
+		for (j=0; j<BATCH; j++) {
+			AES_CTX ctx;
+
+			AES_set_key(&ctx, aeskey, aesiv, AES_MODE_128);
+			AES_convert_key(&ctx);
+			AES_cbc_decrypt(&ctx, packet+12, output, enclen);
+		}
+		per_packet.cycles += read_cycles() - cycles;
+		per_packet.ns += raop_metrics_now() - start;
+		per_packet.calls += BATCH;
+	}
+
+	printf("# decrypt, cost per packet\n");
+	printf("%-11s", "");
+	print_timing("cached key", &cached);
+	print_timing("key/packet", &per_packet);
+	printf("\n");
+}
+
+static int
+run_level(unsigned char *packet, int packetlen, const unsigned char *aeskey,
+          const unsigned char *aesiv, int length, int lazy, int fill, int rounds)
+{
+	raop_buffer_t *buffer;
+	timing_t queue = { 0, 0, 0 }, poll = { 0, 0, 0 };
+	unsigned short seqnum = 0;
+	unsigned int timestamp;
+	volatile int sink = 0;
+	int i, j, len;
+
+	buffer = raop_buffer_init(rtpmap, fmtp, aeskey, aesiv, length, lazy);
+	if (!buffer) {
+		fprintf(stderr, "Could not create a buffer of %d packets\n", length);
+		return -1;
+	}
+
+	/* Keep fill-BATCH packets queued between the batches */
+	for (i=0; i<fill-BATCH; i++) {
+		set_header(packet, seqnum++);
+		raop_buffer_queue(buffer, packet, packetlen, 1);
+	}
+
+	for (i=0; i<rounds; i++) {
+		uint64_t start;
+		unsigned long long cycles;
+
+		start = raop_metrics_now();
+		cycles = read_cycles();
+		for (j=0; j<BATCH; j++) {
+			set_header(packet, seqnum++);
+			raop_buffer_queue(buffer, packet, packetlen, 1);
+		}
+		queue.cycles += read_cycles() - cycles;
+		queue.ns += raop_metrics_now() - start;
+		queue.calls += BATCH;
+
+		start = raop_metrics_now();
+		cycles = read_cycles();
+		for (j=0; j<POLLS; j++) {
+			sink += raop_buffer_can_dequeue(buffer);
+		}
+		poll.cycles += read_cycles() - cycles;
+		poll.ns += raop_metrics_now() - start;
+		poll.calls += POLLS;
+
+		for (j=0; j<BATCH; j++) {
+			raop_buffer_dequeue(buffer, &len, &timestamp, 1);
+		}
+	}
+	raop_buffer_destroy(buffer);
+
+	printf("%5d/%-5d", fill, length);
+	print_timing("queue", &queue);
+	print_timing("can_dequeue", &poll);
+	printf("\n");
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -n packets    buffer length, default %d\n"
+	        "  -r rounds     batches of %d packets per fill level, default 20000\n"
+	        "  -l            decode on dequeue instead of on queue\n",
+	        name, RAOP_BUFFER_DEFAULT_LENGTH, BATCH);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned char aeskey[16], aesiv[16];
+	unsigned char payload[MAX_PACKET], packet[MAX_PACKET];
+	int length = RAOP_BUFFER_DEFAULT_LENGTH, rounds = 20000, lazy = 0;
+	int len, enclen, level, i, opt;
+	AES_CTX aes;
+
+	while ((opt = getopt(argc, argv, "n:r:lh")) != -1) {
+		switch (opt) {
+		case 'n': length = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		case 'l': lazy = 1; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (!raop_buffer_valid_length(length) || length < BATCH || rounds < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	srand(1);
+	for (i=0; i<16; i++) {
+		aeskey[i] = rand();
+		aesiv[i] = rand();
+	}
+
+	/* Whole blocks are encrypted with the IV reset per packet, the tail stays clear */
+	memset(packet, 0, 12);
+	packet[0] = 0x80;
+	packet[1] = 0x60;
+	len = encode_frame(payload);
+	enclen = len / 16 * 16;
+	AES_set_key(&aes, aeskey, aesiv, AES_MODE_128);
+	AES_cbc_encrypt(&aes, payload, packet+12, enclen);
+	memcpy(packet+12+enclen, payload+enclen, len-enclen);
+
+	printf("# %d byte packets, %s decode\n", 12+len, lazy ? "lazy" : "eager");
+	run_decrypt(packet, 12+len, aeskey, aesiv, rounds);
+	printf("# fill/length, cost per call\n");
+	for (level=0; level<=4; level++) {
+		int fill = level ? length * level / 4 : BATCH;
+
+		if (fill < BATCH) {
+			continue;
+		}
+		if (run_level(packet, 12+len, aeskey, aesiv, length, lazy, fill, rounds) < 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
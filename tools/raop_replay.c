@@ -0,0 +1,206 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Plays a capture made with shairplay -c back through libshairplay. The
+ * RTSP requests go through the handlers and the packets into the buffer in
+ * the order they were received, either at the captured pace (-r) or as
+ * fast as possible, which makes it a throughput benchmark of the receive
+ * and decode path on real traffic.
+ *
+ * The decoded audio is summed into a checksum, so two runs over the same
+ * capture can be compared, and can be written out as raw PCM with -o.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <shairplay/raop.h>
+
+typedef struct {
+	FILE *output;
+	int sessions;
+	int samplerate;
+	int frame_bytes;
+	unsigned long long frames;
+	unsigned long long bytes;
+	uint32_t checksum;
+} replay_t;
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cpu_seconds(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void *
+audio_init(void *cls, int bits, int channels, int samplerate, int *audio_fd)
+{
+	replay_t *replay = cls;
+
+	replay->sessions++;
+	replay->samplerate = samplerate;
+	replay->frame_bytes = channels * bits / 8;
+	return replay;
+}
+
+static void
+audio_process(void *cls, void *session, const void *buffer, int buflen, unsigned int timestamp, unsigned int ltime)
+{
+	replay_t *replay = cls;
+	const unsigned char *data = buffer;
+	int i;
+
+	/* FNV-1a over the audio */
+	for (i=0; i<buflen; i++) {
+		replay->checksum = (replay->checksum ^ data[i]) * 16777619u;
+	}
+	replay->frames++;
+	replay->bytes += buflen;
+	if (replay->output) {
+		fwrite(buffer, 1, buflen, replay->output);
+	}
+}
+
+static void
+audio_destroy(void *cls, void *session)
+{
+}
+
+static void
+log_callback(void *cls, int level, const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options] capture\n"
+	        "  -k keyfile    private key of the capturing receiver, default airport.key\n"
+	        "  -r            replay at the captured pace instead of full speed\n"
+	        "  -o file       write the decoded audio as raw PCM\n"
+	        "  -n count      replay the capture count times, default 1\n"
+	        "  -v            print library debug messages\n",
+	        name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *keyfile = "airport.key";
+	const char *output = NULL;
+	raop_callbacks_t cbs;
+	raop_t *raop;
+	raop_metrics_t metrics;
+	replay_t replay;
+	int realtime = 0, verbose = 0, count = 1;
+	int records = 0, opt, i;
+	double start, cpu, wall, audio;
+
+	while ((opt = getopt(argc, argv, "k:ro:n:vh")) != -1) {
+		switch (opt) {
+		case 'k': keyfile = optarg; break;
+		case 'r': realtime = 1; break;
+		case 'o': output = optarg; break;
+		case 'n': count = atoi(optarg); break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind != argc-1 || count < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&replay, 0, sizeof(replay));
+	replay.checksum = 2166136261u;
+	if (output && !(replay.output = fopen(output, "wb"))) {
+		fprintf(stderr, "Could not open %s\n", output);
+		return 1;
+	}
+
+	memset(&cbs, 0, sizeof(cbs));
+	cbs.cls = &replay;
+	cbs.audio_init = audio_init;
+	cbs.audio_process = audio_process;
+	cbs.audio_destroy = audio_destroy;
+	raop = raop_init_from_keyfile(1, &cbs, keyfile, NULL);
+	if (!raop) {
+		fprintf(stderr, "Could not initialize with %s\n", keyfile);
+		return 1;
+	}
+	raop_set_log_callback(raop, log_callback, NULL);
+	raop_set_log_level(raop, verbose ? RAOP_LOG_DEBUG : RAOP_LOG_WARNING);
+
+	start = now_seconds();
+	cpu = cpu_seconds();
+	for (i=0; i<count; i++) {
+		int ret = raop_replay_file(raop, argv[optind], realtime);
+		if (ret < 0) {
+			fprintf(stderr, "Could not replay %s\n", argv[optind]);
+			raop_destroy(raop);
+			return 1;
+		}
+		records += ret;
+	}
+	wall = now_seconds() - start;
+	cpu = cpu_seconds() - cpu;
+	audio = (replay.samplerate && replay.frame_bytes) ?
+	        (double)replay.bytes / replay.frame_bytes / replay.samplerate : 0.0;
+
+	printf("%d records, %d sessions, %llu frames, %.1f s of audio\n",
+	       records, replay.sessions, replay.frames, audio);
+	printf("%.3f s wall, %.3f s cpu, %.1fx real time, %.0f frames/s\n",
+	       wall, cpu, wall > 0.0 ? audio / wall : 0.0, wall > 0.0 ? replay.frames / wall : 0.0);
+	printf("checksum %08x\n", replay.checksum);
+
+	raop_get_metrics(raop, &metrics);
+	printf("%llu packets, %llu lost, aes %.0f ns, decode %.0f ns per frame\n",
+	       metrics.packets_received, metrics.packets_lost,
+	       metrics.aes_time.count ? (double)metrics.aes_time.sum / metrics.aes_time.count : 0.0,
+	       metrics.decode_time.count ? (double)metrics.decode_time.sum / metrics.decode_time.count : 0.0);
+
+	raop_destroy(raop);
+	if (replay.output) {
+		fclose(replay.output);
+	}
+	return 0;
+}
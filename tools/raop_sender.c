@@ -0,0 +1,894 @@
+/**
+ *  Copyright (C) 2012-2013  Juho Vähä-Herttua
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining
+ *  a copy of this software and associated documentation files (the
+ *  "Software"), to deal in the Software without restriction, including
+ *  without limitation the rights to use, copy, modify, merge, publish,
+ *  distribute, sublicense, and/or sell copies of the Software, and to
+ *  permit persons to whom the Software is furnished to do so, subject to
+ *  the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included
+ *  in all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ *  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ *  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ *  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ *  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ *  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Synthetic RAOP sender for load tests. Every session does ANNOUNCE, SETUP,
+ * RECORD and SET_PARAMETER over RTSP, answers timing requests and resend
+ * requests, and streams an AES encrypted ALAC tone over UDP or TCP with
+ * optional loss and reordering.
+ *
+ * With -e the receiver runs in this process from libshairplay, so the
+ * end-to-end latency from the nominal send time of a frame to its delivery
+ * and the receiver CPU per stream are measured too. Sessions are started
+ * -i ms apart, and once a second a line reports the active sessions and
+ * how many of the sent frames were delivered.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <shairplay/raop.h>
+
+#include "rsakey.h"
+#include "base64.h"
+#include "utils.h"
+#include "crypto/crypto.h"
+
+#define SAMPLE_RATE   44100
+#define HISTORY       1024
+#define MAX_PACKET    (12 + 16 + 4*4096)
+#define NTP_EPOCH     0x83aa7e80ull
+
+typedef struct {
+	const char *host;
+	unsigned short port;
+	const char *keyfile;
+	int sessions;
+	int interval_ms;
+	int duration;
+	int frames;
+	int latency;
+	double speed;
+	double loss;
+	double reorder;
+	int tcp;
+	int embedded;
+	int workers;
+	const char *capture;
+	int verbose;
+} config_t;
+
+typedef struct {
+	unsigned short len;
+	unsigned char data[MAX_PACKET];
+} packet_t;
+
+typedef struct session_s {
+	int index;
+	pthread_t thread;
+
+	int rtsp;
+	int cseq;
+	char url[64];
+	char session[64];
+
+	int data, control, timing;
+	struct sockaddr_in data_addr, control_addr;
+
+	unsigned char aeskey[16];
+	unsigned char aesiv[16];
+	AES_CTX aes;
+
+	unsigned short seqnum;
+	packet_t *history;
+
+	/* Counters, read by the reporting thread */
+	volatile int streaming;
+	volatile unsigned long long sent, dropped, resent, failed;
+	volatile double cpu;
+} session_t;
+
+static config_t config = {
+	.host = "127.0.0.1",
+	.port = 5000,
+	.keyfile = "airport.key",
+	.sessions = 1,
+	.interval_ms = 1000,
+	.duration = 10,
+	.frames = 352,
+	.latency = 11025,
+	.speed = 1.0,
+};
+
+static volatile int running = 1;
+static char *pemstr;
+
+/* All sessions timestamp against the same epoch, so a timestamp tells the
+ * nominal send time of its frame without looking anything up */
+static uint64_t epoch;
+
+/* Filled by the in-process receiver */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long played, concealed;
+static double latency_sum, latency_max, latency_min = 1e9;
+static int receivers;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double
+thread_cpu(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+process_cpu(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static uint64_t
+ntp_time(uint64_t ns)
+{
+	uint64_t sec = ns / 1000000000ull;
+	uint64_t frac = ((ns % 1000000000ull) << 32) / 1000000000ull;
+	return ((sec + NTP_EPOCH) << 32) | frac;
+}
+
+static void
+put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8; p[1] = v;
+}
+
+static void
+put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void
+put64(unsigned char *p, uint64_t v)
+{
+	put32(p, v >> 32);
+	put32(p+4, v);
+}
+
+/* Timestamp of the frame nominally sent at ns */
+static unsigned int
+rtp_time(uint64_t ns)
+{
+	return (unsigned int)((double)(ns - epoch) * config.speed * SAMPLE_RATE / 1e9);
+}
+
+static uint64_t
+nominal_time(unsigned int timestamp)
+{
+	return epoch + (uint64_t)(timestamp / (config.speed * SAMPLE_RATE) * 1e9);
+}
+
+
+/* --- audio ------------------------------------------------------------ */
+
+typedef struct {
+	unsigned char *buf;
+	int bits;
+} bitwriter_t;
+
+static void
+write_bits(bitwriter_t *bw, unsigned int value, int count)
+{
+	while (count--) {
+		int bit = (value >> count) & 1;
+		if (bit) {
+			bw->buf[bw->bits >> 3] |= 0x80 >> (bw->bits & 7);
+		}
+		bw->bits++;
+	}
+}
+
+/* An uncompressed stereo ALAC frame of a tone, returns its length */
+static int
+encode_frame(unsigned char *out, unsigned int timestamp, int frames)
+{
+	bitwriter_t bw = { out, 0 };
+	int i;
+
+	memset(out, 0, (23 + frames*32 + 7) / 8 + 1);
+	write_bits(&bw, 1, 3);      /* two channels */
+	write_bits(&bw, 0, 4);
+	write_bits(&bw, 0, 12);
+	write_bits(&bw, 0, 1);      /* no sample count, a full frame */
+	write_bits(&bw, 0, 2);
+	write_bits(&bw, 1, 1);      /* not compressed */
+	for (i=0; i<frames; i++) {
+		double t = (double)(timestamp + i) / SAMPLE_RATE;
+		short left = 8000 * sin(2*M_PI*440.0*t);
+		short right = 8000 * sin(2*M_PI*660.0*t);
+		write_bits(&bw, (unsigned short)left, 16);
+		write_bits(&bw, (unsigned short)right, 16);
+	}
+	write_bits(&bw, 7, 3);      /* end of frame */
+	return (bw.bits + 7) / 8;
+}
+
+static packet_t *
+build_packet(session_t *s, unsigned int timestamp, int first)
+{
+	packet_t *pkt = &s->history[s->seqnum % HISTORY];
+	unsigned char payload[MAX_PACKET];
+	int len, enclen;
+
+	pkt->data[0] = 0x80;
+	pkt->data[1] = first ? 0xe0 : 0x60;
+	put16(pkt->data+2, s->seqnum);
+	put32(pkt->data+4, timestamp);
+	put32(pkt->data+8, s->index + 1);
+
+	/* Whole blocks are encrypted with the IV reset per packet, the tail stays clear */
+	len = encode_frame(payload, timestamp, config.frames);
+	enclen = len / 16 * 16;
+	memcpy(s->aes.iv, s->aesiv, 16);
+	AES_cbc_encrypt(&s->aes, payload, pkt->data+12, enclen);
+	memcpy(pkt->data+12+enclen, payload+enclen, len-enclen);
+	pkt->len = 12 + len;
+	s->seqnum++;
+	return pkt;
+}
+
+
+/* --- rtsp ------------------------------------------------------------- */
+
+/* Sends a request and reads the response headers into buf, returns the status */
+static int
+rtsp_request(session_t *s, const char *method, const char *headers,
+             const char *type, const char *body, char *buf, int buflen)
+{
+	char req[4096];
+	int len, pos = 0, status = -1, bodylen = 0;
+	char *end;
+
+	len = snprintf(req, sizeof(req),
+	               "%s %s RTSP/1.0\r\nCSeq: %d\r\n%s%s%s%s"
+	               "User-Agent: raop_sender\r\nClient-Instance: %016X\r\n",
+	               method, s->url, ++s->cseq, headers,
+	               s->session[0] ? "Session: " : "", s->session, s->session[0] ? "\r\n" : "",
+	               s->index + 1);
+	if (body) {
+		len += snprintf(req+len, sizeof(req)-len, "Content-Type: %s\r\nContent-Length: %d\r\n",
+		                type, (int)strlen(body));
+	}
+	len += snprintf(req+len, sizeof(req)-len, "\r\n%s", body ? body : "");
+	if (send(s->rtsp, req, len, 0) != len) {
+		return -1;
+	}
+
+	while (pos < buflen-1) {
+		int ret = recv(s->rtsp, buf+pos, buflen-1-pos, 0);
+		if (ret <= 0) {
+			return -1;
+		}
+		pos += ret;
+		buf[pos] = '\0';
+		if ((end = strstr(buf, "\r\n\r\n"))) {
+			break;
+		}
+	}
+	if (!end || sscanf(buf, "RTSP/1.0 %d", &status) != 1) {
+		return -1;
+	}
+
+	/* Skip any body, nothing in it is needed */
+	const char *cl = strcasestr(buf, "Content-Length:");
+	if (cl) {
+		bodylen = atoi(cl + 15) - (int)(buf + pos - (end + 4));
+	}
+	while (bodylen > 0) {
+		char skip[1024];
+		int ret = recv(s->rtsp, skip, bodylen < sizeof(skip) ? bodylen : sizeof(skip), 0);
+		if (ret <= 0) {
+			return -1;
+		}
+		bodylen -= ret;
+	}
+	*end = '\0';
+	return status;
+}
+
+static int
+udp_socket(unsigned short *port)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	*port = ntohs(addr.sin_port);
+	return fd;
+}
+
+static int
+session_setup(session_t *s)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	rsakey_t *rsakey;
+	base64_t *base64;
+	char local[INET_ADDRSTRLEN];
+	char rsaaeskey[1024], aesiv[64];
+	char sdp[2048], headers[512], buf[4096];
+	unsigned short cport = 0, tport = 0;
+	const char *transport;
+	int i, one = 1;
+
+	s->rtsp = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(config.port);
+	inet_pton(AF_INET, config.host, &addr.sin_addr);
+	if (s->rtsp < 0 || connect(s->rtsp, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "session %d: connect failed: %s\n", s->index, strerror(errno));
+		return -1;
+	}
+	setsockopt(s->rtsp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	getsockname(s->rtsp, (struct sockaddr *)&addr, &addrlen);
+	inet_ntop(AF_INET, &addr.sin_addr, local, sizeof(local));
+	snprintf(s->url, sizeof(s->url), "rtsp://%s/%u", local, 1000000 + s->index);
+
+	/* The session key goes to the receiver encrypted with its public key */
+	for (i=0; i<16; i++) {
+		s->aeskey[i] = rand();
+		s->aesiv[i] = rand();
+	}
+	AES_set_key(&s->aes, s->aeskey, s->aesiv, AES_MODE_128);
+	rsakey = rsakey_init_pem(pemstr);
+	base64 = base64_init(NULL, 0, 0);
+	if (!rsakey || !base64 || rsakey_encrypt(rsakey, rsaaeskey, sizeof(rsaaeskey), s->aeskey, 16) < 0) {
+		fprintf(stderr, "session %d: could not encrypt the session key\n", s->index);
+		rsakey_destroy(rsakey);
+		base64_destroy(base64);
+		return -1;
+	}
+	base64_encode(base64, aesiv, s->aesiv, 16);
+	rsakey_destroy(rsakey);
+	base64_destroy(base64);
+
+	snprintf(sdp, sizeof(sdp),
+	         "v=0\r\no=raop_sender %d 0 IN IP4 %s\r\ns=raop_sender\r\nc=IN IP4 %s\r\nt=0 0\r\n"
+	         "m=audio 0 RTP/AVP 96\r\na=rtpmap:96 AppleLossless\r\n"
+	         "a=fmtp:96 %d 0 16 40 10 14 2 255 0 0 %d\r\n"
+	         "a=rsaaeskey:%s\r\na=aesiv:%s\r\na=min-latency:%d\r\n",
+	         s->index, local, local, config.frames, SAMPLE_RATE, rsaaeskey, aesiv, config.latency);
+	if (rtsp_request(s, "ANNOUNCE", "", "application/sdp", sdp, buf, sizeof(buf)) != 200) {
+		fprintf(stderr, "session %d: ANNOUNCE refused\n", s->index);
+		return -1;
+	}
+
+	if (config.tcp) {
+		snprintf(headers, sizeof(headers), "Transport: RTP/AVP/TCP;unicast;interleaved=0-1;mode=record\r\n");
+	} else {
+		s->control = udp_socket(&cport);
+		s->timing = udp_socket(&tport);
+		if (s->control < 0 || s->timing < 0) {
+			return -1;
+		}
+		snprintf(headers, sizeof(headers),
+		         "Transport: RTP/AVP/UDP;unicast;interleaved=0-1;mode=record;control_port=%u;timing_port=%u\r\n",
+		         cport, tport);
+	}
+	if (rtsp_request(s, "SETUP", headers, NULL, NULL, buf, sizeof(buf)) != 200 ||
+	    !(transport = strcasestr(buf, "Transport:"))) {
+		fprintf(stderr, "session %d: SETUP refused\n", s->index);
+		return -1;
+	}
+	strcpy(s->session, "DEADBEEF");
+
+	/* Pick the receiver ports out of the transport */
+	memset(&s->data_addr, 0, sizeof(s->data_addr));
+	s->data_addr.sin_family = AF_INET;
+	inet_pton(AF_INET, config.host, &s->data_addr.sin_addr);
+	s->control_addr = s->data_addr;
+	const char *value;
+	if ((value = strstr(transport, "server_port=")))
+		s->data_addr.sin_port = htons(atoi(value + 12));
+	if ((value = strstr(transport, "control_port=")))
+		s->control_addr.sin_port = htons(atoi(value + 13));
+	if (!s->data_addr.sin_port) {
+		fprintf(stderr, "session %d: no server port in %s\n", s->index, transport);
+		return -1;
+	}
+
+	if (config.tcp) {
+		s->data = socket(AF_INET, SOCK_STREAM, 0);
+		if (s->data < 0 || connect(s->data, (struct sockaddr *)&s->data_addr, sizeof(s->data_addr)) < 0) {
+			fprintf(stderr, "session %d: stream connect failed: %s\n", s->index, strerror(errno));
+			return -1;
+		}
+		setsockopt(s->data, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	} else {
+		s->data = socket(AF_INET, SOCK_DGRAM, 0);
+	}
+
+	s->seqnum = rand();
+	snprintf(headers, sizeof(headers), "Range: npt=0-\r\nRTP-Info: seq=%u;rtptime=%u\r\n",
+	         s->seqnum, rtp_time(now_ns()));
+	if (rtsp_request(s, "RECORD", headers, NULL, NULL, buf, sizeof(buf)) != 200) {
+		fprintf(stderr, "session %d: RECORD refused\n", s->index);
+		return -1;
+	}
+	if (rtsp_request(s, "SET_PARAMETER", "", "text/parameters", "volume: -15.000000\r\n", buf, sizeof(buf)) != 200) {
+		fprintf(stderr, "session %d: SET_PARAMETER refused\n", s->index);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* --- streaming -------------------------------------------------------- */
+
+static void
+send_packet(session_t *s, const packet_t *pkt)
+{
+	int ret;
+
+	if (config.tcp) {
+		unsigned char frame[4 + MAX_PACKET];
+		frame[0] = '$';
+		frame[1] = 0;
+		put16(frame+2, pkt->len);
+		memcpy(frame+4, pkt->data, pkt->len);
+		ret = send(s->data, frame, 4 + pkt->len, 0);
+	} else {
+		ret = sendto(s->data, pkt->data, pkt->len, 0, (struct sockaddr *)&s->data_addr, sizeof(s->data_addr));
+	}
+	if (ret < 0) {
+		s->failed++;
+	} else {
+		s->sent++;
+	}
+}
+
+static void
+send_sync(session_t *s, uint64_t now, int first)
+{
+	unsigned char pkt[20];
+	unsigned int current = rtp_time(now);
+
+	pkt[0] = first ? 0x90 : 0x80;
+	pkt[1] = 0xd4;
+	put16(pkt+2, 7);
+	put32(pkt+4, current - config.latency);
+	put64(pkt+8, ntp_time(now));
+	put32(pkt+16, current);
+	sendto(s->control, pkt, sizeof(pkt), 0, (struct sockaddr *)&s->control_addr, sizeof(s->control_addr));
+}
+
+static void
+handle_timing(session_t *s)
+{
+	unsigned char req[64], rep[32];
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int len = recvfrom(s->timing, req, sizeof(req), 0, (struct sockaddr *)&addr, &addrlen);
+	uint64_t now = ntp_time(now_ns());
+
+	if (len < 32 || (req[1] & 0x7f) != 0x52) {
+		return;
+	}
+	memset(rep, 0, sizeof(rep));
+	rep[0] = 0x80;
+	rep[1] = 0xd3;
+	memcpy(rep+2, req+2, 2);
+	memcpy(rep+8, req+24, 8);
+	put64(rep+16, now);
+	put64(rep+24, now);
+	sendto(s->timing, rep, sizeof(rep), 0, (struct sockaddr *)&addr, addrlen);
+}
+
+static void
+handle_control(session_t *s)
+{
+	unsigned char req[64], rep[4 + MAX_PACKET];
+	int len = recv(s->control, req, sizeof(req), 0);
+	unsigned short seqnum, count;
+
+	if (len < 8 || (req[1] & 0x7f) != 0x55) {
+		return;
+	}
+	seqnum = (req[4] << 8) | req[5];
+	count = (req[6] << 8) | req[7];
+	while (count-- > 0 && (unsigned short)(s->seqnum - seqnum) <= HISTORY) {
+		const packet_t *pkt = &s->history[seqnum % HISTORY];
+
+		rep[0] = 0x80;
+		rep[1] = 0xd6;
+		put16(rep+2, seqnum);
+		memcpy(rep+4, pkt->data, pkt->len);
+		sendto(s->control, rep, 4 + pkt->len, 0, (struct sockaddr *)&s->control_addr, sizeof(s->control_addr));
+		s->resent++;
+		seqnum++;
+	}
+}
+
+static void *
+session_thread(void *arg)
+{
+	session_t *s = arg;
+	uint64_t frame_ns = (uint64_t)(config.frames * 1e9 / (config.speed * SAMPLE_RATE));
+	uint64_t start, next, next_sync, end;
+	packet_t *held = NULL;
+	double cpu_start = thread_cpu();
+	int first = 1;
+	char buf[1024];
+
+	s->history = calloc(HISTORY, sizeof(packet_t));
+	if (!s->history || session_setup(s) < 0) {
+		s->streaming = -1;
+		return NULL;
+	}
+
+	start = now_ns();
+	next = start;
+	next_sync = start;
+	end = start + (uint64_t)config.duration * 1000000000ull;
+	s->streaming = 1;
+	while (running && next < end) {
+		struct pollfd pfd[2];
+		uint64_t now = now_ns();
+		int nfds = 0;
+
+		if (!config.tcp && now >= next_sync) {
+			send_sync(s, now, first);
+			next_sync += 1000000000ull;
+		}
+		if (now >= next) {
+			/* Frames are stamped with their nominal send time */
+			packet_t *pkt = build_packet(s, rtp_time(next), first);
+			first = 0;
+			next += frame_ns;
+
+			if (!config.tcp && drand48() * 100.0 < config.loss) {
+				s->dropped++;
+			} else if (!config.tcp && !held && drand48() * 100.0 < config.reorder) {
+				held = pkt;
+			} else {
+				send_packet(s, pkt);
+				if (held) {
+					send_packet(s, held);
+					held = NULL;
+				}
+			}
+			s->cpu = thread_cpu() - cpu_start;
+			continue;
+		}
+
+		if (!config.tcp) {
+			pfd[nfds].fd = s->control;
+			pfd[nfds++].events = POLLIN;
+			pfd[nfds].fd = s->timing;
+			pfd[nfds++].events = POLLIN;
+		}
+		if (poll(pfd, nfds, (next - now) / 1000000) > 0) {
+			if (pfd[0].revents & POLLIN)
+				handle_control(s);
+			if (pfd[1].revents & POLLIN)
+				handle_timing(s);
+		}
+	}
+	s->streaming = 0;
+	s->cpu = thread_cpu() - cpu_start;
+
+	rtsp_request(s, "TEARDOWN", "", NULL, NULL, buf, sizeof(buf));
+	return NULL;
+}
+
+
+/* --- in-process receiver ---------------------------------------------- */
+
+static void *
+recv_init(void *cls, int bits, int channels, int samplerate, int *audio_fd)
+{
+	pthread_mutex_lock(&stats_mutex);
+	receivers++;
+	pthread_mutex_unlock(&stats_mutex);
+	return NULL;
+}
+
+static void
+recv_process(void *cls, void *session, const void *buffer, int buflen, unsigned int timestamp, unsigned int ltime)
+{
+	uint64_t now = now_ns();
+
+	pthread_mutex_lock(&stats_mutex);
+	if (timestamp == 0) {
+		/* Concealed frames carry no timestamp */
+		concealed++;
+	} else {
+		double latency = ((double)now - (double)nominal_time(timestamp)) / 1e6;
+		played++;
+		latency_sum += latency;
+		if (latency > latency_max) latency_max = latency;
+		if (latency < latency_min) latency_min = latency;
+	}
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+static void
+recv_destroy(void *cls, void *session)
+{
+	pthread_mutex_lock(&stats_mutex);
+	receivers--;
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+static void
+recv_log(void *cls, int level, const char *msg)
+{
+	if (config.verbose || level <= RAOP_LOG_WARNING)
+		fprintf(stderr, "receiver: %s\n", msg);
+}
+
+
+/* --- main ------------------------------------------------------------- */
+
+static void
+signal_handler(int sig)
+{
+	running = 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -e            run the receiver in this process and measure latency\n"
+	        "  -a host       receiver address, default 127.0.0.1\n"
+	        "  -p port       receiver RTSP port, default 5000, any free one with -e\n"
+	        "  -k keyfile    receiver private key, default airport.key\n"
+	        "  -n sessions   concurrent sessions, default 1\n"
+	        "  -i ms         delay between session starts, default 1000\n"
+	        "  -t seconds    streaming time of each session, default 10\n"
+	        "  -f frames     frames per packet, default 352\n"
+	        "  -L frames     sender latency, default 11025\n"
+	        "  -s speed      send rate relative to real time, default 1.0\n"
+	        "  -l percent    packets dropped before sending\n"
+	        "  -r percent    packets swapped with the next one\n"
+	        "  -T            stream over TCP instead of UDP\n"
+	        "  -w workers    receiver worker threads with -e, -1 for one per core\n"
+	        "  -c file       capture the receiver traffic with -e, see raop_replay\n"
+	        "  -v            print receiver debug messages\n",
+	        name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	raop_t *raop = NULL;
+	session_t *sessions;
+	unsigned long long last_sent = 0, last_played = 0;
+	double last_cpu = 0.0, last_sender_cpu = 0.0, last_latency = 0.0, wall;
+	uint64_t start, next_start, next_report;
+	int started = 0, active, i, opt;
+	int best = 0;
+
+	while ((opt = getopt(argc, argv, "ea:p:k:n:i:t:f:L:s:l:r:Tw:c:vh")) != -1) {
+		switch (opt) {
+		case 'e': config.embedded = 1; break;
+		case 'a': config.host = optarg; break;
+		case 'p': config.port = atoi(optarg); break;
+		case 'k': config.keyfile = optarg; break;
+		case 'n': config.sessions = atoi(optarg); break;
+		case 'i': config.interval_ms = atoi(optarg); break;
+		case 't': config.duration = atoi(optarg); break;
+		case 'f': config.frames = atoi(optarg); break;
+		case 'L': config.latency = atoi(optarg); break;
+		case 's': config.speed = atof(optarg); break;
+		case 'l': config.loss = atof(optarg); break;
+		case 'r': config.reorder = atof(optarg); break;
+		case 'T': config.tcp = 1; break;
+		case 'w': config.workers = atoi(optarg); break;
+		case 'c': config.capture = optarg; break;
+		case 'v': config.verbose = 1; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (config.sessions < 1 || config.frames < 1 || config.frames > 4096 || config.speed <= 0.0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (utils_read_file(&pemstr, config.keyfile) < 0) {
+		fprintf(stderr, "Could not read %s\n", config.keyfile);
+		return 1;
+	}
+	signal(SIGINT, signal_handler);
+	signal(SIGPIPE, SIG_IGN);
+	srand48(getpid());
+	srand(getpid());
+
+	if (config.embedded) {
+		raop_callbacks_t cbs;
+		char hwaddr[] = { 0x48, 0x5d, 0x60, 0x7c, 0xee, 0x23 };
+
+		/* The library accepts at most 99 clients per instance */
+		if (config.sessions > 99) {
+			fprintf(stderr, "At most 99 sessions with -e\n");
+			return 1;
+		}
+		memset(&cbs, 0, sizeof(cbs));
+		cbs.audio_init = recv_init;
+		cbs.audio_process = recv_process;
+		cbs.audio_destroy = recv_destroy;
+		raop = raop_init(config.sessions, &cbs, pemstr, NULL);
+		if (!raop) {
+			fprintf(stderr, "Could not initialize the receiver\n");
+			return 1;
+		}
+		raop_set_log_callback(raop, recv_log, NULL);
+		raop_set_log_level(raop, config.verbose ? RAOP_LOG_DEBUG : RAOP_LOG_WARNING);
+		raop_set_worker_threads(raop, config.workers);
+		if (config.capture && raop_set_capture_file(raop, config.capture) < 0) {
+			fprintf(stderr, "Could not open %s\n", config.capture);
+			return 1;
+		}
+		if (config.port == 5000)
+			config.port = 0;
+		if (raop_start(raop, &config.port, hwaddr, sizeof(hwaddr), NULL) < 0) {
+			fprintf(stderr, "Could not start the receiver\n");
+			return 1;
+		}
+	}
+
+	sessions = calloc(config.sessions, sizeof(session_t));
+	epoch = now_ns() - 1000000000ull;
+	start = now_ns();
+	next_start = start;
+	next_report = start + 1000000000ull;
+
+	printf("# %d %s sessions to %s:%u, %d frames per packet, %.1f%% loss, %.1f%% reordered\n",
+	       config.sessions, config.tcp ? "TCP" : "UDP", config.host, config.port,
+	       config.frames, config.loss, config.reorder);
+	printf("# time  sessions  packets/s  played/s  delivered  latency ms avg/min/max  cpu%% sender/receiver per stream\n");
+	while (running) {
+		uint64_t now = now_ns();
+		unsigned long long sent = 0;
+		double sender_cpu = 0.0;
+		int done = 1;
+
+		if (started < config.sessions && now >= next_start) {
+			session_t *s = &sessions[started];
+			s->index = started++;
+			pthread_create(&s->thread, NULL, session_thread, s);
+			next_start += (uint64_t)config.interval_ms * 1000000ull;
+		}
+
+		active = 0;
+		for (i=0; i<started; i++) {
+			sent += sessions[i].sent + sessions[i].dropped;
+			sender_cpu += sessions[i].cpu;
+			active += (sessions[i].streaming == 1);
+			done &= (sessions[i].streaming != 1 && sessions[i].thread);
+		}
+		if (started == config.sessions && done) {
+			break;
+		}
+
+		if (now >= next_report) {
+			double cpu = process_cpu();
+			unsigned long long nplayed;
+			double avg, lmin, lmax, delivered, scpu, rcpu;
+
+			pthread_mutex_lock(&stats_mutex);
+			nplayed = played;
+			avg = (played > last_played) ? (latency_sum - last_latency) / (played - last_played) : 0.0;
+			last_latency = latency_sum;
+			lmin = latency_min;
+			lmax = latency_max;
+			latency_max = 0.0;
+			latency_min = 1e9;
+			pthread_mutex_unlock(&stats_mutex);
+
+			/* Per stream and per second, the receiver is whatever the senders did not use */
+			scpu = active ? 100.0 * (sender_cpu - last_sender_cpu) / active : 0.0;
+			rcpu = active ? 100.0 * ((cpu - last_cpu) - (sender_cpu - last_sender_cpu)) / active : 0.0;
+			delivered = (sent > last_sent) ? 100.0 * (nplayed - last_played) / (sent - last_sent) : 0.0;
+			printf("%6.0f  %8d  %6llu", (now - start) / 1e9, active, sent - last_sent);
+			if (config.embedded) {
+				printf("  %8llu  %8.1f%%  %7.1f/%.1f/%.1f  %5.2f/%.2f\n", nplayed - last_played, delivered,
+				       avg, lmin < 1e9 ? lmin : 0.0, lmax, scpu, rcpu);
+				/* Most sessions that were all delivered to within a percent */
+				if (delivered >= 99.0 && active > best)
+					best = active;
+			} else {
+				printf("  %5.2f\n", scpu);
+			}
+			fflush(stdout);
+			last_sent = sent;
+			last_played = nplayed;
+			last_cpu = cpu;
+			last_sender_cpu = sender_cpu;
+			next_report += 1000000000ull;
+		}
+		usleep(10000);
+	}
+
+	wall = (now_ns() - start) / 1e9;
+	for (i=0; i<started; i++) {
+		session_t *s = &sessions[i];
+		pthread_join(s->thread, NULL);
+		if (s->streaming < 0) {
+			printf("# session %d failed to start\n", i);
+		} else if (config.verbose) {
+			printf("# session %d: sent %llu, dropped %llu, resent %llu, send errors %llu\n",
+			       i, s->sent, s->dropped, s->resent, s->failed);
+		}
+	}
+	if (config.embedded) {
+		raop_metrics_t m;
+
+		raop_stop(raop);
+		raop_get_metrics(raop, &m);
+		raop_destroy(raop);
+		printf("# receiver: %llu packets, %llu resent, %llu late, %llu duplicate, %llu lost, %llu wakeups\n",
+		       m.packets_received, m.packets_resent, m.packets_late, m.packets_duplicate,
+		       m.packets_lost, m.wakeups);
+		printf("# receiver: resample ratio %.9f, playout error %lld us\n",
+		       m.resample_ratio / 1e9, m.resample_error);
+		printf("# receiver: %llu receive calls for %llu packets\n", m.recv_calls, m.recv_packets);
+		printf("# receiver: aes %.0f ns, decode %.0f ns, callback %.0f ns per frame\n",
+		       m.aes_time.count ? (double)m.aes_time.sum / m.aes_time.count : 0.0,
+		       m.decode_time.count ? (double)m.decode_time.sum / m.decode_time.count : 0.0,
+		       m.callback_time.count ? (double)m.callback_time.sum / m.callback_time.count : 0.0);
+		printf("# played %llu frames, %llu concealed, mean latency %.1f ms, "
+		       "%d sessions fully delivered, %.1f s cpu over %.1f s\n",
+		       played, concealed, played ? latency_sum / played : 0.0,
+		       best, process_cpu(), wall);
+	}
+	free(sessions);
+	free(pemstr);
+	return 0;
+}